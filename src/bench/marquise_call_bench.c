@@ -0,0 +1,350 @@
+/* Per-call latency of the hot paths: sending simple points, sending
+ * extended points of several sizes, updating sources at several cache
+ * hit ratios, hashing identifiers and rotating spool files.
+ *
+ * Usage: marquise_call_bench [calls]
+ *
+ * Each benchmark prints one line of key=value pairs: throughput over
+ * the whole run and the p50, p99, p999 and maximum latency of a single
+ * call in nanoseconds. The spool goes to MARQUISE_SPOOL_DIR if set,
+ * otherwise /dev/shm (so it's tmpfs, and we measure the library rather
+ * than the disk) or /tmp if there's no /dev/shm.
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "../marquise.h"
+
+#define BENCH_ADDRESS   1234567890999999999
+#define BENCH_TIMESTAMP 1405392588999999999
+#define BENCH_CALLS     1000000
+/* Updating sources allocates one per call up front, so fewer of them. */
+#define BENCH_SOURCES   100000
+/* Big enough values that every sixteenth call or so rotates. */
+#define BENCH_ROTATE_VALUE_LEN (64 * 1024)
+#define BENCH_ROTATE_CALLS 2000
+/* Don't fill the spool dir (often tmpfs, so memory) past this in one
+ * benchmark. */
+#define BENCH_SPOOL_BYTES (256 * 1024 * 1024)
+
+const char *spool_dir;
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* The latency below which the given fraction of the sorted samples
+ * fall. */
+uint64_t percentile(const uint64_t *sorted, size_t n, double fraction) {
+	size_t i = (size_t)(fraction * n);
+	return sorted[i < n ? i : n - 1];
+}
+
+/* Print a result line. Sorts the latencies. elapsed_ns covers all the
+ * calls, including any not sampled (as with rotation, where only the
+ * calls that rotated are). */
+void report(const char *bench, const char *params, size_t calls, uint64_t elapsed_ns, uint64_t *latencies, size_t n) {
+	if (n == 0) {
+		printf("bench=%s%s%s calls=%zu samples=0\n", bench, params[0] ? " " : "", params, calls);
+		return;
+	}
+	qsort(latencies, n, sizeof(uint64_t), compare_u64);
+	double seconds = elapsed_ns / 1e9;
+	printf("bench=%s%s%s calls=%zu samples=%zu seconds=%.3f calls_per_sec=%.0f "
+	       "p50_ns=%lu p99_ns=%lu p999_ns=%lu max_ns=%lu\n",
+	       bench, params[0] ? " " : "", params, calls, n, seconds, calls / seconds,
+	       percentile(latencies, n, 0.5), percentile(latencies, n, 0.99),
+	       percentile(latencies, n, 0.999), latencies[n - 1]);
+	fflush(stdout);
+}
+
+marquise_ctx *bench_init(const char *bench) {
+	marquise_ctx *ctx = marquise_init("marquisebench");
+	if (ctx == NULL) {
+		printf("marquise_init failed for %s: %s\n", bench, strerror(errno));
+	}
+	return ctx;
+}
+
+/* Remove the benchmark's spool files of the given type. */
+void clean_spool(const char *spool_type) {
+	char dir[4096];
+	char path[4096 + 256];
+	snprintf(dir, sizeof(dir), "%s/marquisebench/%s/new", spool_dir, spool_type);
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+			unlink(path);
+		}
+	}
+	closedir(d);
+}
+
+/* Shut down and throw away what was written, so the benchmarks don't
+ * fill the spool dir between them. */
+int bench_shutdown(marquise_ctx *ctx, const char *bench) {
+	int ret = marquise_shutdown(ctx);
+	if (ret != 0) {
+		printf("marquise_shutdown failed for %s: %s\n", bench, strerror(errno));
+	}
+	clean_spool("points");
+	clean_spool("contents");
+	return ret == 0 ? 0 : -1;
+}
+
+/* The cost of taking the time, which every sample below includes. */
+int bench_timer(uint64_t *latencies, size_t calls) {
+	size_t i;
+	uint64_t start = now_ns();
+	for (i = 0; i < calls; i++) {
+		uint64_t t0 = now_ns();
+		latencies[i] = now_ns() - t0;
+	}
+	report("timer", "", calls, now_ns() - start, latencies, calls);
+	return 0;
+}
+
+int bench_send_simple(uint64_t *latencies, size_t calls) {
+	size_t i;
+	marquise_ctx *ctx = bench_init("send_simple");
+	if (ctx == NULL) {
+		return -1;
+	}
+	uint64_t start = now_ns();
+	for (i = 0; i < calls; i++) {
+		uint64_t t0 = now_ns();
+		int ret = marquise_send_simple(ctx, BENCH_ADDRESS, BENCH_TIMESTAMP + i, i);
+		latencies[i] = now_ns() - t0;
+		if (ret != 0) {
+			printf("marquise_send_simple failed: %s\n", strerror(errno));
+			bench_shutdown(ctx, "send_simple");
+			return -1;
+		}
+	}
+	uint64_t elapsed = now_ns() - start;
+	if (bench_shutdown(ctx, "send_simple") != 0) {
+		return -1;
+	}
+	report("send_simple", "", calls, elapsed, latencies, calls);
+	return 0;
+}
+
+int bench_send_extended(uint64_t *latencies, size_t calls, size_t value_len) {
+	size_t i;
+	char params[64];
+	char *value = malloc(value_len);
+	if (value == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memset(value, 'x', value_len);
+	marquise_ctx *ctx = bench_init("send_extended");
+	if (ctx == NULL) {
+		free(value);
+		return -1;
+	}
+	uint64_t start = now_ns();
+	for (i = 0; i < calls; i++) {
+		uint64_t t0 = now_ns();
+		int ret = marquise_send_extended(ctx, BENCH_ADDRESS, BENCH_TIMESTAMP + i, value, value_len);
+		latencies[i] = now_ns() - t0;
+		if (ret != 0) {
+			printf("marquise_send_extended failed: %s\n", strerror(errno));
+			bench_shutdown(ctx, "send_extended");
+			free(value);
+			return -1;
+		}
+	}
+	uint64_t elapsed = now_ns() - start;
+	free(value);
+	if (bench_shutdown(ctx, "send_extended") != 0) {
+		return -1;
+	}
+	snprintf(params, sizeof(params), "value_len=%zu", value_len);
+	report("send_extended", params, calls, elapsed, latencies, calls);
+	return 0;
+}
+
+/* The first distinct calls send new sources, which are misses; the rest
+ * go round them again and hit. */
+int bench_update_source(uint64_t *latencies, size_t calls, double hit_ratio) {
+	size_t i;
+	char params[64];
+	size_t distinct = (size_t)(calls * (1.0 - hit_ratio) + 0.5);
+	if (distinct == 0) {
+		distinct = 1;
+	}
+	marquise_source **sources = malloc(distinct * sizeof(marquise_source *));
+	if (sources == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (i = 0; i < distinct; i++) {
+		char host[48];
+		char *fields[3] = { "hostname", "metric", "service" };
+		char *values[3] = { host, "BytesUsed", "memory" };
+		snprintf(host, sizeof(host), "web%zu.example.com", i);
+		sources[i] = marquise_new_source(fields, values, 3);
+		if (sources[i] == NULL) {
+			perror("marquise_new_source");
+			return -1;
+		}
+	}
+
+	int ret = 0;
+	marquise_ctx *ctx = bench_init("update_source");
+	if (ctx == NULL) {
+		ret = -1;
+	} else {
+		uint64_t start = now_ns();
+		for (i = 0; i < calls; i++) {
+			uint64_t t0 = now_ns();
+			ret = marquise_update_source(ctx, BENCH_ADDRESS + 2 * (i % distinct), sources[i % distinct]);
+			latencies[i] = now_ns() - t0;
+			if (ret != 0) {
+				printf("marquise_update_source failed: %s\n", strerror(errno));
+				break;
+			}
+		}
+		uint64_t elapsed = now_ns() - start;
+		marquise_cache_stats stats;
+		marquise_source_cache_stats(ctx, &stats);
+		if (bench_shutdown(ctx, "update_source") != 0) {
+			ret = -1;
+		}
+		if (ret == 0) {
+			snprintf(params, sizeof(params), "hit_ratio=%.2f hits=%lu misses=%lu",
+			         hit_ratio, stats.hits, stats.misses);
+			report("update_source", params, calls, elapsed, latencies, calls);
+		}
+	}
+	for (i = 0; i < distinct; i++) {
+		marquise_free_source(sources[i]);
+	}
+	free(sources);
+	return ret;
+}
+
+int bench_hash_identifier(uint64_t *latencies, size_t calls) {
+	size_t i;
+	const char *id = "hostname:web17.example.com,metric:BytesUsed,service:memory,";
+	size_t id_len = strlen(id);
+	uint64_t sink = 0;
+	uint64_t start = now_ns();
+	for (i = 0; i < calls; i++) {
+		uint64_t t0 = now_ns();
+		sink ^= marquise_hash_identifier((const unsigned char *)id, id_len);
+		latencies[i] = now_ns() - t0;
+	}
+	uint64_t elapsed = now_ns() - start;
+	char params[64];
+	snprintf(params, sizeof(params), "id_len=%zu", id_len);
+	report("hash_identifier", params, calls, elapsed, latencies, calls);
+	/* Keep the hashing from being optimised away. */
+	return sink == 1 ? 1 : 0;
+}
+
+/* Only the calls which rotated the spool file are sampled. */
+int bench_rotation(uint64_t *latencies) {
+	size_t i;
+	size_t rotations = 0;
+	char *value = malloc(BENCH_ROTATE_VALUE_LEN);
+	if (value == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memset(value, 'x', BENCH_ROTATE_VALUE_LEN);
+	marquise_ctx *ctx = bench_init("rotation");
+	if (ctx == NULL) {
+		free(value);
+		return -1;
+	}
+	uint64_t start = now_ns();
+	for (i = 0; i < BENCH_ROTATE_CALLS; i++) {
+		size_t before = ctx->bytes_written_points;
+		uint64_t t0 = now_ns();
+		int ret = marquise_send_extended(ctx, BENCH_ADDRESS, BENCH_TIMESTAMP + i, value, BENCH_ROTATE_VALUE_LEN);
+		uint64_t t1 = now_ns();
+		if (ret != 0) {
+			printf("marquise_send_extended failed: %s\n", strerror(errno));
+			bench_shutdown(ctx, "rotation");
+			free(value);
+			return -1;
+		}
+		if (ctx->bytes_written_points < before) {
+			latencies[rotations++] = t1 - t0;
+		}
+	}
+	uint64_t elapsed = now_ns() - start;
+	free(value);
+	if (bench_shutdown(ctx, "rotation") != 0) {
+		return -1;
+	}
+	char params[64];
+	snprintf(params, sizeof(params), "value_len=%d", BENCH_ROTATE_VALUE_LEN);
+	report("rotation", params, BENCH_ROTATE_CALLS, elapsed, latencies, rotations);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	size_t calls = (argc > 1) ? strtoul(argv[1], NULL, 10) : BENCH_CALLS;
+	if (calls == 0) {
+		calls = BENCH_CALLS;
+	}
+	size_t source_calls = calls < BENCH_SOURCES ? calls : BENCH_SOURCES;
+	size_t value_lens[] = { 16, 256, 4096 };
+	double hit_ratios[] = { 0.0, 0.9, 0.99 };
+	size_t i;
+	int ret = 0;
+
+	spool_dir = getenv("MARQUISE_SPOOL_DIR");
+	if (spool_dir == NULL) {
+		spool_dir = g_file_test("/dev/shm", G_FILE_TEST_IS_DIR) ? "/dev/shm" : "/tmp";
+	}
+	setenv("MARQUISE_SPOOL_DIR", spool_dir, 1);
+	setenv("MARQUISE_LOCK_DIR", spool_dir, 1);
+	/* Each run should start from an empty source dict cache. */
+	setenv("MARQUISE_SOURCE_CACHE_PERSIST", "0", 1);
+	printf("# spool_dir=%s writer=%s\n", spool_dir,
+	       getenv("MARQUISE_SPOOL_WRITER") ? getenv("MARQUISE_SPOOL_WRITER") : MARQUISE_SPOOL_WRITER);
+
+	uint64_t *latencies = malloc(calls * sizeof(uint64_t));
+	if (latencies == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	ret |= bench_timer(latencies, calls);
+	ret |= bench_send_simple(latencies, calls);
+	for (i = 0; i < sizeof(value_lens) / sizeof(value_lens[0]); i++) {
+		size_t max_calls = BENCH_SPOOL_BYTES / (24 + value_lens[i]);
+		ret |= bench_send_extended(latencies, calls < max_calls ? calls : max_calls, value_lens[i]);
+	}
+	for (i = 0; i < sizeof(hit_ratios) / sizeof(hit_ratios[0]); i++) {
+		ret |= bench_update_source(latencies, source_calls, hit_ratios[i]);
+	}
+	ret |= bench_hash_identifier(latencies, calls);
+	if (calls >= BENCH_ROTATE_CALLS) {
+		ret |= bench_rotation(latencies);
+	}
+	free(latencies);
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
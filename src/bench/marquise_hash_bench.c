@@ -0,0 +1,133 @@
+/* Compare marquise_hash_identifier, one identifier at a time, with
+ * marquise_hash_identifiers_batch over the same identifiers, and with
+ * an identifier builder finishing suffixes of a shared prefix.
+ *
+ * Usage: marquise_hash_bench [count]
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../marquise.h"
+
+#define BENCH_IDENTIFIERS 1000000
+#define BENCH_ROUNDS      5
+
+int main(int argc, char **argv) {
+	size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : BENCH_IDENTIFIERS;
+	if (n == 0) {
+		n = BENCH_IDENTIFIERS;
+	}
+	unsigned char **ids = malloc(n * sizeof(unsigned char *));
+	size_t *id_lens = malloc(n * sizeof(size_t));
+	uint64_t *single = malloc(n * sizeof(uint64_t));
+	uint64_t *batch = malloc(n * sizeof(uint64_t));
+	if (ids == NULL || id_lens == NULL || single == NULL || batch == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	/* Identifiers of the usual shape and a spread of lengths. */
+	size_t i;
+	for (i = 0; i < n; i++) {
+		char id[128];
+		id_lens[i] = snprintf(id, sizeof(id), "hostname:web%zu.example.com,metric:%s,service:%s,",
+		                      i % 5000, (i & 1) ? "BytesUsed" : "cpu_user", (i % 3) ? "memory" : "cpu");
+		ids[i] = (unsigned char *)strdup(id);
+	}
+
+	gint64 best_single = G_MAXINT64;
+	gint64 best_batch = G_MAXINT64;
+	int round;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		gint64 start = g_get_monotonic_time();
+		for (i = 0; i < n; i++) {
+			single[i] = marquise_hash_identifier(ids[i], id_lens[i]);
+		}
+		gint64 elapsed = g_get_monotonic_time() - start;
+		best_single = elapsed < best_single ? elapsed : best_single;
+
+		start = g_get_monotonic_time();
+		marquise_hash_identifiers_batch((const unsigned char *const *)ids, id_lens, n, batch);
+		elapsed = g_get_monotonic_time() - start;
+		best_batch = elapsed < best_batch ? elapsed : best_batch;
+	}
+
+	if (memcmp(single, batch, n * sizeof(uint64_t)) != 0) {
+		printf("batch hashes don't match marquise_hash_identifier\n");
+		return EXIT_FAILURE;
+	}
+	printf("hash=single identifiers=%zu seconds=%.3f ids_per_sec=%.0f\n",
+	       n, best_single / 1e6, n / (best_single / 1e6));
+	printf("hash=batch identifiers=%zu seconds=%.3f ids_per_sec=%.0f speedup=%.2f\n",
+	       n, best_batch / 1e6, n / (best_batch / 1e6), (double)best_single / best_batch);
+
+	/* Identifiers sharing a long prefix, hashed whole and from the
+	 * prefix's midstate, without and with the builder's cache (which
+	 * sees each suffix many times over). */
+	const char *prefix = "hostname:web17.example.com,service:cpu,collection_point:syd1,metric:";
+	size_t prefix_len = strlen(prefix);
+	for (i = 0; i < n; i++) {
+		char id[160];
+		id_lens[i] = snprintf(id, sizeof(id), "%scpu_user,core:%zu,", prefix, i % 256);
+		free(ids[i]);
+		ids[i] = (unsigned char *)strdup(id);
+	}
+	marquise_id_builder *uncached = marquise_id_builder_new((const unsigned char *)prefix, prefix_len, 0);
+	marquise_id_builder *cached = marquise_id_builder_new((const unsigned char *)prefix, prefix_len, 1024);
+	if (uncached == NULL || cached == NULL) {
+		perror("marquise_id_builder_new");
+		return EXIT_FAILURE;
+	}
+	gint64 best_prefix = G_MAXINT64;
+	gint64 best_cached = G_MAXINT64;
+	best_single = G_MAXINT64;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		gint64 start = g_get_monotonic_time();
+		for (i = 0; i < n; i++) {
+			single[i] = marquise_hash_identifier(ids[i], id_lens[i]);
+		}
+		gint64 elapsed = g_get_monotonic_time() - start;
+		best_single = elapsed < best_single ? elapsed : best_single;
+
+		start = g_get_monotonic_time();
+		for (i = 0; i < n; i++) {
+			batch[i] = marquise_id_builder_hash(uncached, ids[i] + prefix_len, id_lens[i] - prefix_len);
+		}
+		elapsed = g_get_monotonic_time() - start;
+		best_prefix = elapsed < best_prefix ? elapsed : best_prefix;
+		if (memcmp(single, batch, n * sizeof(uint64_t)) != 0) {
+			printf("builder hashes don't match marquise_hash_identifier\n");
+			return EXIT_FAILURE;
+		}
+
+		start = g_get_monotonic_time();
+		for (i = 0; i < n; i++) {
+			batch[i] = marquise_id_builder_hash(cached, ids[i] + prefix_len, id_lens[i] - prefix_len);
+		}
+		elapsed = g_get_monotonic_time() - start;
+		best_cached = elapsed < best_cached ? elapsed : best_cached;
+		if (memcmp(single, batch, n * sizeof(uint64_t)) != 0) {
+			printf("cached builder hashes don't match marquise_hash_identifier\n");
+			return EXIT_FAILURE;
+		}
+	}
+	printf("hash=prefixed_single identifiers=%zu seconds=%.3f ids_per_sec=%.0f\n",
+	       n, best_single / 1e6, n / (best_single / 1e6));
+	printf("hash=builder identifiers=%zu seconds=%.3f ids_per_sec=%.0f speedup=%.2f\n",
+	       n, best_prefix / 1e6, n / (best_prefix / 1e6), (double)best_single / best_prefix);
+	printf("hash=builder_cached identifiers=%zu seconds=%.3f ids_per_sec=%.0f speedup=%.2f\n",
+	       n, best_cached / 1e6, n / (best_cached / 1e6), (double)best_single / best_cached);
+	marquise_id_builder_free(uncached);
+	marquise_id_builder_free(cached);
+
+	for (i = 0; i < n; i++) {
+		free(ids[i]);
+	}
+	free(ids);
+	free(id_lens);
+	free(single);
+	free(batch);
+	return EXIT_SUCCESS;
+}
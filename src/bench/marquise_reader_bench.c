@@ -0,0 +1,165 @@
+/* Compare reading a points spool file back with marquise_spool_open and
+ * marquise_spool_next against reading it with stdio and copying each
+ * frame out, as the test programs used to.
+ *
+ * Usage: marquise_reader_bench [points]
+ *
+ * Half the points are simple, half extended. The spool goes to
+ * MARQUISE_SPOOL_DIR, or /tmp if that isn't set. Files are read from
+ * the page cache, so this measures parsing rather than the disk.
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "../marquise.h"
+
+#define BENCH_SIMPLE_ADDRESS   1234567890123456780
+#define BENCH_EXTENDED_ADDRESS 1234567890999999999
+#define BENCH_TIMESTAMP        1405392588999999999
+#define BENCH_POINTS           2000000
+#define BENCH_VALUE_LEN        100
+#define BENCH_ROUNDS           5
+
+/* Read 64 bits from little-endian byte array p, make a 64-bit value. */
+#define LE8TOU64(v, p) v = \
+	(((uint64_t)p[0])      ) + \
+	(((uint64_t)p[1]) <<  8) + \
+	(((uint64_t)p[2]) << 16) + \
+	(((uint64_t)p[3]) << 24) + \
+	(((uint64_t)p[4]) << 32) + \
+	(((uint64_t)p[5]) << 40) + \
+	(((uint64_t)p[6]) << 48) + \
+	(((uint64_t)p[7]) << 56)
+
+char *write_spool(size_t n) {
+	char value[BENCH_VALUE_LEN];
+	size_t i;
+	memset(value, 'x', BENCH_VALUE_LEN);
+	marquise_ctx *ctx = marquise_init("marquisebench");
+	if (ctx == NULL) {
+		printf("marquise_init failed: %s\n", strerror(errno));
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		int ret = (i % 2 == 0) ?
+			marquise_send_simple(ctx, BENCH_SIMPLE_ADDRESS, BENCH_TIMESTAMP + i, i) :
+			marquise_send_extended(ctx, BENCH_EXTENDED_ADDRESS, BENCH_TIMESTAMP + i, value, BENCH_VALUE_LEN);
+		if (ret != 0) {
+			printf("marquise_send failed: %s\n", strerror(errno));
+			marquise_shutdown(ctx);
+			return NULL;
+		}
+	}
+	char *path = strdup(ctx->spool_path_points);
+	if (marquise_shutdown(ctx) != 0) {
+		printf("marquise_shutdown failed: %s\n", strerror(errno));
+		free(path);
+		return NULL;
+	}
+	return path;
+}
+
+/* Read every frame with the spool reader. Returns the number of frames,
+ * adding their timestamps to *sum so that nothing is optimised away. */
+size_t read_spool(const char *path, size_t *bytes, uint64_t *sum) {
+	marquise_spool *s = marquise_spool_open(path, SPOOL_POINTS);
+	if (s == NULL) {
+		printf("marquise_spool_open failed: %s\n", strerror(errno));
+		return 0;
+	}
+	marquise_frame f;
+	size_t frames = 0;
+	int ret;
+	while ((ret = marquise_spool_next(s, &f)) == 1) {
+		*sum += f.timestamp + (f.extended ? f.len : 0);
+		frames++;
+	}
+	if (ret != 0) {
+		printf("marquise_spool_next failed: %s\n", strerror(errno));
+	}
+	*bytes = marquise_spool_offset(s);
+	marquise_spool_close(s);
+	return frames;
+}
+
+/* The same with fread, copying each extended value out. */
+size_t read_stdio(const char *path, size_t *bytes, uint64_t *sum) {
+	FILE *spool = fopen(path, "r");
+	if (spool == NULL) {
+		printf("fopen failed: %s\n", strerror(errno));
+		return 0;
+	}
+	unsigned char header[24];
+	char *value = NULL;
+	size_t value_size = 0;
+	size_t frames = 0;
+	*bytes = 0;
+	while (fread(header, 1, 24, spool) == 24) {
+		uint64_t address;
+		uint64_t timestamp;
+		uint64_t len = 0;
+		LE8TOU64(address, header);
+		LE8TOU64(timestamp, (header+8));
+		if (address & 1) {
+			LE8TOU64(len, (header+16));
+			if (len > value_size) {
+				value_size = len;
+				value = realloc(value, value_size);
+			}
+			if (fread(value, 1, len, spool) != len) {
+				break;
+			}
+		}
+		*sum += timestamp + len;
+		*bytes += 24 + len;
+		frames++;
+	}
+	free(value);
+	fclose(spool);
+	return frames;
+}
+
+void bench_reader(const char *name, size_t (*reader)(const char *, size_t *, uint64_t *), const char *path) {
+	int round;
+	double best = 0;
+	size_t frames = 0;
+	size_t bytes = 0;
+	uint64_t sum = 0;
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		gint64 start = g_get_monotonic_time();
+		frames = reader(path, &bytes, &sum);
+		double seconds = (g_get_monotonic_time() - start) / 1e6;
+		if (round == 0 || seconds < best) {
+			best = seconds;
+		}
+	}
+	printf("reader=%s frames=%zu bytes=%zu seconds=%.4f frames_per_sec=%.0f mb_per_sec=%.0f checksum=%llu\n",
+	       name, frames, bytes, best, frames / best, bytes / best / 1e6, (unsigned long long)sum);
+}
+
+int main(int argc, char **argv) {
+	size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : BENCH_POINTS;
+	if (n == 0) {
+		n = BENCH_POINTS;
+	}
+
+	setenv("MARQUISE_SPOOL_DIR", getenv("MARQUISE_SPOOL_DIR") ? getenv("MARQUISE_SPOOL_DIR") : "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	/* All of it in one file. */
+	setenv("MARQUISE_ROTATE_SIZE", "1099511627776", 1);
+	char *path = write_spool(n);
+	if (path == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	bench_reader("spool", read_spool, path);
+	bench_reader("stdio", read_stdio, path);
+
+	unlink(path);
+	free(path);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/* Compare the spool writers by pushing extended points through each,
+ * then the durability modes with the write writer, from one thread and
+ * from several.
+ *
+ * Usage: marquise_writer_bench [writer...]
+ *
+ * Writers default to "write mmap io_uring". The spool goes to
+ * MARQUISE_SPOOL_DIR, or /tmp if that isn't set; point it at the
+ * filesystem you care about, since syncing to tmpfs costs nothing.
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../marquise.h"
+
+#define BENCH_ADDRESS   1234567890999999999
+#define BENCH_TIMESTAMP 1405392588999999999
+#define BENCH_POINTS    1000000
+#define BENCH_VALUE_LEN 200
+/* Syncing can be slow enough that the durability runs are timed
+ * rather than counted. */
+#define BENCH_DURABLE_SECONDS 2
+#define BENCH_DURABLE_THREADS 8
+
+const char *writer_names[] = { "write", "mmap", "io_uring" };
+
+int bench_writer(const char *writer, char *value) {
+	int i;
+	setenv("MARQUISE_SPOOL_WRITER", writer, 1);
+	marquise_ctx *ctx = marquise_init("marquisebench");
+	if (ctx == NULL) {
+		printf("marquise_init failed for writer %s: %s\n", writer, strerror(errno));
+		return -1;
+	}
+	/* The io_uring writer falls back to write() if it has to. */
+	const char *actual = writer_names[ctx->writer_mode];
+
+	gint64 start = g_get_monotonic_time();
+	for (i = 0; i < BENCH_POINTS; i++) {
+		if (marquise_send_extended(ctx, BENCH_ADDRESS, BENCH_TIMESTAMP + i, value, BENCH_VALUE_LEN) != 0) {
+			printf("marquise_send_extended failed for writer %s: %s\n", writer, strerror(errno));
+			marquise_shutdown(ctx);
+			return -1;
+		}
+	}
+	if (marquise_shutdown(ctx) != 0) {
+		printf("marquise_shutdown failed for writer %s: %s\n", writer, strerror(errno));
+		return -1;
+	}
+	double seconds = (g_get_monotonic_time() - start) / 1e6;
+
+	printf("writer=%s actual=%s points=%d value_len=%d seconds=%.3f points_per_sec=%.0f\n",
+	       writer, actual, BENCH_POINTS, BENCH_VALUE_LEN, seconds, BENCH_POINTS / seconds);
+	return 0;
+}
+
+struct durable_sender {
+	marquise_ctx *ctx;
+	gint64 end_time;
+	uint64_t points;
+	int failed;
+};
+
+gpointer send_durable(gpointer data) {
+	struct durable_sender *sender = data;
+	while (g_get_monotonic_time() < sender->end_time) {
+		if (marquise_send_simple(sender->ctx, BENCH_ADDRESS, BENCH_TIMESTAMP + sender->points, sender->points) != 0) {
+			sender->failed = 1;
+			break;
+		}
+		sender->points++;
+	}
+	return NULL;
+}
+
+int bench_durability(const char *durability, int n_threads) {
+	GThread *threads[BENCH_DURABLE_THREADS];
+	struct durable_sender senders[BENCH_DURABLE_THREADS];
+	int i;
+	int failed = 0;
+	setenv("MARQUISE_SPOOL_WRITER", "write", 1);
+	setenv("MARQUISE_DURABILITY", durability, 1);
+	marquise_ctx *ctx = marquise_init("marquisebench");
+	unsetenv("MARQUISE_DURABILITY");
+	if (ctx == NULL) {
+		printf("marquise_init failed for durability %s: %s\n", durability, strerror(errno));
+		return -1;
+	}
+
+	uint64_t points = 0;
+	gint64 start = g_get_monotonic_time();
+	for (i = 0; i < n_threads; i++) {
+		senders[i].ctx = ctx;
+		senders[i].end_time = start + BENCH_DURABLE_SECONDS * G_USEC_PER_SEC;
+		senders[i].points = 0;
+		senders[i].failed = 0;
+		threads[i] = g_thread_new("sender", send_durable, &senders[i]);
+	}
+	for (i = 0; i < n_threads; i++) {
+		g_thread_join(threads[i]);
+		failed |= senders[i].failed;
+		points += senders[i].points;
+	}
+	if (marquise_shutdown(ctx) != 0 || failed) {
+		printf("sending failed for durability %s: %s\n", durability, strerror(errno));
+		return -1;
+	}
+	double seconds = (g_get_monotonic_time() - start) / 1e6;
+
+	printf("durability=%s threads=%d points=%lu seconds=%.3f points_per_sec=%.0f\n",
+	       durability, n_threads, points, seconds, points / seconds);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	int ret = 0;
+	char value[BENCH_VALUE_LEN];
+	memset(value, 'x', BENCH_VALUE_LEN);
+
+	setenv("MARQUISE_SPOOL_DIR", getenv("MARQUISE_SPOOL_DIR") ? getenv("MARQUISE_SPOOL_DIR") : "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			ret |= bench_writer(argv[i], value);
+		}
+	} else {
+		for (i = 0; i < 3; i++) {
+			ret |= bench_writer(writer_names[i], value);
+		}
+	}
+
+	const char *durabilities[] = { "none", "rotate", "group", "frame" };
+	for (i = 0; i < 4; i++) {
+		ret |= bench_durability(durabilities[i], 1);
+		ret |= bench_durability(durabilities[i], BENCH_DURABLE_THREADS);
+	}
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
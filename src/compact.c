@@ -0,0 +1,400 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "compact.h"
+#include "marquise.h"
+
+/* Write the 32-bit value in v to the byte array p. */
+#define U32TO8_LE(p, v)                \
+	(p)[0] = (uint8_t)((v));       \
+	(p)[1] = (uint8_t)((v) >>  8); \
+	(p)[2] = (uint8_t)((v) >> 16); \
+	(p)[3] = (uint8_t)((v) >> 24);
+
+/* Write the 64-bit value in v to the byte array p. */
+#define U64TO8_LE(p, v)                            \
+	U32TO8_LE((p),     (uint32_t)((v)      )); \
+	U32TO8_LE((p) + 4, (uint32_t)((v) >> 32));
+
+/* Read a 32-bit value from the little-endian byte array p. */
+#define U8TO32_LE(p)                   \
+	(((uint32_t)((p)[0])      ) |  \
+	 ((uint32_t)((p)[1]) <<  8) |  \
+	 ((uint32_t)((p)[2]) << 16) |  \
+	 ((uint32_t)((p)[3]) << 24))
+
+/* Read a 64-bit value from the little-endian byte array p. */
+#define U8TO64_LE(p)                                \
+	((uint64_t)U8TO32_LE(p) |                   \
+	 ((uint64_t)U8TO32_LE((p) + 4) << 32))
+
+/* The most a varint of a 64-bit value takes. */
+#define VARINT_MAX 10
+
+/* Map a signed delta onto an unsigned one, small either side of zero
+ * staying small. */
+#define zigzag(d) (((uint64_t)(d) << 1) ^ (uint64_t)((int64_t)(d) >> 63))
+#define unzigzag(u) (((u) >> 1) ^ (0 - ((u) & 1)))
+
+struct compact_point {
+	uint64_t address;
+	uint64_t timestamp;
+	uint64_t value;
+	size_t   seq;		/* Arrival order, to keep sorting stable. */
+};
+
+struct compact_encoder {
+	struct compact_point *points;
+	size_t   n_points;
+	size_t   points_size;
+	/* Extended frames, verbatim. value_left is how much of the last
+	 * one's value is still to come. */
+	uint8_t *frames;
+	size_t   frames_used;
+	size_t   frames_size;
+	uint64_t value_left;
+	uint8_t *out;
+	size_t   out_size;
+};
+
+struct compact_encoder *compact_encoder_new(void)
+{
+	return calloc(1, sizeof(struct compact_encoder));
+}
+
+void compact_encoder_free(struct compact_encoder *e)
+{
+	if (e == NULL) {
+		return;
+	}
+	free(e->points);
+	free(e->frames);
+	free(e->out);
+	free(e);
+}
+
+/* Make room for len more bytes at *buf, which has used bytes of size
+ * in use. Zero on success, -1 on failure. */
+static int reserve(uint8_t **buf, size_t *size, size_t used, size_t len)
+{
+	if (len <= *size - used) {
+		return 0;
+	}
+	size_t new_size = *size > 0 ? *size : 4096;
+	while (new_size - used < len) {
+		if (new_size > SIZE_MAX / 2) {
+			errno = ENOMEM;
+			return -1;
+		}
+		new_size *= 2;
+	}
+	uint8_t *p = realloc(*buf, new_size);
+	if (p == NULL) {
+		return -1;
+	}
+	*buf = p;
+	*size = new_size;
+	return 0;
+}
+
+static int add_frame_bytes(struct compact_encoder *e, const uint8_t *p, size_t len)
+{
+	if (reserve(&e->frames, &e->frames_size, e->frames_used, len) != 0) {
+		return -1;
+	}
+	memcpy(e->frames + e->frames_used, p, len);
+	e->frames_used += len;
+	return 0;
+}
+
+static int add_point(struct compact_encoder *e, const uint8_t *p)
+{
+	if (e->n_points == e->points_size) {
+		size_t new_size = e->points_size > 0 ? e->points_size * 2 : 1024;
+		struct compact_point *points = realloc(e->points, new_size * sizeof(struct compact_point));
+		if (points == NULL) {
+			return -1;
+		}
+		e->points = points;
+		e->points_size = new_size;
+	}
+	struct compact_point *pt = &e->points[e->n_points];
+	pt->address = U8TO64_LE(p);
+	pt->timestamp = U8TO64_LE(p + 8);
+	pt->value = U8TO64_LE(p + 16);
+	pt->seq = e->n_points++;
+	return 0;
+}
+
+int compact_add(struct compact_encoder *e, const struct iovec *iov, int iovcnt)
+{
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		const uint8_t *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while (left > 0) {
+			if (e->value_left > 0) {
+				size_t n = left < e->value_left ? left : e->value_left;
+				if (add_frame_bytes(e, p, n) != 0) {
+					return -1;
+				}
+				e->value_left -= n;
+				p += n;
+				left -= n;
+				continue;
+			}
+			if (left < 24) {
+				errno = EINVAL;
+				return -1;
+			}
+			/* Extended frames have the LSB of the address set. */
+			if (p[0] & 1) {
+				if (add_frame_bytes(e, p, 24) != 0) {
+					return -1;
+				}
+				e->value_left = U8TO64_LE(p + 16);
+			} else if (add_point(e, p) != 0) {
+				return -1;
+			}
+			p += 24;
+			left -= 24;
+		}
+	}
+	return 0;
+}
+
+size_t compact_pending(const struct compact_encoder *e)
+{
+	return e->n_points * 24 + e->frames_used;
+}
+
+static int compare_points(const void *a, const void *b)
+{
+	const struct compact_point *x = a;
+	const struct compact_point *y = b;
+	if (x->address != y->address) {
+		return x->address < y->address ? -1 : 1;
+	}
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static uint8_t *put_varint(uint8_t *o, uint64_t v)
+{
+	while (v >= 0x80) {
+		*o++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*o++ = (uint8_t)v;
+	return o;
+}
+
+static uint8_t *put_block_header(uint8_t *o, uint8_t type, size_t len)
+{
+	o[0] = type;
+	o[1] = o[2] = o[3] = 0;
+	U32TO8_LE(o + 4, (uint32_t)len);
+	return o + COMPACT_BLOCK_HEADER_LEN;
+}
+
+/* Encode the collected points as a COMPACT_BLOCK_POINTS block at o,
+ * returning the end of it. */
+static uint8_t *encode_points(struct compact_encoder *e, uint8_t *o)
+{
+	struct compact_point *pts = e->points;
+	size_t n = e->n_points;
+	size_t i, j;
+
+	qsort(pts, n, sizeof(struct compact_point), compare_points);
+	size_t series = 0;
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && pts[j].address == pts[i].address; j++);
+		series++;
+	}
+
+	uint8_t *block = o;
+	o = put_varint(o + COMPACT_BLOCK_HEADER_LEN, series);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && pts[j].address == pts[i].address; j++);
+		U64TO8_LE(o, pts[i].address);
+		o = put_varint(o + 8, j - i);
+		U64TO8_LE(o, pts[i].timestamp);
+		U64TO8_LE(o + 8, pts[i].value);
+		o += 16;
+		uint64_t delta = 0;
+		size_t k;
+		for (k = i + 1; k < j; k++) {
+			uint64_t d = pts[k].timestamp - pts[k - 1].timestamp;
+			o = put_varint(o, zigzag(d - delta));
+			o = put_varint(o, zigzag(pts[k].value - pts[k - 1].value));
+			delta = d;
+		}
+	}
+	put_block_header(block, COMPACT_BLOCK_POINTS, o - block - COMPACT_BLOCK_HEADER_LEN);
+	return o;
+}
+
+const uint8_t *compact_encode(struct compact_encoder *e, bool header, size_t *len)
+{
+	/* Worst case: every point its own series. */
+	size_t bound = COMPACT_FILE_HEADER_LEN + 2 * COMPACT_BLOCK_HEADER_LEN + VARINT_MAX +
+	               e->n_points * (24 + VARINT_MAX) + e->frames_used;
+	if (reserve(&e->out, &e->out_size, 0, bound) != 0) {
+		return NULL;
+	}
+	uint8_t *o = e->out;
+	if (header) {
+		memcpy(o, COMPACT_MAGIC, 4);
+		o[4] = COMPACT_VERSION;
+		o[5] = o[6] = o[7] = 0;
+		o += COMPACT_FILE_HEADER_LEN;
+	}
+	if (e->n_points > 0) {
+		o = encode_points(e, o);
+	}
+	if (e->frames_used > 0) {
+		o = put_block_header(o, COMPACT_BLOCK_FRAMES, e->frames_used);
+		memcpy(o, e->frames, e->frames_used);
+		o += e->frames_used;
+	}
+	e->n_points = 0;
+	e->frames_used = 0;
+	*len = o - e->out;
+	return e->out;
+}
+
+/* Read a varint from *p, no further than end. Zero on success, -1 if
+ * it runs off the end or past 64 bits. */
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	uint64_t x = 0;
+	int shift;
+	for (shift = 0; shift < 64; shift += 7) {
+		if (*p >= end) {
+			return -1;
+		}
+		uint8_t b = *(*p)++;
+		x |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = x;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Decode the payload of a COMPACT_BLOCK_POINTS block onto *out. Zero on
+ * success, -1 with errno set on failure. */
+static int decode_points(const uint8_t *p, const uint8_t *end,
+                         uint8_t **out, size_t *out_size, size_t *out_used)
+{
+	uint64_t series;
+	if (get_varint(&p, end, &series) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (series-- > 0) {
+		uint64_t count;
+		if (end - p < 8) {
+			errno = EINVAL;
+			return -1;
+		}
+		uint64_t address = U8TO64_LE(p);
+		p += 8;
+		/* Every point after the first takes at least two bytes, which
+		 * keeps a damaged count from asking for the earth. */
+		if (get_varint(&p, end, &count) != 0 || count == 0 ||
+		    end - p < 16 || count - 1 > (uint64_t)(end - p - 16) / 2) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (reserve(out, out_size, *out_used, count * 24) != 0) {
+			return -1;
+		}
+		uint8_t *o = *out + *out_used;
+		uint64_t timestamp = U8TO64_LE(p);
+		uint64_t value = U8TO64_LE(p + 8);
+		uint64_t delta = 0;
+		p += 16;
+		uint64_t k;
+		for (k = 0; k < count; k++) {
+			if (k > 0) {
+				uint64_t dod, dv;
+				if (get_varint(&p, end, &dod) != 0 || get_varint(&p, end, &dv) != 0) {
+					errno = EINVAL;
+					return -1;
+				}
+				delta += unzigzag(dod);
+				timestamp += delta;
+				value += unzigzag(dv);
+			}
+			U64TO8_LE(o, address);
+			U64TO8_LE(o + 8, timestamp);
+			U64TO8_LE(o + 16, value);
+			o += 24;
+		}
+		*out_used += count * 24;
+	}
+	if (p != end) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+uint8_t *marquise_compact_decode(const uint8_t *buf, size_t len, size_t *out_len)
+{
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + len;
+	uint8_t *out = NULL;
+	size_t out_size = 0;
+	size_t out_used = 0;
+
+	if (len < COMPACT_FILE_HEADER_LEN || memcmp(buf, COMPACT_MAGIC, 4) != 0 ||
+	    buf[4] != COMPACT_VERSION) {
+		errno = EINVAL;
+		return NULL;
+	}
+	p += COMPACT_FILE_HEADER_LEN;
+	/* Something to hand back even if there are no blocks. */
+	if (reserve(&out, &out_size, 0, 1) != 0) {
+		return NULL;
+	}
+	while (p < end) {
+		if (end - p < COMPACT_BLOCK_HEADER_LEN ||
+		    U8TO32_LE(p + 4) > (size_t)(end - p - COMPACT_BLOCK_HEADER_LEN)) {
+			free(out);
+			errno = EINVAL;
+			return NULL;
+		}
+		uint8_t type = p[0];
+		const uint8_t *payload = p + COMPACT_BLOCK_HEADER_LEN;
+		const uint8_t *payload_end = payload + U8TO32_LE(p + 4);
+		int ret = 0;
+		if (type == COMPACT_BLOCK_POINTS) {
+			ret = decode_points(payload, payload_end, &out, &out_size, &out_used);
+		} else if (type == COMPACT_BLOCK_FRAMES) {
+			ret = reserve(&out, &out_size, out_used, payload_end - payload);
+			if (ret == 0) {
+				memcpy(out + out_used, payload, payload_end - payload);
+				out_used += payload_end - payload;
+			}
+		}
+		if (ret != 0) {
+			free(out);
+			return NULL;
+		}
+		p = payload_end;
+	}
+	*out_len = out_used;
+	return out;
+}
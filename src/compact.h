@@ -0,0 +1,75 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+/* The compact points spool format, chosen with
+ * MARQUISE_SPOOL_FORMAT=compact. Simple points are collected a block at
+ * a time, grouped by address, and stored as deltas of deltas, which for
+ * the usual counter or gauge sampled at a steady rate comes to two or
+ * three bytes a point instead of 24.
+ *
+ * A file starts with an eight-byte header: the magic "MQPC", a version
+ * byte (COMPACT_VERSION) and three zero bytes. Blocks follow, each with
+ * an eight-byte header of its own: a type byte, three zero bytes and the
+ * length of the payload, as a 32-bit little-endian integer. Readers skip
+ * blocks of types they don't know.
+ *
+ * A COMPACT_BLOCK_POINTS payload is a varint count of series, then for
+ * each: its address, as eight little-endian bytes; a varint count of its
+ * points; the first point's timestamp and value, eight bytes each; then
+ * for every other point, in the order they were sent, the change in the
+ * timestamp delta and the change in the value, each a zigzag varint.
+ * Deltas are taken modulo 2^64, so any sequence round-trips.
+ *
+ * A COMPACT_BLOCK_FRAMES payload is extended frames exactly as they
+ * appear in the classic format.
+ *
+ * Varints are LEB128: seven bits a byte, least significant first, with
+ * the top bit set on all but the last byte.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define COMPACT_MAGIC "MQPC"
+#define COMPACT_VERSION 1
+#define COMPACT_FILE_HEADER_LEN 8
+#define COMPACT_BLOCK_HEADER_LEN 8
+
+#define COMPACT_BLOCK_POINTS 1
+#define COMPACT_BLOCK_FRAMES 2
+
+/* How many bytes of classic frames are collected before they're
+ * encoded as a block. */
+#define COMPACT_BLOCK_SIZE 64*1024
+
+struct compact_encoder;
+
+/* Returns NULL if it can't be allocated. */
+struct compact_encoder *compact_encoder_new(void);
+
+/* Safe to call with NULL. */
+void compact_encoder_free(struct compact_encoder *e);
+
+/* Collect the classic points frames in the iovcnt buffers of iov. An
+ * extended frame's value may be split between buffers, but frame
+ * headers may not. Returns zero on success, -1 with errno set if a frame
+ * header is split or there is no memory for the frames. */
+int compact_add(struct compact_encoder *e, const struct iovec *iov, int iovcnt);
+
+/* How many bytes of classic frames have been collected since they were
+ * last encoded. */
+size_t compact_pending(const struct compact_encoder *e);
+
+/* Encode everything collected as blocks, preceded by the file header if
+ * header is set, and forget it. Returns the encoding, which belongs to
+ * the encoder and is good until it's next used, with its length in
+ * *len; or NULL if there is no memory for it. */
+const uint8_t *compact_encode(struct compact_encoder *e, bool header, size_t *len);
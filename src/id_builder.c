@@ -0,0 +1,131 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "siphash24.h"
+#include "marquise.h"
+
+/* The longest suffix kept in the builder's cache; longer ones are
+ * always hashed. */
+#define ID_CACHE_SUFFIX_MAX 48
+
+typedef struct {
+	uint64_t      address;
+	uint8_t       len;	/* Zero for an empty entry. */
+	unsigned char suffix[ID_CACHE_SUFFIX_MAX];
+} id_cache_entry;
+
+struct marquise_id_builder {
+	siphash_state   prefix_state;	/* SipHash state after the prefix. */
+	id_cache_entry *cache;
+	size_t          cache_mask;
+	size_t          cache_size;
+	uint64_t        hits;
+	uint64_t        misses;
+};
+
+marquise_id_builder *marquise_id_builder_new(const unsigned char *prefix, size_t prefix_len, size_t cache_size)
+{
+	marquise_id_builder *b = malloc(sizeof(marquise_id_builder));
+	if (b == NULL) {
+		return NULL;
+	}
+	unsigned char key[16];
+	memset(key, 0, 16);
+	siphash_init(&b->prefix_state, key);
+	siphash_update(&b->prefix_state, prefix, prefix_len);
+
+	/* Round the cache down to a power of two so a slot is a mask away. */
+	b->cache = NULL;
+	b->cache_size = 0;
+	b->cache_mask = 0;
+	if (cache_size > 0) {
+		size_t slots = 1;
+		while (slots <= cache_size / 2) {
+			slots *= 2;
+		}
+		b->cache = calloc(slots, sizeof(id_cache_entry));
+		if (b->cache == NULL) {
+			free(b);
+			return NULL;
+		}
+		b->cache_size = slots;
+		b->cache_mask = slots - 1;
+	}
+	b->hits = 0;
+	b->misses = 0;
+	return b;
+}
+
+marquise_id_builder *marquise_id_builder_extend(const marquise_id_builder *parent, const unsigned char *more, size_t more_len)
+{
+	marquise_id_builder *b = marquise_id_builder_new(NULL, 0, parent->cache_size);
+	if (b == NULL) {
+		return NULL;
+	}
+	b->prefix_state = parent->prefix_state;
+	siphash_update(&b->prefix_state, more, more_len);
+	return b;
+}
+
+/* Pick a cache slot from the suffix's length and its last few bytes,
+ * which are where suffixes sharing a prefix usually differ. */
+static size_t cache_slot(const marquise_id_builder *b, const unsigned char *suffix, size_t suffix_len)
+{
+	uint64_t h = suffix_len;
+	size_t start = suffix_len > 8 ? suffix_len - 8 : 0;
+	size_t i;
+	for (i = start; i < suffix_len; i++) {
+		h = (h << 8) | suffix[i];
+	}
+	h ^= (suffix_len > 0) ? (uint64_t)suffix[0] << 56 : 0;
+	h *= 0x9E3779B97F4A7C15ULL;
+	return (h >> 32) & b->cache_mask;
+}
+
+uint64_t marquise_id_builder_hash(marquise_id_builder *b, const unsigned char *suffix, size_t suffix_len)
+{
+	id_cache_entry *entry = NULL;
+	if (b->cache != NULL && suffix_len > 0 && suffix_len <= ID_CACHE_SUFFIX_MAX) {
+		entry = &b->cache[cache_slot(b, suffix, suffix_len)];
+		if (entry->len == suffix_len && memcmp(entry->suffix, suffix, suffix_len) == 0) {
+			b->hits++;
+			return entry->address;
+		}
+		b->misses++;
+	}
+
+	siphash_state state = b->prefix_state;
+	siphash_update(&state, suffix, suffix_len);
+	uint64_t address = siphash_final(&state) >> 1 << 1;
+
+	if (entry != NULL) {
+		entry->address = address;
+		entry->len = suffix_len;
+		memcpy(entry->suffix, suffix, suffix_len);
+	}
+	return address;
+}
+
+void marquise_id_builder_stats(const marquise_id_builder *b, uint64_t *hits, uint64_t *misses)
+{
+	*hits = b->hits;
+	*misses = b->misses;
+}
+
+void marquise_id_builder_free(marquise_id_builder *b)
+{
+	if (b == NULL) {
+		return;
+	}
+	free(b->cache);
+	free(b);
+}
@@ -7,6 +7,10 @@
  * redistribute it and/or modify it under the terms of the BSD license.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -17,10 +21,39 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <time.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "siphash24.h"
+#include "spool_uring.h"
+#include "source_cache.h"
+#include "compact.h"
+#include "spool_block.h"
 #include "marquise.h"
+#include "telemetry.h"
+#include "probes.h"
+
+#ifdef HAVE_SDT
+PROBE_SEMAPHORE(rotating_write);
+PROBE_SEMAPHORE(spool_write);
+PROBE_SEMAPHORE(rotate);
+PROBE_SEMAPHORE(spool_path);
+PROBE_SEMAPHORE(source_hit);
+PROBE_SEMAPHORE(source_miss);
+#endif
+
+/* POSIX only promises this with _XOPEN_SOURCE; 1024 is Linux's limit. */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /* Write the 32-bit value in v to the byte array p. */
 #define U32TO8_LE(p, v)                \
@@ -34,16 +67,155 @@
 	U32TO8_LE((p),     (uint32_t)((v)      )); \
 	U32TO8_LE((p) + 4, (uint32_t)((v) >> 32));
 
+/* Read a 32-bit value from the little-endian byte array p. */
+#define U8TO32_LE(p)                   \
+	(((uint32_t)((p)[0])      ) |  \
+	 ((uint32_t)((p)[1]) <<  8) |  \
+	 ((uint32_t)((p)[2]) << 16) |  \
+	 ((uint32_t)((p)[3]) << 24))
+
+/* Read a 64-bit value from the little-endian byte array p. */
+#define U8TO64_LE(p)                   \
+	(((uint64_t)((p)[0])      ) |  \
+	 ((uint64_t)((p)[1]) <<  8) |  \
+	 ((uint64_t)((p)[2]) << 16) |  \
+	 ((uint64_t)((p)[3]) << 24) |  \
+	 ((uint64_t)((p)[4]) << 32) |  \
+	 ((uint64_t)((p)[5]) << 40) |  \
+	 ((uint64_t)((p)[6]) << 48) |  \
+	 ((uint64_t)((p)[7]) << 56))
+
+/* A producer thread's staging rings for one context, one per spool
+ * type. Each is single-producer (the owning thread) single-consumer
+ * (whoever holds the context's write_lock), so pushing a frame needs no
+ * lock: head and tail are free-running byte counts, published with
+ * release stores.
+ *
+ * The struct is shared between the context and the thread, and freed by
+ * whichever of them lets go last. The rings themselves belong to the
+ * context and go as soon as it is done with them.
+ */
+struct marquise_staging {
+	struct marquise_staging *next;
+	uint8_t *ring[2];
+	size_t   head[2];
+	size_t   tail[2];
+	int      retired;
+	int      refs;
+};
+
+/* Drop one reference to a staging struct, freeing it on the last. */
+void staging_unref(struct marquise_staging *st)
+{
+	if (__atomic_sub_fetch(&st->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(st);
+	}
+}
+
+/* Preallocate the spool file fd to size bytes and map it. Returns the
+ * mapping, or NULL on failure, in which case frames are written to the
+ * file as usual. */
+uint8_t *map_segment(int fd, size_t size)
+{
+	if (posix_fallocate(fd, 0, size) != 0) {
+		return NULL;
+	}
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ftruncate(fd, 0);
+		return NULL;
+	}
+	return map;
+}
+
+/* Unmap the writer's spool file, if it is mapped, and trim it to the
+ * frames actually stored. Writes to the file carry on from there. Zero
+ * on success, -1 on failure. */
+int spool_unmap(marquise_spool_writer *w)
+{
+	if (w->map == NULL) {
+		return 0;
+	}
+	munmap(w->map, w->map_size);
+	w->map = NULL;
+	if (ftruncate(w->fd, w->map_used) != 0) {
+		return -1;
+	}
+	return lseek(w->fd, 0, SEEK_END) < 0 ? -1 : 0;
+}
+
+void rotator_stop(marquise_ctx *ctx);
+int shutdown_finish(marquise_ctx *ctx, bool lost);
+void discard_segment(marquise_ctx *ctx, const marquise_spool_writer *w, marquise_spool_segment *seg);
+
 /* Safe and complete destructor for marquise_ctxs */
 void free_ctx(marquise_ctx *ctx) {
 	if (ctx == NULL) return;
+	telemetry_stop(ctx->telemetry);
+	rotator_stop(ctx);
 	free(ctx->marquise_namespace);
 	free(ctx->spool_path_points);
 	free(ctx->spool_path_contents);
-	/* This avoids getting a dumb error message: */
-	/* GLib-CRITICAL **: g_tree_destroy: assertion 'tree != NULL' failed */
-	if (ctx->sd_hashes != NULL) {
-		g_tree_destroy(ctx->sd_hashes);
+	source_cache_free(ctx->sd_hashes);
+	compact_encoder_free(ctx->compact);
+	spool_codec_free(ctx->codec);
+	if (ctx->source_pool != NULL) {
+		g_thread_pool_free(ctx->source_pool, FALSE, TRUE);
+	}
+	/* The ring has to finish with the spool files before they close. */
+	uring_free(ctx->uring);
+	spool_unmap(&ctx->writer_points);
+	spool_unmap(&ctx->writer_contents);
+	if (ctx->writer_points.fd >= 0) {
+		close(ctx->writer_points.fd);
+	}
+	if (ctx->writer_contents.fd >= 0) {
+		close(ctx->writer_contents.fd);
+	}
+	/* Anything still in tmp/ never got going, so nobody wants it. */
+	if (ctx->writer_points.tmp_path != NULL) {
+		unlink(ctx->writer_points.tmp_path);
+		free(ctx->writer_points.tmp_path);
+	}
+	if (ctx->writer_contents.tmp_path != NULL) {
+		unlink(ctx->writer_contents.tmp_path);
+		free(ctx->writer_contents.tmp_path);
+	}
+	discard_segment(ctx, &ctx->writer_points, &ctx->writer_points.next);
+	discard_segment(ctx, &ctx->writer_contents, &ctx->writer_contents.next);
+	if (ctx->writer_points.dirfd >= 0) {
+		close(ctx->writer_points.dirfd);
+	}
+	if (ctx->writer_contents.dirfd >= 0) {
+		close(ctx->writer_contents.dirfd);
+	}
+	free(ctx->writer_points.dir_path);
+	free(ctx->writer_contents.dir_path);
+	free(ctx->writer_points.buf);
+	free(ctx->writer_contents.buf);
+	free(ctx->writer_points.block);
+	free(ctx->writer_contents.block);
+	while (ctx->stagings != NULL) {
+		struct marquise_staging *st = ctx->stagings;
+		ctx->stagings = st->next;
+		free(st->ring[SPOOL_POINTS]);
+		free(st->ring[SPOOL_CONTENTS]);
+		staging_unref(st);
+	}
+	free(ctx->drain_buf);
+	g_mutex_clear(&ctx->cache_lock);
+	g_mutex_clear(&ctx->write_lock);
+	g_mutex_clear(&ctx->queue_lock);
+	g_cond_clear(&ctx->queue_cond);
+	g_cond_clear(&ctx->space_cond);
+	g_cond_clear(&ctx->stopped_cond);
+	g_mutex_clear(&ctx->sync_lock);
+	g_cond_clear(&ctx->sync_cond);
+	g_mutex_clear(&ctx->rotator_lock);
+	g_cond_clear(&ctx->rotator_cond);
+	/* Let go of the namespace lock, if we got as far as taking it. */
+	if (ctx->lock_fd > 0) {
+		close(ctx->lock_fd);
 	}
 	free(ctx);
 }
@@ -64,13 +236,22 @@ uint8_t valid_namespace(char *namespace)
 	return 1;
 }
 
-/* Return 1 if supplied source tag is valid (no colons or commas);
- * otherwise return zero.
- */
-uint8_t valid_source_tag(char *tag)
+/* Return 1 if the len bytes at tag contain no ',' or ':', else 0. */
+uint8_t valid_source_tag_len(const char *tag, size_t len)
 {
-	int i;
-	for (i=0; i < strlen(tag); i++) {
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i comma = _mm_set1_epi8(',');
+	const __m128i colon = _mm_set1_epi8(':');
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(tag + i));
+		__m128i bad = _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, colon));
+		if (_mm_movemask_epi8(bad) != 0) {
+			return 0;
+		}
+	}
+#endif
+	for (; i < len; i++) {
 		if (tag[i] == ',' || tag[i] == ':') {
 			return 0;
 		}
@@ -78,6 +259,59 @@ uint8_t valid_source_tag(char *tag)
 	return 1;
 }
 
+/* Measure the NUL-terminated tag and check it for ',' and ':' in the
+ * same pass, returning its length and setting *valid. Sixteen bytes are
+ * examined at a time using aligned loads, which never cross into a page
+ * the string doesn't reach, but may read past its end within one; hence
+ * no ASan. */
+#if defined(__SANITIZE_ADDRESS__)
+__attribute__((no_sanitize_address))
+#endif
+size_t scan_source_tag(const char *tag, uint8_t *valid)
+{
+#ifdef __SSE2__
+	const __m128i nul = _mm_setzero_si128();
+	const __m128i comma = _mm_set1_epi8(',');
+	const __m128i colon = _mm_set1_epi8(':');
+	size_t offset = (uintptr_t)tag & 15;
+	const char *p = tag - offset;
+	/* Ignore the bytes before the start of the tag in the first block. */
+	unsigned int skip = ~0U << offset;
+	for (;;) {
+		__m128i v = _mm_load_si128((const __m128i *)p);
+		unsigned int end = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nul)) & skip;
+		unsigned int bad = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, comma),
+		                                                  _mm_cmpeq_epi8(v, colon))) & skip;
+		if (end != 0) {
+			/* Only separators before the terminator count. */
+			unsigned int before = end & -end;
+			*valid = (bad & (before - 1)) == 0;
+			return p + __builtin_ctz(end) - tag;
+		}
+		if (bad != 0) {
+			*valid = 0;
+			return strlen(tag);
+		}
+		p += 16;
+		skip = ~0U;
+	}
+#else
+	size_t len = strlen(tag);
+	*valid = valid_source_tag_len(tag, len);
+	return len;
+#endif
+}
+
+/* Return 1 if supplied source tag is valid (no colons or commas);
+ * otherwise return zero.
+ */
+uint8_t valid_source_tag(char *tag)
+{
+	uint8_t valid;
+	scan_source_tag(tag, &valid);
+	return valid;
+}
+
 /* Create a directory at path if it does not exist. Zero on success, -1 on
  * failure. */
 int mkdirp(char *path)
@@ -90,6 +324,124 @@ int mkdirp(char *path)
 	return 0;
 }
 
+/* Parse a non-negative decimal size from str into *size. Zero on
+ * success, -1 if str isn't one. */
+int parse_size(const char *str, size_t *size)
+{
+	if (str[0] == '\0' || str[0] == '-') {
+		return -1;
+	}
+	char *end;
+	int saved_errno = errno;
+	errno = 0;
+	unsigned long long n = strtoull(str, &end, 10);
+	bool bad = errno != 0 || *end != '\0' || n > SIZE_MAX;
+	errno = saved_errno;
+	if (bad) {
+		return -1;
+	}
+	*size = n;
+	return 0;
+}
+
+#define OPTION_STRING 0
+#define OPTION_SIZE   1
+#define OPTION_FLAG   2
+
+/* Each setting in marquise_options, by the environment variable that
+ * sets it. */
+static const struct {
+	const char *name;
+	int         kind;
+	size_t      offset;
+} options_by_name[] = {
+	{ "MARQUISE_SPOOL_DIR",             OPTION_STRING, offsetof(marquise_options, spool_dir) },
+	{ "MARQUISE_LOCK_DIR",              OPTION_STRING, offsetof(marquise_options, lock_dir) },
+	{ "DISABLE_NAMESPACE_LOCK",         OPTION_FLAG,   offsetof(marquise_options, disable_namespace_lock) },
+	{ "MARQUISE_ROTATE_SIZE",           OPTION_SIZE,   offsetof(marquise_options, rotate_size) },
+	{ "MARQUISE_ROTATE_AGE",            OPTION_SIZE,   offsetof(marquise_options, rotate_age) },
+	{ "MARQUISE_ROTATE_INTERVAL",       OPTION_SIZE,   offsetof(marquise_options, rotate_interval) },
+	{ "MARQUISE_WRITE_BUFFER_SIZE",     OPTION_SIZE,   offsetof(marquise_options, write_buffer_size) },
+	{ "MARQUISE_SPOOL_WRITER",          OPTION_STRING, offsetof(marquise_options, spool_writer) },
+	{ "MARQUISE_IO_URING_DEPTH",        OPTION_SIZE,   offsetof(marquise_options, io_uring_depth) },
+	{ "MARQUISE_IO_URING_SYNC",         OPTION_FLAG,   offsetof(marquise_options, io_uring_sync) },
+	{ "MARQUISE_SPOOL_FORMAT",          OPTION_STRING, offsetof(marquise_options, spool_format) },
+	{ "MARQUISE_SPOOL_COMPRESSION",     OPTION_STRING, offsetof(marquise_options, spool_compression) },
+	{ "MARQUISE_SPOOL_BLOCK_SIZE",      OPTION_SIZE,   offsetof(marquise_options, spool_block_size) },
+	{ "MARQUISE_DURABILITY",            OPTION_STRING, offsetof(marquise_options, durability) },
+	{ "MARQUISE_GROUP_COMMIT_INTERVAL", OPTION_SIZE,   offsetof(marquise_options, group_commit_interval) },
+	{ "MARQUISE_ASYNC",                 OPTION_FLAG,   offsetof(marquise_options, async) },
+	{ "MARQUISE_ASYNC_QUEUE_SIZE",      OPTION_SIZE,   offsetof(marquise_options, async_queue_size) },
+	{ "MARQUISE_ASYNC_FLUSH_INTERVAL",  OPTION_SIZE,   offsetof(marquise_options, async_flush_interval) },
+	{ "MARQUISE_SOURCE_CACHE_MEMORY",   OPTION_SIZE,   offsetof(marquise_options, source_cache_memory) },
+	{ "MARQUISE_SOURCE_CACHE_PERSIST",  OPTION_FLAG,   offsetof(marquise_options, source_cache_persist) },
+	{ "MARQUISE_SOURCE_WORKERS",        OPTION_SIZE,   offsetof(marquise_options, source_workers) },
+	{ "MARQUISE_TELEMETRY_INTERVAL",    OPTION_SIZE,   offsetof(marquise_options, telemetry_interval) },
+};
+
+int marquise_options_set(marquise_options *opts, const char *name, const char *value)
+{
+	size_t i;
+	for (i = 0; i < sizeof(options_by_name) / sizeof(options_by_name[0]); i++) {
+		if (strcmp(name, options_by_name[i].name) != 0) {
+			continue;
+		}
+		char *field = (char *)opts + options_by_name[i].offset;
+		switch (options_by_name[i].kind) {
+		case OPTION_STRING:
+			*(const char **)field = value;
+			return 0;
+		case OPTION_SIZE:
+			if (parse_size(value, (size_t *)field) != 0) {
+				errno = EINVAL;
+				return -1;
+			}
+			return 0;
+		default:
+			/* Anything but a string starting with '0' is true. */
+			*(bool *)field = value[0] != '0';
+			return 0;
+		}
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+void marquise_options_init(marquise_options *opts)
+{
+	opts->spool_dir = MARQUISE_SPOOL_DIR;
+	opts->lock_dir = MARQUISE_LOCK_DIR;
+	opts->disable_namespace_lock = DISABLE_NAMESPACE_LOCK;
+	opts->rotate_size = MARQUISE_ROTATE_SIZE;
+	opts->rotate_age = MARQUISE_ROTATE_AGE;
+	opts->rotate_interval = MARQUISE_ROTATE_INTERVAL;
+	opts->write_buffer_size = MARQUISE_WRITE_BUFFER_SIZE;
+	opts->spool_writer = MARQUISE_SPOOL_WRITER;
+	opts->io_uring_depth = MARQUISE_IO_URING_DEPTH;
+	opts->io_uring_sync = MARQUISE_IO_URING_SYNC;
+	opts->spool_format = MARQUISE_SPOOL_FORMAT;
+	opts->spool_compression = MARQUISE_SPOOL_COMPRESSION;
+	opts->spool_block_size = MARQUISE_SPOOL_BLOCK_SIZE;
+	opts->durability = MARQUISE_DURABILITY;
+	opts->group_commit_interval = MARQUISE_GROUP_COMMIT_INTERVAL;
+	opts->async = MARQUISE_ASYNC;
+	opts->async_queue_size = MARQUISE_ASYNC_QUEUE_SIZE;
+	opts->async_flush_interval = MARQUISE_ASYNC_FLUSH_INTERVAL;
+	opts->source_cache_memory = MARQUISE_SOURCE_CACHE_MEMORY;
+	opts->source_cache_persist = MARQUISE_SOURCE_CACHE_PERSIST;
+	opts->source_workers = MARQUISE_SOURCE_WORKERS;
+	opts->telemetry_interval = MARQUISE_TELEMETRY_INTERVAL;
+
+	/* A variable that won't parse leaves the default alone. */
+	size_t i;
+	for (i = 0; i < sizeof(options_by_name) / sizeof(options_by_name[0]); i++) {
+		const char *value = getenv(options_by_name[i].name);
+		if (value != NULL) {
+			marquise_options_set(opts, options_by_name[i].name, value);
+		}
+	}
+}
+
 uint64_t marquise_hash_identifier(const unsigned char *id, size_t id_len)
 {
 	unsigned char key[16];
@@ -98,6 +450,17 @@ uint64_t marquise_hash_identifier(const unsigned char *id, size_t id_len)
 	return addr >> 1 << 1;
 }
 
+void marquise_hash_identifiers_batch(const unsigned char *const *ids, const size_t *id_lens, size_t n, uint64_t *addresses)
+{
+	unsigned char key[16];
+	memset(key, 0, 16);
+	siphash_batch(ids, id_lens, n, key, addresses);
+	size_t i;
+	for (i = 0; i < n; i++) {
+		addresses[i] = addresses[i] >> 1 << 1;
+	}
+}
+
 /* Build up the the folder structure for the lock file, ensuring parent folder exists.
  * Return NULL on failure
  * Return the path to the lock file on success
@@ -173,27 +536,32 @@ int lock_namespace(const char *lock_path)
 	return fd;
 }
 
-char *build_spool_path(const char *spool_prefix, char *namespace, const char* spool_type)
+/* Open the spool directory for namespace and spool_type ("points" or
+ * "contents") under spool_prefix, creating it and the tmp/ and new/
+ * directories within as required. Returns a descriptor for the
+ * directory and stores its path, with a trailing slash, in *dir_path;
+ * or returns -1 on failure.
+ */
+int open_spool_dir(const char *spool_prefix, char *namespace, const char* spool_type, char **dir_path)
 {
 	int ret;
 
 	const char* pathsep = "/";
 	const char* new     = "new/";
-	const char* tmp_tpl = "XXXXXX";
+	const char* tmp     = "tmp/";  /* Same length as new/. */
 
 	size_t prefix_len     = strlen(spool_prefix);
 	size_t ns_len         = strlen(namespace);
 	size_t spool_type_len = strlen(spool_type);  /* points or contents */
 	size_t new_len        = strlen(new);         /* new/    */
-	size_t tmp_tpl_len    = strlen(tmp_tpl);     /* XXXXXX  */
 
 	size_t spool_path_len =
-		prefix_len + 1 + ns_len + 1 + spool_type_len    + 1 + new_len + tmp_tpl_len + 1;
-	/*                   /            /   points-or-contents  /   new/      XXXXXX        \0  */
+		prefix_len + 1 + ns_len + 1 + spool_type_len    + 1 + new_len + 1;
+	/*                   /            /   points-or-contents  /   new/      \0  */
 
 	char *spool_path = malloc(spool_path_len);
 	if (spool_path == NULL) {
-		return NULL;
+		return -1;
 	}
 	char* spool_path_end = spool_path;
 
@@ -209,7 +577,7 @@ char *build_spool_path(const char *spool_prefix, char *namespace, const char* sp
 	ret = mkdirp(spool_path);  /* Will return -1 on failure, with errno set to whatever mkdir(3) indicates. */
 	if (ret != 0) {
 		free(spool_path);
-		return NULL;
+		return -1;
 	}
 
 	spool_path_end = stpncpy(spool_path_end, spool_type, spool_type_len);  /*  /prefix/namespace/{points,contents}   */
@@ -218,380 +586,2565 @@ char *build_spool_path(const char *spool_prefix, char *namespace, const char* sp
 	ret = mkdirp(spool_path);  /* See above for failure notes. */
 	if (ret != 0) {
 		free(spool_path);
-		return NULL;
+		return -1;
 	}
 
-	spool_path_end = stpncpy(spool_path_end, new, new_len);                /*  /prefix/namespace/{points,contents}/new/  */
+	char *dir_end = spool_path_end;
+	stpncpy(dir_end, new, new_len);                                        /*  /prefix/namespace/{points,contents}/new/  */
 	/* Create new path if it doesn't exist. */
 	ret = mkdirp(spool_path);  /* See above. */
 	if (ret != 0) {
 		free(spool_path);
-		return NULL;
+		return -1;
 	}
+	stpncpy(dir_end, tmp, new_len);                                        /*  /prefix/namespace/{points,contents}/tmp/  */
+	/* And tmp/, where spool files are written until then. */
+	ret = mkdirp(spool_path);  /* See above. */
+	if (ret != 0) {
+		free(spool_path);
+		return -1;
+	}
+	*dir_end = '\0';                                                       /*  /prefix/namespace/{points,contents}/  */
 
-	spool_path_end = stpncpy(spool_path_end, tmp_tpl, tmp_tpl_len);        /*  /prefix/namespace/{points,contents}/new/XXXXXX  */
-
-	int tmpf = mkstemp(spool_path);
-	if (tmpf < 0) {
+	int dirfd = open(spool_path, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
 		free(spool_path);
-		return NULL;
+		return -1;
 	}
-	return spool_path;
+	*dir_path = spool_path;
+	return dirfd;
 }
 
-int maybe_rotate(marquise_ctx *ctx, spool_type t) {
-	/* If the file is under max size, we're done, else rotate */
-	if (t == SPOOL_POINTS) {
-		if (ctx->bytes_written_points < MAX_SPOOL_FILE_SIZE) {
-			return 0;
-		}
-	} else {
-		if (ctx->bytes_written_contents < MAX_SPOOL_FILE_SIZE) {
-			return 0;
-		}
+/* Return the path of the source dict cache file for namespace under
+ * spool_prefix, or NULL on failure. open_spool_dir() has already
+ * created the directory. */
+char *build_source_cache_path(const char *spool_prefix, char *namespace)
+{
+	const char *cache_name = "source_cache";
+	/*                       prefix                 /   namespace           /   source_cache         \0 */
+	size_t cache_path_len = strlen(spool_prefix) + 1 + strlen(namespace) + 1 + strlen(cache_name) + 1;
+	char *cache_path = malloc(cache_path_len);
+	if (cache_path == NULL) {
+		return NULL;
 	}
+	snprintf(cache_path, cache_path_len, "%s/%s/%s", spool_prefix, namespace, cache_name);
+	return cache_path;
+}
 
-	const char *spool_type_paths = (t == SPOOL_POINTS) ? "points" : "contents";
-
-	const char *envvar_spool_prefix = getenv("MARQUISE_SPOOL_DIR");
-	const char *default_spool_prefix = MARQUISE_SPOOL_DIR;
-	const char *spool_prefix =
-		(envvar_spool_prefix ==
-		 NULL) ? default_spool_prefix : envvar_spool_prefix;
+/* Return the writer for spool type t. */
+marquise_spool_writer *spool_writer(marquise_ctx *ctx, spool_type t)
+{
+	return (t == SPOOL_POINTS) ? &ctx->writer_points : &ctx->writer_contents;
+}
 
-	char *new_spool_path = build_spool_path(spool_prefix, ctx->marquise_namespace, spool_type_paths);
-	/* If new path fails to generate, keep using old one for now. */
-	if (new_spool_path == NULL) {
-		return -1;
+/* Write all of buf to fd, retrying on short writes and EINTR. Returns
+ * the number of bytes written; if this is less than len, errno is set.
+ */
+size_t write_all(int fd, const uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = write(fd, buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		done += ret;
 	}
+	return done;
+}
 
-	if (t == SPOOL_POINTS) {
-		free(ctx->spool_path_points);
-		ctx->spool_path_points = new_spool_path;
-		ctx->bytes_written_points = 0;
-	} else {
-		free(ctx->spool_path_contents);
-		ctx->spool_path_contents = new_spool_path;
-		ctx->bytes_written_contents = 0;
+/* Write all of the iovcnt buffers in iov to fd, retrying on short
+ * writes and EINTR and splitting at IOV_MAX. iov is consumed as it is
+ * written: on return each element's iov_base and iov_len describe
+ * whatever of it has not been written. Zero on success, -1 on failure
+ * with errno set.
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t ret = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov->iov_len = 0;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
 	}
 	return 0;
 }
 
-/* Hash comparator for the sourcedict cache.
- * We ignore user_data. */
-gint hash_comp(gconstpointer a, gconstpointer b, gpointer user_data) {
-	return *(uint64_t*)a - *(uint64_t*)b;
+/* Add n to one of ctx's statistics counters. They are only changed
+ * with write_lock held, but marquise_get_stats() reads them without it,
+ * so each store is atomic. */
+#define stat_add(ctx, counter, n) \
+	__atomic_store_n(&(ctx)->stats.counter, (ctx)->stats.counter + (n), __ATOMIC_RELAXED)
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-marquise_ctx *marquise_init(char *marquise_namespace)
+/* Count a write to the kernel for spool type t which took ns
+ * nanoseconds and returned ret in the latency histogram. The io_uring
+ * writer calls this as each of its writes completes. */
+void record_latency(void *data, int t, uint64_t ns, int ret)
 {
-	marquise_ctx *ctx = malloc(sizeof(marquise_ctx));
-	if (ctx == NULL) {
-		return NULL;
+	marquise_ctx *ctx = data;
+	PROBE3(spool_write, t, ns, ret);
+	/* Bucket i holds latencies from 2^(i-1) up to 2^i nanoseconds. */
+	int bucket = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+	if (bucket >= MARQUISE_STATS_LATENCY_BUCKETS) {
+		bucket = MARQUISE_STATS_LATENCY_BUCKETS - 1;
 	}
+	stat_add(ctx, write_latency[bucket], 1);
+}
 
-	/* Zero the struct to ensure it's clean. This allows free_ctx() to run
-	 * with gay abandon, because it has no context as to which struct
-	 * members have or haven't been safely defined.
-	 */
-	ctx->marquise_namespace = NULL;
-	ctx->spool_path_points = NULL;
-	ctx->spool_path_contents = NULL;
-	ctx->lock_path = NULL;
-	ctx->lock_fd = 0;
-	ctx->sd_hashes = NULL;
-
-	if (!valid_namespace(marquise_namespace)) {
-		errno = EINVAL;
-		free_ctx(ctx);
-		return NULL;
-	}
-	ctx->marquise_namespace = strdup(marquise_namespace);
-	if (ctx->marquise_namespace == NULL) {
-		free_ctx(ctx);
-		return NULL;
+/* Count a write to the kernel for spool type t begun at start_ns (from
+ * monotonic_ns()) in the latency histogram, and an error if it failed. */
+void record_write(marquise_ctx *ctx, spool_type t, uint64_t start_ns, int ret)
+{
+	record_latency(ctx, t, monotonic_ns() - start_ns, ret);
+	if (ret != 0) {
+		stat_add(ctx, write_errors, 1);
 	}
+}
 
-	/* Create the lock for this namespace */
-	int disable_namespace_lock = DISABLE_NAMESPACE_LOCK; /* Establish default value. */
-	const char* env_temp = getenv("DISABLE_NAMESPACE_LOCK");
-	if (env_temp != NULL) {
-		/* Assume that locking is being disabled, unless we see
-		 * specific indications otherwise. */
-		disable_namespace_lock = true;
-		if (env_temp[0] == '0') {
-			disable_namespace_lock = false;
-		}
+size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
 	}
+	return len;
+}
 
-	if (disable_namespace_lock == true) {
-		printf("DISABLE_NAMESPACE_LOCK invoked. This process will not lock on the namespace %s\n", ctx->marquise_namespace);
-	} else {
-		/* Lock the namespace so another process cannot access it */
-		const char *envvar_lock_prefix = getenv("MARQUISE_LOCK_DIR");
-		const char *default_lock_prefix = MARQUISE_LOCK_DIR;
-		const char *lock_prefix = (envvar_lock_prefix == NULL) ? default_lock_prefix : envvar_lock_prefix;
-
-		ctx->lock_path = build_lock_path(lock_prefix, marquise_namespace);
-
-		if (ctx->lock_path == NULL) {
-			free_ctx(ctx);
-			return NULL;
-		}
-
-		/* Exit out if namespace lock doesn't work - someone else is here */
-		ctx->lock_fd = lock_namespace(ctx->lock_path);
-		if (ctx->lock_fd == -1) {
-			free_ctx(ctx);
-			return NULL;
-		}
+int spool_append(marquise_ctx *ctx, spool_type t, struct iovec *iov, int iovcnt);
 
-	}
+/* Return whether nothing has gone into spool type t's current file yet,
+ * not even into a block still being filled. */
+bool segment_empty(marquise_ctx *ctx, spool_type t)
+{
+	size_t bytes = (t == SPOOL_POINTS) ? ctx->bytes_written_points : ctx->bytes_written_contents;
+	return bytes == 0 && spool_writer(ctx, t)->block_used == 0;
+}
 
-	/* Create spool dir, et al */
-	const char *envvar_spool_prefix = getenv("MARQUISE_SPOOL_DIR");
-	const char *default_spool_prefix = MARQUISE_SPOOL_DIR;
-	const char *spool_prefix =
-		(envvar_spool_prefix ==
-		 NULL) ? default_spool_prefix : envvar_spool_prefix;
-
-	ctx->spool_path_points = build_spool_path(spool_prefix, marquise_namespace, "points");
-	if (ctx->spool_path_points == NULL) {
-		free_ctx(ctx);
-		return NULL;
+/* With the compact format, write out the points the encoder has
+ * collected as blocks, starting the spool file with the format's
+ * header if nothing has been written to it yet. Zero on success (or if
+ * there is nothing to write), -1 on failure, in which case the points
+ * are lost. */
+int emit_compact(marquise_ctx *ctx)
+{
+	if (ctx->compact == NULL || compact_pending(ctx->compact) == 0) {
+		return 0;
 	}
-
-	ctx->spool_path_contents = build_spool_path(spool_prefix, marquise_namespace, "contents");
-	if (ctx->spool_path_contents == NULL) {
-		free_ctx(ctx);
-		return NULL;
+	struct iovec iov[2];
+	size_t len;
+	const uint8_t *encoded = compact_encode(ctx->compact, segment_empty(ctx, SPOOL_POINTS), &len);
+	if (encoded == NULL) {
+		stat_add(ctx, write_errors, 1);
+		return -1;
 	}
-	ctx->bytes_written_points = 0;
-	ctx->bytes_written_contents = 0;
-	ctx->sd_hashes = g_tree_new_full(hash_comp, NULL, free, free);
-	return ctx;
+	iov[1].iov_base = (void *)encoded;
+	iov[1].iov_len = len;
+	return spool_append(ctx, SPOOL_POINTS, iov, 2);
 }
 
-/* Writes the context of buf (representing an already-serialized
- * datapoint, either simple or extended) to the current spool file.
- * If (post-write) the amount of data we've written to the current spool
- * file exceeds MAX_SPOOL_FILE_SIZE, set a new spool file as current for
- * next time.
- *
- * Returns zero on success, -1 on error, or panics and exits with status
- * 1 if passed an invalid spool type.
- */
-int rotating_write(marquise_ctx * ctx, uint8_t *buf, size_t buf_size, spool_type t) {
-	char* spool_path = (t == SPOOL_POINTS) ? ctx->spool_path_points : ctx->spool_path_contents ;
-	FILE *spool = fopen(spool_path, "a");
-	if (spool == NULL) {
-		return -1;
-	}
-	if (fwrite((void *)buf, 1, buf_size, spool) != buf_size) {
-		fclose(spool);
-		return -1;
+int spool_store(marquise_ctx *ctx, spool_type t, struct iovec *iov, int iovcnt);
+
+/* With block compression, compress what has been collected for spool
+ * type t and write it out as a block, starting the spool file with the
+ * file header if nothing has been written to it yet. Zero on success
+ * (or if there is nothing to write), -1 on failure, in which case the
+ * block is lost. */
+int emit_block(marquise_ctx *ctx, spool_type t)
+{
+	marquise_spool_writer *w = spool_writer(ctx, t);
+	if (ctx->codec == NULL || w->block_used == 0) {
+		return 0;
 	}
-	if (t == SPOOL_POINTS) {
-		ctx->bytes_written_points += buf_size;
-	} else if (t == SPOOL_CONTENTS) {
-		ctx->bytes_written_contents += buf_size;
-	} else {
-		/* We were passed an invalid spool_type, shouldn't ever
-		 * happen as this function isn't exposed. */
-		fprintf(stderr, "rotating_write: passed an invalid spool type %d, this can't happen. Please report a bug.\n", t);
-		fclose(spool);
-		exit(EXIT_FAILURE);
+	uint8_t header[SPOOL_BLOCK_FILE_HEADER_LEN];
+	struct iovec iov[3];
+	int iovcnt = 1;
+	size_t bytes = (t == SPOOL_POINTS) ? ctx->bytes_written_points : ctx->bytes_written_contents;
+	if (bytes == 0) {
+		spool_codec_file_header(ctx->codec, header);
+		iov[iovcnt].iov_base = header;
+		iov[iovcnt].iov_len = SPOOL_BLOCK_FILE_HEADER_LEN;
+		iovcnt++;
 	}
-	maybe_rotate(ctx, t);
-	return fclose(spool) ? -1 : 0;
+	size_t len;
+	iov[iovcnt].iov_base = (void *)spool_codec_compress(ctx->codec, w->block, w->block_used, &len);
+	iov[iovcnt].iov_len = len;
+	iovcnt++;
+	w->block_used = 0;
+	return spool_store(ctx, t, iov, iovcnt);
 }
 
-int marquise_send_simple(marquise_ctx * ctx, uint64_t address,
-			 uint64_t timestamp, uint64_t value)
+/* Write out anything held back from spool type t's file for the compact
+ * format or block compression. Zero on success, -1 on failure. */
+int emit_pending(marquise_ctx *ctx, spool_type t)
 {
-	uint8_t buf[24];
-	/* Clear the LSB for a simple frame. */
-	address = address >> 1 << 1;
-
-	U64TO8_LE(buf, address);
-	U64TO8_LE(buf + 8, timestamp);
-	U64TO8_LE(buf + 16, value);
-	return rotating_write(ctx, buf, 24, SPOOL_POINTS);
+	if (t == SPOOL_POINTS && emit_compact(ctx) != 0) {
+		return -1;
+	}
+	return emit_block(ctx, t);
 }
 
-int marquise_send_extended(marquise_ctx * ctx, uint64_t address,
-			   uint64_t timestamp, char *value, size_t value_len)
+/* Write out the buffered frames for spool type t. Zero on success, -1
+ * on failure; anything not written stays at the front of the buffer.
+ */
+int flush_spool(marquise_ctx *ctx, spool_type t)
 {
-	size_t buf_len = 24 + value_len;
-	if (buf_len < value_len) {
-		errno = EINVAL; 	// Overflow
+	uint64_t start;
+	int ret;
+	if (emit_pending(ctx, t) != 0) {
 		return -1;
 	}
-
-	uint8_t *buf = malloc(buf_len);
-	if (buf == NULL) {
+	if (ctx->uring != NULL) {
+		/* Latency is recorded as each write completes. */
+		ret = uring_flush(ctx->uring);
+		if (ret != 0) {
+			stat_add(ctx, write_errors, 1);
+		}
+		return ret;
+	}
+	marquise_spool_writer *w = spool_writer(ctx, t);
+	if (w->buf_used == 0) {
+		return 0;
+	}
+	start = monotonic_ns();
+	size_t done = write_all(w->fd, w->buf, w->buf_used);
+	ret = (done < w->buf_used) ? -1 : 0;
+	record_write(ctx, t, start, ret);
+	if (ret != 0) {
+		memmove(w->buf, w->buf + done, w->buf_used - done);
+		w->buf_used -= done;
 		return -1;
 	}
-
-	uint64_t length_word = value_len;
-	/* Set the LSB for an extended frame. */
-	address |= 1;
-	U64TO8_LE(buf, address);
-	U64TO8_LE(buf + 8, timestamp);
-	U64TO8_LE(buf + 16, length_word);
-	memcpy(buf + 24, value, value_len);
-	int ret = rotating_write(ctx, buf, buf_len, SPOOL_POINTS);
-	free(buf);
-	return ret;
+	w->buf_used = 0;
+	return 0;
 }
 
-int marquise_shutdown(marquise_ctx * ctx)
+/* Write the bytes in iov[1..iovcnt-1] to spool type t's file, without
+ * rotating. iov[0] is scratch space for the writer's own use: if the
+ * bytes fit in the write buffer they are copied there, otherwise the
+ * buffered bytes are placed in iov[0] and everything goes out in a
+ * single writev(). With the mmap writer they are copied into the
+ * mapping instead, and with the io_uring writer they are queued on the
+ * ring. Returns zero on success, -1 on error.
+ */
+int spool_store(marquise_ctx *ctx, spool_type t, struct iovec *iov, int iovcnt)
 {
-	int ret = 0;
-	if (fcntl(ctx->lock_fd, F_GETFD) > 0) {
-		ret = flock(ctx->lock_fd, LOCK_UN);
-		if (ret != 0) {
+	marquise_spool_writer *w = spool_writer(ctx, t);
+	size_t len = iov_length(iov + 1, iovcnt - 1);
+	int i;
+
+	/* If this is what takes a mapped segment over the top, trim it and
+	 * append the rest the ordinary way. */
+	if (w->map != NULL && len > w->map_size - w->map_used) {
+		if (spool_unmap(w) != 0) {
+			stat_add(ctx, write_errors, 1);
 			return -1;
 		}
 	}
 
-	if (access(ctx->lock_path, F_OK) != -1) {
-		ret = unlink(ctx->lock_path);
-		if (ret != 0) {
+	if (ctx->uring != NULL) {
+		/* Only queued here; timed when the write completes. */
+		if (uring_append(ctx->uring, t, w->fd, iov + 1, iovcnt - 1) != 0) {
+			stat_add(ctx, write_errors, 1);
 			return -1;
 		}
+	} else if (w->map != NULL) {
+		for (i = 1; i < iovcnt; i++) {
+			memcpy(w->map + w->map_used, iov[i].iov_base, iov[i].iov_len);
+			w->map_used += iov[i].iov_len;
+		}
+	} else if (len <= ctx->write_buf_size - w->buf_used) {
+		for (i = 1; i < iovcnt; i++) {
+			memcpy(w->buf + w->buf_used, iov[i].iov_base, iov[i].iov_len);
+			w->buf_used += iov[i].iov_len;
+		}
+	} else {
+		iov[0].iov_base = w->buf;
+		iov[0].iov_len = w->buf_used;
+		uint64_t start = monotonic_ns();
+		int ret = writev_all(w->fd, iov, iovcnt);
+		record_write(ctx, t, start, ret);
+		/* Hang on to whatever was buffered but didn't make it out. */
+		if (iov[0].iov_len > 0) {
+			memmove(w->buf, iov[0].iov_base, iov[0].iov_len);
+		}
+		w->buf_used = iov[0].iov_len;
+		if (ret != 0) {
+			return -1;
+		}
+	}
+
+	if (t == SPOOL_POINTS) {
+		ctx->bytes_written_points += len;
+	} else {
+		ctx->bytes_written_contents += len;
+	}
+	return 0;
+}
+
+/* Append the bytes in iov[1..iovcnt-1] to spool type t's file, as
+ * spool_store(). With block compression they are collected into the
+ * writer's block instead, and each block is compressed and written out
+ * as it fills. Returns zero on success, -1 on error.
+ */
+int spool_append(marquise_ctx *ctx, spool_type t, struct iovec *iov, int iovcnt)
+{
+	if (ctx->codec == NULL) {
+		return spool_store(ctx, t, iov, iovcnt);
+	}
+	marquise_spool_writer *w = spool_writer(ctx, t);
+	int i;
+	for (i = 1; i < iovcnt; i++) {
+		const uint8_t *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while (left > 0) {
+			size_t n = ctx->block_size - w->block_used;
+			if (n > left) {
+				n = left;
+			}
+			memcpy(w->block + w->block_used, p, n);
+			w->block_used += n;
+			p += n;
+			left -= n;
+			if (w->block_used == ctx->block_size && emit_block(ctx, t) != 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Append the n frames in iov[1..iovcnt-1] to spool type t, without
+ * rotating, as spool_append(). With the compact format, points frames
+ * are handed to the encoder instead and written out a block at a time.
+ * The statistics count the frames as given either way. Returns zero on
+ * success, -1 on error.
+ */
+int spool_writev(marquise_ctx *ctx, spool_type t, struct iovec *iov, int iovcnt, size_t n)
+{
+	size_t len = iov_length(iov + 1, iovcnt - 1);
+	bool compact = t == SPOOL_POINTS && ctx->compact != NULL;
+
+	if (compact) {
+		if (compact_add(ctx->compact, iov + 1, iovcnt - 1) != 0) {
+			stat_add(ctx, write_errors, 1);
+			return -1;
+		}
+	} else if (spool_append(ctx, t, iov, iovcnt) != 0) {
+		return -1;
+	}
+
+	if (t == SPOOL_POINTS) {
+		stat_add(ctx, frames_points, n);
+		stat_add(ctx, bytes_points, len);
+	} else {
+		stat_add(ctx, frames_contents, n);
+		stat_add(ctx, bytes_contents, len);
+	}
+	if (compact && compact_pending(ctx->compact) >= COMPACT_BLOCK_SIZE) {
+		return emit_compact(ctx);
+	}
+	return 0;
+}
+
+/* Work out when the writer's segment, opened just now, is due to be
+ * rotated by age or at the next interval boundary of the wall clock. */
+void set_rotate_deadline(marquise_ctx *ctx, marquise_spool_writer *w)
+{
+	gint64 now = g_get_monotonic_time();
+	w->deadline = G_MAXINT64;
+	if (ctx->rotate_age > 0) {
+		w->deadline = now + ctx->rotate_age;
+	}
+	if (ctx->rotate_interval > 0) {
+		gint64 boundary = now + ctx->rotate_interval - g_get_real_time() % ctx->rotate_interval;
+		if (boundary < w->deadline) {
+			w->deadline = boundary;
+		}
+	}
+}
+
+/* Return whether spool type t's segment is due to be rotated: it has
+ * reached the rotation size, or has something in it and its deadline
+ * has passed. */
+bool rotation_due(marquise_ctx *ctx, spool_type t)
+{
+	size_t bytes = (t == SPOOL_POINTS) ? ctx->bytes_written_points : ctx->bytes_written_contents;
+	if (bytes >= ctx->rotate_size) {
+		return true;
+	}
+	/* Whatever is being held back to be encoded or compressed counts
+	 * as something. */
+	if (t == SPOOL_POINTS && ctx->compact != NULL) {
+		bytes += compact_pending(ctx->compact);
+	}
+	bytes += spool_writer(ctx, t)->block_used;
+	gint64 deadline = spool_writer(ctx, t)->deadline;
+	return bytes > 0 && deadline != G_MAXINT64 && g_get_monotonic_time() >= deadline;
+}
+
+/* Fill name with a fresh six-character spool file name, from the same
+ * alphabet mkstemp() uses. */
+void segment_name(marquise_ctx *ctx, char *name)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+	uint64_t x = monotonic_ns() ^ ((uint64_t)getpid() << 32) ^
+	             __atomic_add_fetch(&ctx->segment_seq, 0x9e3779b97f4a7c15ULL, __ATOMIC_RELAXED);
+	/* splitmix64's finaliser, so that neighbouring inputs differ. */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	int i;
+	for (i = 0; i < 6; i++) {
+		name[i] = chars[x % 62];
+		x /= 62;
+	}
+	name[6] = '\0';
+}
+
+/* Create a new spool file under tmp/ in w's directory, with a name not
+ * in use in new/ either, and preallocate and map it for the mmap
+ * writer. Zero on success, -1 with errno set on failure. */
+int open_segment(marquise_ctx *ctx, const marquise_spool_writer *w, marquise_spool_segment *seg)
+{
+	char tmp_name[16];
+	char new_name[16];
+	int tries;
+	seg->fd = -1;
+	seg->map = NULL;
+	for (tries = 0; tries < 100; tries++) {
+		segment_name(ctx, seg->name);
+		snprintf(tmp_name, sizeof(tmp_name), "tmp/%s", seg->name);
+		snprintf(new_name, sizeof(new_name), "new/%s", seg->name);
+		/* The daemon only ever takes files out of new/, and the
+		 * namespace lock keeps anyone else from adding them. */
+		if (faccessat(w->dirfd, new_name, F_OK, 0) == 0) {
+			continue;
+		}
+		seg->fd = openat(w->dirfd, tmp_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (seg->fd >= 0) {
+			break;
+		}
+		if (errno != EEXIST) {
+			return -1;
+		}
+	}
+	if (seg->fd < 0) {
+		return -1;
+	}
+	if (ctx->writer_mode == SPOOL_WRITER_MMAP) {
+		seg->map = map_segment(seg->fd, ctx->rotate_size);
+	}
+	return 0;
+}
+
+/* Close and remove a spool file which won't be used after all. */
+void discard_segment(marquise_ctx *ctx, const marquise_spool_writer *w, marquise_spool_segment *seg)
+{
+	if (seg->fd < 0) {
+		return;
+	}
+	if (seg->map != NULL) {
+		munmap(seg->map, ctx->rotate_size);
+		seg->map = NULL;
+	}
+	close(seg->fd);
+	seg->fd = -1;
+	char tmp_name[16];
+	snprintf(tmp_name, sizeof(tmp_name), "tmp/%s", seg->name);
+	unlinkat(w->dirfd, tmp_name, 0);
+}
+
+/* Return the path of name under sub ("tmp/" or "new/") in w's
+ * directory, or NULL on failure. */
+char *segment_path(const marquise_spool_writer *w, const char *sub, const char *name)
+{
+	size_t len = strlen(w->dir_path) + strlen(sub) + strlen(name) + 1;
+	char *path = malloc(len);
+	if (path != NULL) {
+		snprintf(path, len, "%s%s%s", w->dir_path, sub, name);
+	}
+	return path;
+}
+
+/* Get w's next spool file ready to become current, creating it if the
+ * rotator hasn't. Its paths under tmp/ and new/ are stored in *tmp_path
+ * and *spool_path. Zero on success, -1 with errno set on failure. */
+int ready_segment(marquise_ctx *ctx, marquise_spool_writer *w, char **tmp_path, char **spool_path)
+{
+	if (w->next.fd < 0 && open_segment(ctx, w, &w->next) != 0) {
+		return -1;
+	}
+	*tmp_path = segment_path(w, "tmp/", w->next.name);
+	*spool_path = segment_path(w, "new/", w->next.name);
+	if (*tmp_path == NULL || *spool_path == NULL) {
+		free(*tmp_path);
+		free(*spool_path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Make spool type t's next spool file, readied by ready_segment(), the
+ * current one. The old one must already be closed. */
+void install_segment(marquise_ctx *ctx, spool_type t, char *tmp_path, char *spool_path)
+{
+	marquise_spool_writer *w = spool_writer(ctx, t);
+	char **path = (t == SPOOL_POINTS) ? &ctx->spool_path_points : &ctx->spool_path_contents;
+	free(w->tmp_path);
+	free(*path);
+	w->fd = w->next.fd;
+	memcpy(w->name, w->next.name, sizeof(w->name));
+	w->map = w->next.map;
+	w->map_used = 0;
+	w->map_size = ctx->rotate_size;
+	w->tmp_path = tmp_path;
+	*path = spool_path;
+	w->next.fd = -1;
+	w->next.map = NULL;
+	set_rotate_deadline(ctx, w);
+	if (t == SPOOL_POINTS) {
+		ctx->bytes_written_points = 0;
+	} else {
+		ctx->bytes_written_contents = 0;
+	}
+	PROBE2(spool_path, tmp_path, w->fd);
+}
+
+/* Move w's current spool file from tmp/ to new/, where the daemon picks
+ * it up. Zero on success, -1 with errno set on failure. */
+int publish_segment(const marquise_spool_writer *w)
+{
+	char tmp_name[16];
+	char new_name[16];
+	snprintf(tmp_name, sizeof(tmp_name), "tmp/%s", w->name);
+	snprintf(new_name, sizeof(new_name), "new/%s", w->name);
+	return renameat(w->dirfd, tmp_name, w->dirfd, new_name);
+}
+
+/* Return whether spool type t's files are fdatasync()ed as they are
+ * finished. */
+bool segment_sync(const marquise_ctx *ctx, spool_type t)
+{
+	return ctx->durability != DURABILITY_NONE || (t == SPOOL_CONTENTS && ctx->contents_sync);
+}
+
+size_t frame_length(const uint8_t *buf, size_t avail, spool_type t);
+
+/* Return how many of the len bytes at p, a spool file of type t, hold
+ * whole frames, or whole blocks for the compact and block-compressed
+ * formats, storing the length of the file's own header in *header_len.
+ * What follows is a frame or block cut short, or the zeroed tail of a
+ * file from the mmap writer. */
+size_t segment_whole_len(const uint8_t *p, size_t len, spool_type t, size_t *header_len)
+{
+	static const uint8_t zeroes[24];
+	size_t pos = 0;
+	size_t n;
+	if (len >= SPOOL_BLOCK_FILE_HEADER_LEN && memcmp(p, SPOOL_BLOCK_MAGIC, 4) == 0) {
+		/* Blocks are never empty, so a zero size ends the file. */
+		*header_len = SPOOL_BLOCK_FILE_HEADER_LEN;
+		for (pos = *header_len; len - pos >= SPOOL_BLOCK_HEADER_LEN; pos += n) {
+			n = U8TO32_LE(p + pos);
+			if (n == 0 || n > len - pos - SPOOL_BLOCK_HEADER_LEN) {
+				break;
+			}
+			n += SPOOL_BLOCK_HEADER_LEN;
+		}
+		return pos;
+	}
+	if (t == SPOOL_POINTS && len >= COMPACT_FILE_HEADER_LEN && memcmp(p, COMPACT_MAGIC, 4) == 0) {
+		/* And compact blocks are never of type zero. */
+		*header_len = COMPACT_FILE_HEADER_LEN;
+		for (pos = *header_len; len - pos >= COMPACT_BLOCK_HEADER_LEN; pos += n) {
+			n = U8TO32_LE(p + pos + 4);
+			if (p[pos] == 0 || n > len - pos - COMPACT_BLOCK_HEADER_LEN) {
+				break;
+			}
+			n += COMPACT_BLOCK_HEADER_LEN;
+		}
+		return pos;
+	}
+	/* No frame has a header of all zeroes; see reserved_address(). */
+	*header_len = 0;
+	size_t frame_header_len = (t == SPOOL_POINTS) ? 24 : 16;
+	while (len - pos >= frame_header_len && memcmp(p + pos, zeroes, frame_header_len) != 0 &&
+	       (n = frame_length(p + pos, len - pos, t)) > 0) {
+		pos += n;
+	}
+	return pos;
+}
+
+/* Publish whatever a process that died holding the namespace left in
+ * w's tmp/ directory: each file is cut back to what it holds whole and
+ * moved into new/, or removed if that leaves nothing. Only safe with
+ * the namespace lock held, and before the first segment is opened.
+ * Files that can't be dealt with are left where they are. */
+void recover_segments(marquise_ctx *ctx, marquise_spool_writer *w, spool_type t)
+{
+	int tmp_fd = openat(w->dirfd, "tmp", O_RDONLY | O_DIRECTORY);
+	if (tmp_fd < 0) {
+		return;
+	}
+	DIR *dir = fdopendir(tmp_fd);
+	if (dir == NULL) {
+		close(tmp_fd);
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		struct stat st;
+		int fd = openat(tmp_fd, entry->d_name, O_RDWR | O_NOFOLLOW);
+		if (fd < 0) {
+			continue;
+		}
+		if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			continue;
+		}
+		size_t keep = 0;
+		size_t header_len = 0;
+		if (st.st_size > 0) {
+			void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED) {
+				close(fd);
+				continue;
+			}
+			keep = segment_whole_len(map, st.st_size, t, &header_len);
+			munmap(map, st.st_size);
+		}
+		if (keep <= header_len) {
+			close(fd);
+			unlinkat(tmp_fd, entry->d_name, 0);
+			continue;
+		}
+		int ret = (keep < (size_t)st.st_size) ? ftruncate(fd, keep) : 0;
+		close(fd);
+		if (ret != 0) {
+			continue;
+		}
+		/* Under a name not already taken in new/. */
+		char tmp_name[NAME_MAX + 5];
+		char new_name[16];
+		char name[8];
+		int tries;
+		snprintf(tmp_name, sizeof(tmp_name), "tmp/%s", entry->d_name);
+		for (tries = 0; tries < 100; tries++) {
+			segment_name(ctx, name);
+			snprintf(new_name, sizeof(new_name), "new/%s", name);
+			if (faccessat(w->dirfd, new_name, F_OK, 0) != 0) {
+				renameat(w->dirfd, tmp_name, w->dirfd, new_name);
+				break;
+			}
+		}
+	}
+	closedir(dir);
+}
+
+int maybe_rotate(marquise_ctx *ctx, spool_type t) {
+	if (!rotation_due(ctx, t)) {
+		return 0;
+	}
+
+	/* Only the probe wants the time. */
+	uint64_t start = PROBE_ENABLED(rotate) ? monotonic_ns() : 0;
+	if (emit_pending(ctx, t) != 0) {
+		return -1;
+	}
+	size_t finished_bytes = (t == SPOOL_POINTS) ? ctx->bytes_written_points : ctx->bytes_written_contents;
+
+	/* Everything destined for the old file has to land there before
+	 * we let go of it. */
+	if (flush_spool(ctx, t) != 0) {
+		return -1;
+	}
+
+	/* Normally the rotator has the next file waiting. If it can't be
+	 * got ready, keep using the old one for now. */
+	marquise_spool_writer *w = spool_writer(ctx, t);
+	char *tmp_path;
+	char *spool_path;
+	if (ready_segment(ctx, w, &tmp_path, &spool_path) != 0) {
+		stat_add(ctx, write_errors, 1);
+		return -1;
+	}
+
+	if (ctx->uring != NULL) {
+		/* Only the sync is left to go against the old file, and the
+		 * daemon mustn't see the file before it lands either. */
+		uring_rotate(ctx->uring, t, w->fd, segment_sync(ctx, t));
+		if (uring_flush(ctx->uring) != 0) {
+			/* Too late to do anything but count it. */
+			stat_add(ctx, write_errors, 1);
+		}
+	} else {
+		spool_unmap(w);
+		if (segment_sync(ctx, t) && fdatasync(w->fd) != 0) {
+			/* Too late to do anything but count it. */
+			stat_add(ctx, write_errors, 1);
+		}
+		close(w->fd);
+	}
+	if (publish_segment(w) != 0) {
+		/* Stranded in tmp/; nothing more we can do with it. */
+		stat_add(ctx, write_errors, 1);
+	}
+	install_segment(ctx, t, tmp_path, spool_path);
+	stat_add(ctx, rotations, 1);
+	/* Zero if the tracer attached partway through. */
+	PROBE3(rotate, t, finished_bytes, start != 0 ? monotonic_ns() - start : 0);
+	/* The rotator is told to get the one after ready once we let go
+	 * of write_lock. */
+	ctx->rotated = true;
+	return 0;
+}
+
+/* Return the length of the frame at the start of the avail bytes at
+ * buf in a spool of type t, or zero if only part of a frame is there. */
+size_t frame_length(const uint8_t *buf, size_t avail, spool_type t)
+{
+	size_t len;
+	if (t == SPOOL_POINTS) {
+		if (avail < 24) {
+			return 0;
+		}
+		/* Extended frames have the LSB of the address set. */
+		len = (buf[0] & 1) ? 24 + U8TO64_LE(buf + 16) : 24;
+	} else {
+		if (avail < 16) {
+			return 0;
+		}
+		len = 16 + U8TO64_LE(buf + 8);
+	}
+	return len <= avail ? len : 0;
+}
+
+/* Write len bytes of whole frames from buf to spool type t, rotating
+ * between frames exactly as rotating_write() would. Zero on success, -1
+ * on error. */
+int write_frame_run(marquise_ctx *ctx, spool_type t, uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		size_t segment_bytes = (t == SPOOL_POINTS) ? ctx->bytes_written_points : ctx->bytes_written_contents;
+		size_t count = 0;
+		size_t frames = 0;
+		while (done + count < len) {
+			size_t frame_len = frame_length(buf + done + count, len - done - count, t);
+			if (frame_len == 0) {
+				/* Can't happen; we only ever queue whole frames. */
+				errno = EINVAL;
+				return -1;
+			}
+			count += frame_len;
+			frames++;
+			if (segment_bytes < ctx->rotate_size) {
+				segment_bytes += frame_len;
+				if (segment_bytes >= ctx->rotate_size) {
+					break;
+				}
+			}
+		}
+		struct iovec iov[2];
+		iov[1].iov_base = buf + done;
+		iov[1].iov_len = count;
+		if (spool_writev(ctx, t, iov, 2, frames) != 0) {
+			return -1;
+		}
+		maybe_rotate(ctx, t);
+		done += count;
+	}
+	return 0;
+}
+
+/* Per-thread list of the staging rings the thread owns, one per context
+ * it has sent through. */
+typedef struct marquise_thread_staging {
+	struct marquise_thread_staging *next;
+	guint ctx_id;
+	struct marquise_staging *staging;
+} marquise_thread_staging;
+
+static guint next_ctx_id = 1;
+
+/* Called when a thread exits: give up its claim on its staging rings.
+ * Anything still in them is written out by the consumer. */
+void release_thread_stagings(gpointer data)
+{
+	marquise_thread_staging *ts = data;
+	while (ts != NULL) {
+		marquise_thread_staging *next = ts->next;
+		__atomic_store_n(&ts->staging->retired, 1, __ATOMIC_RELEASE);
+		staging_unref(ts->staging);
+		free(ts);
+		ts = next;
+	}
+}
+
+static GPrivate thread_stagings = G_PRIVATE_INIT(release_thread_stagings);
+
+/* Return the calling thread's staging rings for ctx, creating and
+ * registering them on first use. NULL if they can't be allocated. */
+struct marquise_staging *thread_staging(marquise_ctx *ctx)
+{
+	marquise_thread_staging *head = g_private_get(&thread_stagings);
+	marquise_thread_staging *ts;
+	for (ts = head; ts != NULL; ts = ts->next) {
+		if (ts->ctx_id == ctx->id) {
+			return ts->staging;
+		}
+	}
+
+	ts = malloc(sizeof(marquise_thread_staging));
+	struct marquise_staging *st = calloc(1, sizeof(struct marquise_staging));
+	if (ts == NULL || st == NULL) {
+		free(ts);
+		free(st);
+		return NULL;
+	}
+	st->ring[SPOOL_POINTS] = malloc(ctx->queue_size);
+	st->ring[SPOOL_CONTENTS] = malloc(ctx->queue_size);
+	if (st->ring[SPOOL_POINTS] == NULL || st->ring[SPOOL_CONTENTS] == NULL) {
+		free(st->ring[SPOOL_POINTS]);
+		free(st->ring[SPOOL_CONTENTS]);
+		free(st);
+		free(ts);
+		return NULL;
+	}
+	st->refs = 2;
+	ts->ctx_id = ctx->id;
+	ts->staging = st;
+	ts->next = head;
+	g_private_set(&thread_stagings, ts);
+
+	g_mutex_lock(&ctx->queue_lock);
+	st->next = ctx->stagings;
+	ctx->stagings = st;
+	g_mutex_unlock(&ctx->queue_lock);
+	return st;
+}
+
+/* Copy the whole frames in iov[1..iovcnt-1] onto the calling thread's
+ * staging ring for spool type t, waiting for the consumer if the ring is
+ * full. Returns false if the frames can't be staged (they are bigger
+ * than the ring, or the ring can't be allocated); the caller must then
+ * write them itself with lock_writer(). */
+bool staging_push(marquise_ctx *ctx, spool_type t, const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+	for (i = 1; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (len > ctx->queue_size) {
+		return false;
+	}
+	struct marquise_staging *st = thread_staging(ctx);
+	if (st == NULL) {
+		return false;
+	}
+
+	size_t mask = ctx->queue_size - 1;
+	size_t head = st->head[t];
+	size_t tail = __atomic_load_n(&st->tail[t], __ATOMIC_ACQUIRE);
+	while (ctx->queue_size - (head - tail) < len) {
+		g_mutex_lock(&ctx->queue_lock);
+		ctx->flush_requested = true;
+		g_cond_signal(&ctx->queue_cond);
+		g_cond_wait_until(&ctx->space_cond, &ctx->queue_lock, g_get_monotonic_time() + 1000);
+		g_mutex_unlock(&ctx->queue_lock);
+		tail = __atomic_load_n(&st->tail[t], __ATOMIC_ACQUIRE);
+	}
+
+	size_t pos = head;
+	for (i = 1; i < iovcnt; i++) {
+		const uint8_t *src = iov[i].iov_base;
+		size_t n = iov[i].iov_len;
+		size_t off = pos & mask;
+		size_t first = (n < ctx->queue_size - off) ? n : ctx->queue_size - off;
+		memcpy(st->ring[t] + off, src, first);
+		memcpy(st->ring[t], src + first, n - first);
+		pos += n;
+	}
+	__atomic_store_n(&st->head[t], pos, __ATOMIC_RELEASE);
+
+	/* Wake the flusher as the ring crosses half full. */
+	if (pos - tail >= ctx->queue_size / 2 && head - tail < ctx->queue_size / 2) {
+		g_mutex_lock(&ctx->queue_lock);
+		ctx->flush_requested = true;
+		g_cond_signal(&ctx->queue_cond);
+		g_mutex_unlock(&ctx->queue_lock);
+	}
+	return true;
+}
+
+/* Write out everything staged in st for spool type t. The caller must
+ * hold write_lock, which makes it the ring's only consumer. */
+int staging_drain(marquise_ctx *ctx, struct marquise_staging *st, spool_type t)
+{
+	size_t mask = ctx->queue_size - 1;
+	size_t tail = st->tail[t];
+	size_t head = __atomic_load_n(&st->head[t], __ATOMIC_ACQUIRE);
+	size_t len = head - tail;
+	if (len == 0) {
+		return 0;
+	}
+
+	size_t off = tail & mask;
+	uint8_t *frames = st->ring[t] + off;
+	if (len > ctx->queue_size - off) {
+		/* Frames straddle the end of the ring; straighten them out. */
+		size_t first = ctx->queue_size - off;
+		memcpy(ctx->drain_buf, st->ring[t] + off, first);
+		memcpy(ctx->drain_buf + first, st->ring[t], len - first);
+		frames = ctx->drain_buf;
+	}
+	int ret = ctx->aborting ? 0 : write_frame_run(ctx, t, frames, len);
+	__atomic_store_n(&st->tail[t], head, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* Merge every thread's staged frames into the spool files and flush the
+ * write buffers. Caller holds write_lock. Staging rings whose threads
+ * have exited are dropped once empty. */
+int async_drain(marquise_ctx *ctx)
+{
+	int ret = 0;
+	bool retired_any = false;
+	struct marquise_staging *st;
+
+	/* New rings are only ever added at the head, so once we have the
+	 * head the rest of the list is ours to walk. */
+	g_mutex_lock(&ctx->queue_lock);
+	struct marquise_staging *stagings = ctx->stagings;
+	ctx->flush_requested = false;
+	g_mutex_unlock(&ctx->queue_lock);
+
+	for (st = stagings; st != NULL; st = st->next) {
+		bool retired = __atomic_load_n(&st->retired, __ATOMIC_ACQUIRE);
+		if (staging_drain(ctx, st, SPOOL_POINTS) != 0) {
+			ret = -1;
+		}
+		if (staging_drain(ctx, st, SPOOL_CONTENTS) != 0) {
+			ret = -1;
+		}
+		retired_any |= retired;
+	}
+	if (flush_spool(ctx, SPOOL_POINTS) != 0) {
+		ret = -1;
+	}
+	if (flush_spool(ctx, SPOOL_CONTENTS) != 0) {
+		ret = -1;
+	}
+
+	g_mutex_lock(&ctx->queue_lock);
+	g_cond_broadcast(&ctx->space_cond);
+	if (retired_any) {
+		struct marquise_staging **link = &ctx->stagings;
+		while (*link != NULL) {
+			st = *link;
+			if (__atomic_load_n(&st->retired, __ATOMIC_ACQUIRE) &&
+			    st->head[SPOOL_POINTS] == st->tail[SPOOL_POINTS] &&
+			    st->head[SPOOL_CONTENTS] == st->tail[SPOOL_CONTENTS]) {
+				*link = st->next;
+				free(st->ring[SPOOL_POINTS]);
+				free(st->ring[SPOOL_CONTENTS]);
+				staging_unref(st);
+			} else {
+				link = &st->next;
+			}
+		}
+	}
+	g_mutex_unlock(&ctx->queue_lock);
+	return ret;
+}
+
+/* Take the context's write lock so the caller can write to the spool
+ * files directly. In asynchronous mode everything staged so far is
+ * written out first, so frames from any one thread stay in order. */
+void lock_writer(marquise_ctx *ctx)
+{
+	g_mutex_lock(&ctx->write_lock);
+	if (ctx->async) {
+		async_drain(ctx);
+	}
+}
+
+/* Write out both spool files' buffers and fdatasync() them. Caller
+ * holds write_lock. Zero on success, -1 with errno set on failure. */
+int sync_spools(marquise_ctx *ctx)
+{
+	int ret = 0;
+	spool_type t;
+	for (t = SPOOL_POINTS; t <= SPOOL_CONTENTS; t++) {
+		if (flush_spool(ctx, t) != 0) {
+			ret = -1;
+		} else if (fdatasync(spool_writer(ctx, t)->fd) != 0) {
+			stat_add(ctx, write_errors, 1);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/* Wait until everything written up to ticket (a value of write_seq) is
+ * on disk. Whoever finds no sync under way, and at least commit_interval
+ * passed since the last, syncs on behalf of everyone waiting; the rest
+ * wait for that. The sync runs outside write_lock, so senders carry on
+ * in the meantime and are picked up by the next one. */
+int group_commit(marquise_ctx *ctx, uint64_t ticket)
+{
+	int ret = 0;
+	g_mutex_lock(&ctx->sync_lock);
+	while (ctx->synced_seq < ticket) {
+		if (ctx->syncing) {
+			g_cond_wait(&ctx->sync_cond, &ctx->sync_lock);
+			continue;
+		}
+		gint64 due = ctx->last_sync + ctx->commit_interval;
+		if (g_get_monotonic_time() < due) {
+			g_cond_wait_until(&ctx->sync_cond, &ctx->sync_lock, due);
+			continue;
+		}
+		ctx->syncing = true;
+		g_mutex_unlock(&ctx->sync_lock);
+
+		/* Our own descriptors, since a rotation may close the
+		 * context's while we sync. Rotation syncs the old file
+		 * itself. */
+		int fds[2] = { -1, -1 };
+		spool_type t;
+		g_mutex_lock(&ctx->write_lock);
+		uint64_t target = ctx->write_seq;
+		for (t = SPOOL_POINTS; t <= SPOOL_CONTENTS; t++) {
+			if (flush_spool(ctx, t) != 0) {
+				ret = -1;
+			} else {
+				fds[t] = dup(spool_writer(ctx, t)->fd);
+			}
+		}
+		g_mutex_unlock(&ctx->write_lock);
+		for (t = SPOOL_POINTS; t <= SPOOL_CONTENTS; t++) {
+			if (fds[t] < 0 || fdatasync(fds[t]) != 0) {
+				ret = -1;
+			}
+			if (fds[t] >= 0) {
+				close(fds[t]);
+			}
+		}
+
+		g_mutex_lock(&ctx->sync_lock);
+		ctx->syncing = false;
+		ctx->last_sync = g_get_monotonic_time();
+		if (ret == 0) {
+			ctx->synced_seq = target;
+		}
+		g_cond_broadcast(&ctx->sync_cond);
+		if (ret != 0) {
+			int saved_errno = errno;
+			g_mutex_unlock(&ctx->sync_lock);
+			g_mutex_lock(&ctx->write_lock);
+			stat_add(ctx, write_errors, 1);
+			g_mutex_unlock(&ctx->write_lock);
+			errno = saved_errno;
+			return -1;
+		}
+	}
+	g_mutex_unlock(&ctx->sync_lock);
+	return 0;
+}
+
+/* Tell the rotator to make new spool files ready if a rotation has
+ * used one up, and release write_lock. The rotator is only woken once
+ * the lock is free, so it doesn't wake just to wait for it. */
+void unlock_rotated(marquise_ctx *ctx)
+{
+	bool rotated = ctx->rotated;
+	ctx->rotated = false;
+	g_mutex_unlock(&ctx->write_lock);
+	if (rotated) {
+		g_mutex_lock(&ctx->rotator_lock);
+		ctx->rotator_wanted = true;
+		g_cond_signal(&ctx->rotator_cond);
+		g_mutex_unlock(&ctx->rotator_lock);
+	}
+}
+
+/* Release the write lock taken by lock_writer() after a write which
+ * returned ret, first making the write as durable as the context's
+ * durability policy asks. Returns ret, or -1 if that fails. */
+int unlock_writer(marquise_ctx *ctx, int ret)
+{
+	if (ret == 0 && ctx->durability == DURABILITY_FRAME) {
+		ret = sync_spools(ctx);
+	}
+	uint64_t ticket = ++ctx->write_seq;
+	unlock_rotated(ctx);
+	if (ret == 0 && ctx->durability == DURABILITY_GROUP) {
+		ret = group_commit(ctx, ticket);
+	}
+	return ret;
+}
+
+/* Body of the flusher thread: drain the staging rings whenever one
+ * reaches its threshold or the flush interval passes, until told to
+ * stop. Write errors can't be reported from here; the frames concerned
+ * are lost. */
+gpointer async_flusher(gpointer data)
+{
+	marquise_ctx *ctx = data;
+
+	g_mutex_lock(&ctx->queue_lock);
+	while (!ctx->stopping) {
+		gint64 deadline = g_get_monotonic_time() + ctx->flush_interval;
+		while (!ctx->stopping && !ctx->flush_requested) {
+			if (!g_cond_wait_until(&ctx->queue_cond, &ctx->queue_lock, deadline)) {
+				break;
+			}
+		}
+		g_mutex_unlock(&ctx->queue_lock);
+
+		g_mutex_lock(&ctx->write_lock);
+		async_drain(ctx);
+		/* Nobody waits on the sync in asynchronous mode; the
+		 * flusher just makes sure there is one every
+		 * commit_interval. */
+		if (ctx->durability >= DURABILITY_GROUP &&
+		    g_get_monotonic_time() >= ctx->last_sync + ctx->commit_interval) {
+			sync_spools(ctx);
+			ctx->last_sync = g_get_monotonic_time();
+		}
+		unlock_rotated(ctx);
+
+		g_mutex_lock(&ctx->queue_lock);
+	}
+	g_mutex_unlock(&ctx->queue_lock);
+
+	/* One last pass for anything staged before we were stopped. */
+	g_mutex_lock(&ctx->write_lock);
+	async_drain(ctx);
+	g_mutex_unlock(&ctx->write_lock);
+
+	g_mutex_lock(&ctx->queue_lock);
+	ctx->stopped = true;
+	bool abandoned = ctx->abandoned;
+	g_cond_broadcast(&ctx->stopped_cond);
+	g_mutex_unlock(&ctx->queue_lock);
+	/* Whoever was shutting the context down has stopped waiting for
+	 * us, so the rest of the shutdown is ours. */
+	if (abandoned) {
+		shutdown_finish(ctx, true);
+	}
+	return NULL;
+}
+
+/* Stop the flusher thread, giving it until end_time (monotonic, or
+ * forever if negative) to drain the staging rings. Zero if it drained
+ * everything. If it is still going at end_time, staged frames are
+ * abandoned and -1 is returned with errno set to ETIMEDOUT; the flusher
+ * is then left to finish whatever write it is stuck in and shut the
+ * context down itself, so the caller must not touch ctx again. */
+int async_stop(marquise_ctx *ctx, gint64 end_time)
+{
+	g_mutex_lock(&ctx->queue_lock);
+	ctx->stopping = true;
+	g_cond_broadcast(&ctx->queue_cond);
+	while (!ctx->stopped) {
+		if (end_time < 0) {
+			g_cond_wait(&ctx->stopped_cond, &ctx->queue_lock);
+		} else if (!g_cond_wait_until(&ctx->stopped_cond, &ctx->queue_lock, end_time) &&
+			   !ctx->stopped) {
+			__atomic_store_n(&ctx->aborting, true, __ATOMIC_RELAXED);
+			ctx->abandoned = true;
+			g_mutex_unlock(&ctx->queue_lock);
+			g_thread_unref(ctx->flusher);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	g_mutex_unlock(&ctx->queue_lock);
+	g_thread_join(ctx->flusher);
+	ctx->flusher = NULL;
+	return 0;
+}
+
+/* Make sure spool type t has a file ready to rotate to. It is created
+ * without write_lock, so senders aren't held up meanwhile. */
+void prepare_segment(marquise_ctx *ctx, spool_type t)
+{
+	marquise_spool_writer *w = spool_writer(ctx, t);
+	g_mutex_lock(&ctx->write_lock);
+	bool ready = w->next.fd >= 0;
+	g_mutex_unlock(&ctx->write_lock);
+	if (ready) {
+		return;
+	}
+	marquise_spool_segment seg;
+	/* If this fails, rotation has a go itself. */
+	if (open_segment(ctx, w, &seg) != 0) {
+		return;
+	}
+	g_mutex_lock(&ctx->write_lock);
+	if (w->next.fd < 0) {
+		w->next = seg;
+		seg.fd = -1;
+	}
+	g_mutex_unlock(&ctx->write_lock);
+	discard_segment(ctx, w, &seg);
+}
+
+/* Body of the rotator thread. Whenever a spool file has been rotated
+ * to, make the one after ready. If files are rotated by time, also wake
+ * at the earlier of their deadlines and rotate whichever is due, so
+ * that a quiet namespace's frames still reach the daemon in good time;
+ * a file with nothing in it just gets a fresh deadline. */
+gpointer rotator(gpointer data)
+{
+	marquise_ctx *ctx = data;
+
+	g_mutex_lock(&ctx->rotator_lock);
+	while (!ctx->rotator_stopping) {
+		g_mutex_unlock(&ctx->rotator_lock);
+
+		spool_type t;
+		for (t = SPOOL_POINTS; t <= SPOOL_CONTENTS; t++) {
+			prepare_segment(ctx, t);
+		}
+
+		gint64 wake = G_MAXINT64;
+		if (ctx->rotate_age > 0 || ctx->rotate_interval > 0) {
+			lock_writer(ctx);
+			gint64 now = g_get_monotonic_time();
+			for (t = SPOOL_POINTS; t <= SPOOL_CONTENTS; t++) {
+				marquise_spool_writer *w = spool_writer(ctx, t);
+				if (now >= w->deadline) {
+					if (rotation_due(ctx, t)) {
+						maybe_rotate(ctx, t);
+					} else {
+						set_rotate_deadline(ctx, w);
+					}
+				}
+				if (w->deadline < wake) {
+					wake = w->deadline;
+				}
+			}
+			unlock_rotated(ctx);
+			/* Don't spin on a rotation that keeps failing. */
+			if (wake <= now) {
+				wake = now + G_USEC_PER_SEC;
+			}
+		}
+
+		g_mutex_lock(&ctx->rotator_lock);
+		while (!ctx->rotator_stopping && !ctx->rotator_wanted) {
+			if (!g_cond_wait_until(&ctx->rotator_cond, &ctx->rotator_lock, wake)) {
+				break;
+			}
+		}
+		ctx->rotator_wanted = false;
+	}
+	g_mutex_unlock(&ctx->rotator_lock);
+	return NULL;
+}
+
+/* Stop the rotator thread, if there is one. */
+void rotator_stop(marquise_ctx *ctx)
+{
+	if (ctx->rotator == NULL) {
+		return;
+	}
+	g_mutex_lock(&ctx->rotator_lock);
+	ctx->rotator_stopping = true;
+	g_cond_broadcast(&ctx->rotator_cond);
+	g_mutex_unlock(&ctx->rotator_lock);
+	g_thread_join(ctx->rotator);
+	ctx->rotator = NULL;
+}
+
+/* Close both spool files for good, once everything has been written
+ * out: publish those with frames in them and remove the others. Zero on
+ * success, -1 with errno set on failure. */
+int finish_segments(marquise_ctx *ctx)
+{
+	int ret = 0;
+	int saved_errno = 0;
+	/* The ring has to finish with the files before they close. */
+	uring_free(ctx->uring);
+	ctx->uring = NULL;
+	spool_type t;
+	for (t = SPOOL_POINTS; t <= SPOOL_CONTENTS; t++) {
+		marquise_spool_writer *w = spool_writer(ctx, t);
+		size_t bytes = (t == SPOOL_POINTS) ? ctx->bytes_written_points : ctx->bytes_written_contents;
+		if (spool_unmap(w) != 0 && ret == 0) {
+			ret = -1;
+			saved_errno = errno;
+		}
+		/* With any other durability, marquise_flush has synced it. */
+		if (bytes > 0 && ctx->durability == DURABILITY_NONE && segment_sync(ctx, t) &&
+		    fdatasync(w->fd) != 0 && ret == 0) {
+			ret = -1;
+			saved_errno = errno;
+		}
+		close(w->fd);
+		w->fd = -1;
+		if (bytes == 0) {
+			unlink(w->tmp_path);
+		} else if (publish_segment(w) != 0 && ret == 0) {
+			ret = -1;
+			saved_errno = errno;
+		}
+		free(w->tmp_path);
+		w->tmp_path = NULL;
+	}
+	if (ret != 0) {
+		errno = saved_errno;
+	}
+	return ret;
+}
+
+/* Open spool type t's first spool file. Zero on success, -1 on
+ * failure. */
+int first_segment(marquise_ctx *ctx, spool_type t)
+{
+	char *tmp_path;
+	char *spool_path;
+	if (ready_segment(ctx, spool_writer(ctx, t), &tmp_path, &spool_path) != 0) {
+		return -1;
+	}
+	install_segment(ctx, t, tmp_path, spool_path);
+	return 0;
+}
+
+void source_worker(gpointer data, gpointer user_data);
+
+marquise_ctx *marquise_init_opts(char *marquise_namespace, const marquise_options *opts)
+{
+	marquise_options env_opts;
+	if (opts == NULL) {
+		marquise_options_init(&env_opts);
+		opts = &env_opts;
+	}
+
+	marquise_ctx *ctx = malloc(sizeof(marquise_ctx));
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	/* Zero the struct to ensure it's clean. This allows free_ctx() to run
+	 * with gay abandon, because it has no context as to which struct
+	 * members have or haven't been safely defined.
+	 */
+	ctx->marquise_namespace = NULL;
+	ctx->spool_path_points = NULL;
+	ctx->spool_path_contents = NULL;
+	ctx->lock_path = NULL;
+	ctx->lock_fd = 0;
+	ctx->sd_hashes = NULL;
+	ctx->writer_points.dirfd = -1;
+	ctx->writer_points.dir_path = NULL;
+	ctx->writer_points.fd = -1;
+	ctx->writer_points.tmp_path = NULL;
+	ctx->writer_points.next.fd = -1;
+	ctx->writer_points.deadline = G_MAXINT64;
+	ctx->writer_points.buf = NULL;
+	ctx->writer_points.block = NULL;
+	ctx->writer_points.block_used = 0;
+	ctx->writer_points.buf_used = 0;
+	ctx->writer_points.map = NULL;
+	ctx->writer_contents.dirfd = -1;
+	ctx->writer_contents.dir_path = NULL;
+	ctx->writer_contents.fd = -1;
+	ctx->writer_contents.tmp_path = NULL;
+	ctx->writer_contents.next.fd = -1;
+	ctx->writer_contents.deadline = G_MAXINT64;
+	ctx->writer_contents.buf = NULL;
+	ctx->writer_contents.block = NULL;
+	ctx->writer_contents.block_used = 0;
+	ctx->writer_contents.buf_used = 0;
+	ctx->writer_contents.map = NULL;
+	ctx->uring = NULL;
+	ctx->compact = NULL;
+	ctx->codec = NULL;
+	ctx->contents_sync = false;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->source_pool = NULL;
+	ctx->telemetry = NULL;
+	ctx->rotator = NULL;
+	ctx->rotator_stopping = false;
+	ctx->rotator_wanted = false;
+	ctx->rotated = false;
+	ctx->segment_seq = 0;
+	ctx->async = false;
+	ctx->flusher = NULL;
+	ctx->stagings = NULL;
+	ctx->drain_buf = NULL;
+	ctx->flush_requested = false;
+	ctx->stopping = false;
+	ctx->stopped = false;
+	ctx->aborting = false;
+	ctx->abandoned = false;
+	g_mutex_init(&ctx->write_lock);
+	g_mutex_init(&ctx->queue_lock);
+	g_mutex_init(&ctx->cache_lock);
+	g_cond_init(&ctx->queue_cond);
+	g_cond_init(&ctx->space_cond);
+	g_cond_init(&ctx->stopped_cond);
+	g_mutex_init(&ctx->sync_lock);
+	g_cond_init(&ctx->sync_cond);
+	g_mutex_init(&ctx->rotator_lock);
+	g_cond_init(&ctx->rotator_cond);
+	ctx->durability = DURABILITY_NONE;
+	ctx->write_seq = 0;
+	ctx->synced_seq = 0;
+	ctx->syncing = false;
+	ctx->last_sync = 0;
+
+	if (!valid_namespace(marquise_namespace)) {
+		errno = EINVAL;
+		free_ctx(ctx);
+		return NULL;
+	}
+	ctx->marquise_namespace = strdup(marquise_namespace);
+	if (ctx->marquise_namespace == NULL) {
+		free_ctx(ctx);
+		return NULL;
+	}
+
+	/* Create the lock for this namespace */
+	bool disable_namespace_lock = opts->disable_namespace_lock;
+
+	if (disable_namespace_lock == true) {
+		printf("DISABLE_NAMESPACE_LOCK invoked. This process will not lock on the namespace %s\n", ctx->marquise_namespace);
+	} else {
+		/* Lock the namespace so another process cannot access it */
+		ctx->lock_path = build_lock_path(opts->lock_dir, marquise_namespace);
+
+		if (ctx->lock_path == NULL) {
+			free_ctx(ctx);
+			return NULL;
+		}
+
+		/* Exit out if namespace lock doesn't work - someone else is here */
+		ctx->lock_fd = lock_namespace(ctx->lock_path);
+		if (ctx->lock_fd == -1) {
+			free_ctx(ctx);
+			return NULL;
+		}
+
+	}
+
+	/* Create spool dir, et al */
+	const char *spool_prefix = opts->spool_dir;
+
+	ctx->rotate_size = opts->rotate_size;
+	ctx->rotate_age = opts->rotate_age * 1000;
+	ctx->rotate_interval = opts->rotate_interval * 1000;
+	if (ctx->rotate_size == 0) {
+		errno = EINVAL;
+		free_ctx(ctx);
+		return NULL;
+	}
+
+	ctx->writer_points.dirfd = open_spool_dir(spool_prefix, marquise_namespace, "points", &ctx->writer_points.dir_path);
+	if (ctx->writer_points.dirfd < 0) {
+		free_ctx(ctx);
+		return NULL;
+	}
+
+	ctx->writer_contents.dirfd = open_spool_dir(spool_prefix, marquise_namespace, "contents", &ctx->writer_contents.dir_path);
+	if (ctx->writer_contents.dirfd < 0) {
+		free_ctx(ctx);
+		return NULL;
+	}
+
+	const char *writer_mode = opts->spool_writer;
+	if (strcmp(writer_mode, "write") == 0) {
+		ctx->writer_mode = SPOOL_WRITER_WRITE;
+	} else if (strcmp(writer_mode, "mmap") == 0) {
+		ctx->writer_mode = SPOOL_WRITER_MMAP;
+	} else if (strcmp(writer_mode, "io_uring") == 0) {
+		/* Fall back to write() if this kernel (or build) can't. */
+		ctx->writer_mode = SPOOL_WRITER_WRITE;
+		size_t buf_size = opts->write_buffer_size;
+		ctx->uring = uring_init(opts->io_uring_depth,
+		                        buf_size > 0 ? buf_size : MARQUISE_WRITE_BUFFER_SIZE,
+		                        record_latency, ctx);
+		if (ctx->uring != NULL) {
+			ctx->writer_mode = SPOOL_WRITER_IO_URING;
+		}
+	} else {
+		errno = EINVAL;
+		free_ctx(ctx);
+		return NULL;
+	}
+
+	const char *spool_format = opts->spool_format;
+	if (strcmp(spool_format, "compact") == 0) {
+		ctx->compact = compact_encoder_new();
+		if (ctx->compact == NULL) {
+			free_ctx(ctx);
+			return NULL;
+		}
+	} else if (strcmp(spool_format, "classic") != 0) {
+		errno = EINVAL;
+		free_ctx(ctx);
+		return NULL;
+	}
+
+	const char *compression = opts->spool_compression;
+	if (strcmp(compression, "none") != 0) {
+		ctx->block_size = opts->spool_block_size;
+		ctx->codec = spool_codec_new(compression, ctx->block_size);
+		if (ctx->codec == NULL) {
+			int saved_errno = errno;
+			if (saved_errno == ENOTSUP) {
+				fprintf(stderr, "marquise_init: MARQUISE_SPOOL_COMPRESSION is %s, but no codec is available: libmarquise was built without zlib, zstd or lz4.\n", compression);
+			}
+			free_ctx(ctx);
+			errno = saved_errno;
+			return NULL;
+		}
+		ctx->writer_points.block = malloc(ctx->block_size);
+		ctx->writer_contents.block = malloc(ctx->block_size);
+		if (ctx->writer_points.block == NULL || ctx->writer_contents.block == NULL) {
+			free_ctx(ctx);
+			return NULL;
+		}
+	}
+
+	/* Without the lock, whatever is in tmp/ may still be in use. */
+	if (!disable_namespace_lock) {
+		recover_segments(ctx, &ctx->writer_points, SPOOL_POINTS);
+		recover_segments(ctx, &ctx->writer_contents, SPOOL_CONTENTS);
+	}
+
+	if (first_segment(ctx, SPOOL_POINTS) != 0 || first_segment(ctx, SPOOL_CONTENTS) != 0) {
+		free_ctx(ctx);
+		return NULL;
+	}
+
+	const char *durability = opts->durability;
+	if (strcmp(durability, "none") == 0) {
+		/* The io_uring writer's own switch for syncing at
+		 * rotation, from before there was a choice. */
+		if (ctx->uring != NULL && opts->io_uring_sync) {
+			ctx->durability = DURABILITY_ROTATE;
+		}
+	} else if (strcmp(durability, "rotate") == 0) {
+		ctx->durability = DURABILITY_ROTATE;
+	} else if (strcmp(durability, "group") == 0) {
+		ctx->durability = DURABILITY_GROUP;
+	} else if (strcmp(durability, "frame") == 0) {
+		ctx->durability = DURABILITY_FRAME;
+	} else {
+		errno = EINVAL;
+		free_ctx(ctx);
+		return NULL;
+	}
+	ctx->commit_interval = opts->group_commit_interval * 1000;
+
+	ctx->write_buf_size = opts->write_buffer_size;
+	if (ctx->write_buf_size > 0) {
+		ctx->writer_points.buf = malloc(ctx->write_buf_size);
+		ctx->writer_contents.buf = malloc(ctx->write_buf_size);
+		if (ctx->writer_points.buf == NULL || ctx->writer_contents.buf == NULL) {
+			free_ctx(ctx);
+			return NULL;
+		}
+	}
+	ctx->bytes_written_points = 0;
+	ctx->bytes_written_contents = 0;
+	/* The cache file is only safe to use while we hold the namespace
+	 * lock, which makes it ours alone. */
+	size_t cache_memory = opts->source_cache_memory;
+	if (!disable_namespace_lock && opts->source_cache_persist) {
+		char *cache_path = build_source_cache_path(spool_prefix, marquise_namespace);
+		if (cache_path == NULL) {
+			free_ctx(ctx);
+			return NULL;
+		}
+		ctx->sd_hashes = source_cache_open(cache_path, SOURCE_CACHE_INITIAL_SIZE, cache_memory);
+		free(cache_path);
+		ctx->contents_sync = true;
+	} else {
+		ctx->sd_hashes = source_cache_new(SOURCE_CACHE_INITIAL_SIZE, cache_memory);
+	}
+	if (ctx->sd_hashes == NULL) {
+		free_ctx(ctx);
+		return NULL;
+	}
+
+	/* Worker threads for marquise_update_sources_batch, started as
+	 * they are needed. */
+	ctx->source_workers = opts->source_workers;
+	if (ctx->source_workers > 1) {
+		ctx->source_pool = g_thread_pool_new(source_worker, NULL, ctx->source_workers, FALSE, NULL);
+	}
+
+	ctx->async = opts->async;
+	if (ctx->async) {
+		ctx->queue_size = opts->async_queue_size;
+		ctx->flush_interval = opts->async_flush_interval * 1000;
+		if (ctx->queue_size == 0 || ctx->flush_interval == 0) {
+			errno = EINVAL;
+			free_ctx(ctx);
+			return NULL;
+		}
+		/* Staging rings are indexed by masking, so round up to a
+		 * power of two. */
+		size_t ring_size = 1;
+		while (ring_size < ctx->queue_size) {
+			ring_size <<= 1;
+		}
+		ctx->queue_size = ring_size;
+		ctx->drain_buf = malloc(ctx->queue_size);
+		if (ctx->drain_buf == NULL) {
+			free_ctx(ctx);
+			return NULL;
+		}
+		ctx->id = __atomic_fetch_add(&next_ctx_id, 1, __ATOMIC_RELAXED);
+		ctx->flusher = g_thread_new("marquise-flush", async_flusher, ctx);
+	}
+
+	ctx->rotator = g_thread_new("marquise-rotate", rotator, ctx);
+
+	/* Left off if the identifiers can't be built; that needn't stop
+	 * anyone sending data. */
+	size_t telemetry_interval = opts->telemetry_interval;
+	if (telemetry_interval > 0) {
+		ctx->telemetry = telemetry_start(ctx, (gint64)telemetry_interval * 1000);
+	}
+	return ctx;
+}
+
+marquise_ctx *marquise_init(char *marquise_namespace)
+{
+	return marquise_init_opts(marquise_namespace, NULL);
+}
+
+/* Writes a single already-serialized frame, either simple or extended,
+ * gathered from iov[1..iovcnt-1] to the current spool file; iov[0] is
+ * scratch for spool_writev(). Frames are accumulated in the writer's
+ * buffer and only written out when it fills, on rotation, or on
+ * marquise_flush().
+ * If (post-write) the current spool file is due for rotation, by size
+ * or by time, publish it and set a new spool file as current for next
+ * time.
+ *
+ * Returns zero on success, -1 on error, or panics and exits with status
+ * 1 if passed an invalid spool type.
+ */
+int rotating_writev(marquise_ctx *ctx, struct iovec *iov, int iovcnt, spool_type t) {
+	if (t != SPOOL_POINTS && t != SPOOL_CONTENTS) {
+		/* We were passed an invalid spool_type, shouldn't ever
+		 * happen as this function isn't exposed. */
+		fprintf(stderr, "rotating_write: passed an invalid spool type %d, this can't happen. Please report a bug.\n", t);
+		exit(EXIT_FAILURE);
+	}
+	PROBE2(rotating_write, t, iov_length(iov + 1, iovcnt - 1));
+	if (ctx->async && staging_push(ctx, t, iov, iovcnt)) {
+		return 0;
+	}
+	lock_writer(ctx);
+	int ret = spool_writev(ctx, t, iov, iovcnt, 1);
+	if (ret == 0) {
+		maybe_rotate(ctx, t);
+	}
+	return unlock_writer(ctx, ret);
+}
+
+/* As rotating_writev(), for a frame already serialised into buf. */
+int rotating_write(marquise_ctx * ctx, uint8_t *buf, size_t buf_size, spool_type t) {
+	struct iovec iov[2];
+	iov[1].iov_base = buf;
+	iov[1].iov_len = buf_size;
+	return rotating_writev(ctx, iov, 2, t);
+}
+
+/* Serialise a simple frame into the 24 bytes at buf. */
+void encode_simple_frame(uint8_t *buf, uint64_t address, uint64_t timestamp, uint64_t value)
+{
+	/* Clear the LSB for a simple frame. */
+	address = address >> 1 << 1;
+
+	U64TO8_LE(buf, address);
+	U64TO8_LE(buf + 8, timestamp);
+	U64TO8_LE(buf + 16, value);
+}
+
+/* Serialise the 24-byte header of an extended frame into buf; the value
+ * follows it in the spool. */
+void encode_extended_header(uint8_t *buf, uint64_t address, uint64_t timestamp, size_t value_len)
+{
+	uint64_t length_word = value_len;
+	/* Set the LSB for an extended frame. */
+	address |= 1;
+	U64TO8_LE(buf, address);
+	U64TO8_LE(buf + 8, timestamp);
+	U64TO8_LE(buf + 16, length_word);
+}
+
+/* Addresses 0 and 1, the same address once the LSB is cleared, are
+ * reserved for simple points and source dicts: a frame sent there could
+ * have a header of all zeroes, which is how the unused tail of a mapped
+ * segment reads, and where recovery and readers stop. */
+bool reserved_address(uint64_t address)
+{
+	return address >> 1 == 0;
+}
+
+int marquise_send_simple(marquise_ctx * ctx, uint64_t address,
+			 uint64_t timestamp, uint64_t value)
+{
+	if (reserved_address(address)) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint8_t buf[24];
+	encode_simple_frame(buf, address, timestamp, value);
+	return rotating_write(ctx, buf, 24, SPOOL_POINTS);
+}
+
+int marquise_send_simple_batch(marquise_ctx *ctx, const marquise_point *pts, size_t n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	if (n > SIZE_MAX / 24) {
+		errno = EINVAL;		// Overflow
+		return -1;
+	}
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (reserved_address(pts[i].address)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	uint8_t *buf = malloc(n * 24);
+	if (buf == NULL) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		encode_simple_frame(buf + i * 24, pts[i].address, pts[i].timestamp, pts[i].value);
+	}
+	if (ctx->async) {
+		struct iovec iov[2];
+		iov[1].iov_base = buf;
+		iov[1].iov_len = n * 24;
+		if (staging_push(ctx, SPOOL_POINTS, iov, 2)) {
+			free(buf);
+			return 0;
+		}
+	}
+
+	/* Everything up to and including the frame which takes the current
+	 * segment past the rotation size goes out together, then we rotate
+	 * and carry on with the rest. */
+	int ret = 0;
+	size_t done = 0;
+	lock_writer(ctx);
+	while (done < n) {
+		size_t count = n - done;
+		if (ctx->bytes_written_points < ctx->rotate_size) {
+			size_t room = ctx->rotate_size - ctx->bytes_written_points;
+			size_t fit = (room + 23) / 24;
+			if (fit < count) {
+				count = fit;
+			}
+		}
+		struct iovec iov[2];
+		iov[1].iov_base = buf + done * 24;
+		iov[1].iov_len = count * 24;
+		if (spool_writev(ctx, SPOOL_POINTS, iov, 2, count) != 0) {
+			ret = -1;
+			break;
+		}
+		maybe_rotate(ctx, SPOOL_POINTS);
+		done += count;
+	}
+	ret = unlock_writer(ctx, ret);
+	free(buf);
+	return ret;
+}
+
+int marquise_send_extended(marquise_ctx * ctx, uint64_t address,
+			   uint64_t timestamp, char *value, size_t value_len)
+{
+	if (24 + value_len < value_len) {
+		errno = EINVAL; 	// Overflow
+		return -1;
+	}
+
+	/* The header and the caller's value go out together without being
+	 * copied into one buffer first. */
+	uint8_t header[24];
+	encode_extended_header(header, address, timestamp, value_len);
+	struct iovec iov[3];
+	iov[1].iov_base = header;
+	iov[1].iov_len = 24;
+	iov[2].iov_base = value;
+	iov[2].iov_len = value_len;
+	return rotating_writev(ctx, iov, 3, SPOOL_POINTS);
+}
+
+int marquise_send_extended_iov(marquise_ctx *ctx, uint64_t address,
+			       uint64_t timestamp, const struct iovec *value_iov, int iovcnt)
+{
+	if (iovcnt < 0 || iovcnt > IOV_MAX - 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t value_len = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		if (value_len + value_iov[i].iov_len < value_len) {
+			errno = EINVAL;	// Overflow
+			return -1;
+		}
+		value_len += value_iov[i].iov_len;
+	}
+	if (24 + value_len < value_len) {
+		errno = EINVAL; 	// Overflow
+		return -1;
 	}
 
-	free_ctx(ctx);
-	return 0;
+	uint8_t header[24];
+	encode_extended_header(header, address, timestamp, value_len);
+	struct iovec iov[iovcnt + 2];
+	iov[1].iov_base = header;
+	iov[1].iov_len = 24;
+	memcpy(iov + 2, value_iov, iovcnt * sizeof(struct iovec));
+	return rotating_writev(ctx, iov, iovcnt + 2, SPOOL_POINTS);
 }
 
-marquise_source *marquise_new_source(char **fields, char **values, size_t n_tags)
+/* Write n frames, each made of a header and a body, from iov[1..2n];
+ * iov[0] is scratch. Frames go out a segment at a time, rotating in
+ * between exactly as they would if written one by one. Returns zero on
+ * success, -1 on error. */
+int write_frame_pairs(marquise_ctx *ctx, spool_type t, struct iovec *iov, size_t n)
 {
-	int i;
+	if (ctx->async && staging_push(ctx, t, iov, 2 * n + 1)) {
+		return 0;
+	}
 
-	/* We will test for ENOMEM later. */
-	errno = 0;
+	int ret = 0;
+	size_t done = 0;
+	lock_writer(ctx);
+	while (done < n) {
+		/* Take frames until one of them pushes the segment over. */
+		size_t segment_bytes = (t == SPOOL_POINTS) ? ctx->bytes_written_points : ctx->bytes_written_contents;
+		size_t count = 0;
+		while (done + count < n) {
+			const struct iovec *frame = iov + 2 * (done + count) + 1;
+			size_t frame_len = frame[0].iov_len + frame[1].iov_len;
+			count++;
+			if (segment_bytes < ctx->rotate_size) {
+				segment_bytes += frame_len;
+				if (segment_bytes >= ctx->rotate_size) {
+					break;
+				}
+			}
+		}
+		/* The slot before this segment's first frame is free by now,
+		 * so it becomes the scratch slot. */
+		if (spool_writev(ctx, t, iov + 2 * done, 2 * count + 1, count) != 0) {
+			ret = -1;
+			break;
+		}
+		maybe_rotate(ctx, t);
+		done += count;
+	}
+	return unlock_writer(ctx, ret);
+}
 
-	/* Everything looks good? Looks good. */
-	for (i = 0; i < n_tags; i++) {
-		if (!valid_source_tag(fields[i]) || !valid_source_tag(values[i])) {
-			errno = EINVAL;
-			return NULL;
+int marquise_send_extended_batch(marquise_ctx *ctx, const marquise_extended_point *pts, size_t n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (24 + pts[i].value_len < pts[i].value_len) {
+			errno = EINVAL;		// Overflow
+			return -1;
+		}
+	}
+	if (n > SIZE_MAX / 24 || n > (SIZE_MAX / sizeof(struct iovec) - 1) / 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Headers are serialised together; values are written straight
+	 * from the caller's memory. Slot zero is for spool_writev(). */
+	uint8_t *headers = malloc(n * 24);
+	struct iovec *iov = malloc((2 * n + 1) * sizeof(struct iovec));
+	if (headers == NULL || iov == NULL) {
+		free(headers);
+		free(iov);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		encode_extended_header(headers + i * 24, pts[i].address, pts[i].timestamp, pts[i].value_len);
+		iov[2 * i + 1].iov_base = headers + i * 24;
+		iov[2 * i + 1].iov_len = 24;
+		iov[2 * i + 2].iov_base = pts[i].value;
+		iov[2 * i + 2].iov_len = pts[i].value_len;
+	}
+	int ret = write_frame_pairs(ctx, SPOOL_POINTS, iov, n);
+	free(headers);
+	free(iov);
+	return ret;
+}
+
+int marquise_flush(marquise_ctx *ctx)
+{
+	int ret;
+	g_mutex_lock(&ctx->write_lock);
+	if (ctx->async) {
+		ret = async_drain(ctx);
+	} else {
+		ret = flush_spool(ctx, SPOOL_POINTS);
+		if (flush_spool(ctx, SPOOL_CONTENTS) != 0) {
+			ret = -1;
+		}
+	}
+	if (ret == 0 && ctx->durability != DURABILITY_NONE) {
+		ret = sync_spools(ctx);
+	}
+	g_mutex_unlock(&ctx->write_lock);
+	return ret;
+}
+
+/* Flush and close ctx's spool files, release its namespace and free
+ * it, once nothing else is writing to it. If lost, frames have been
+ * dropped on the way, so the source cache isn't saved. Zero on success,
+ * -1 with errno set if anything failed. */
+int shutdown_finish(marquise_ctx *ctx, bool lost)
+{
+	int ret = 0;
+	int flush_ret = 0;
+	int saved_errno = 0;
+	/* Buffered frames are lost if this fails, but we still have to
+	 * let go of the namespace. */
+	if (marquise_flush(ctx) != 0) {
+		flush_ret = -1;
+		saved_errno = errno;
+	}
+	if (finish_segments(ctx) != 0 && flush_ret == 0) {
+		flush_ret = -1;
+		saved_errno = errno;
+	}
+	/* Only if every source dict it records has reached the spool, and
+	 * the disk, and before another process can take the namespace. */
+	if (flush_ret == 0 && !lost) {
+		g_mutex_lock(&ctx->cache_lock);
+		source_cache_persist(ctx->sd_hashes);
+		g_mutex_unlock(&ctx->cache_lock);
+	}
+	if (fcntl(ctx->lock_fd, F_GETFD) > 0) {
+		ret = flock(ctx->lock_fd, LOCK_UN);
+		if (ret != 0) {
+			return -1;
+		}
+	}
+
+	if (access(ctx->lock_path, F_OK) != -1) {
+		ret = unlink(ctx->lock_path);
+		if (ret != 0) {
+			return -1;
 		}
 	}
 
-	/* malloc all the things. */
-	marquise_source *source = malloc(sizeof(marquise_source));
+	free_ctx(ctx);
+	if (flush_ret != 0) {
+		errno = saved_errno;
+	}
+	return flush_ret;
+}
+
+/* Shut down ctx, allowing until end_time (monotonic, or forever if
+ * negative) for the asynchronous queues to drain. */
+int marquise_shutdown_timeout_at(marquise_ctx *ctx, gint64 end_time)
+{
+	/* Its last points have to make it out with everything else. */
+	telemetry_stop(ctx->telemetry);
+	ctx->telemetry = NULL;
+	rotator_stop(ctx);
+	if (ctx->flusher != NULL && async_stop(ctx, end_time) != 0) {
+		/* The flusher has the context now. */
+		return -1;
+	}
+	return shutdown_finish(ctx, false);
+}
+
+int marquise_shutdown(marquise_ctx * ctx)
+{
+	return marquise_shutdown_timeout_at(ctx, -1);
+}
+
+int marquise_shutdown_timeout(marquise_ctx *ctx, unsigned int timeout_ms)
+{
+	return marquise_shutdown_timeout_at(ctx, g_get_monotonic_time() + (gint64)timeout_ms * 1000);
+}
+
+/* Lay out a source for n_tags tags with strings_len bytes of strings
+ * (terminators included) as one allocation: the struct, then the
+ * pointer arrays, then each field's and each value's length, then the
+ * strings themselves. Returns the source with its arrays set up, the
+ * length array in *lens and the start of the string space in *strings,
+ * or NULL on failure. */
+marquise_source *alloc_source(size_t n_tags, size_t strings_len, size_t **lens, char **strings)
+{
+	size_t per_tag = 2 * sizeof(char *) + 2 * sizeof(size_t);
+	if (n_tags > (SIZE_MAX - sizeof(marquise_source)) / per_tag) {
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t header_len = sizeof(marquise_source) + n_tags * per_tag;
+	if (strings_len > SIZE_MAX - header_len) {
+		errno = EINVAL;
+		return NULL;
+	}
+	marquise_source *source = malloc(header_len + strings_len);
 	if (source == NULL) {
 		return NULL;
 	}
+	source->fields = (char **)(source + 1);
+	source->values = source->fields + n_tags;
+	source->n_tags = n_tags;
+	*lens = (size_t *)(source->values + n_tags);
+	*strings = (char *)(*lens + 2 * n_tags);
+	return source;
+}
 
-	char **_fields = malloc(n_tags * sizeof(char*));
-	if (fields == NULL) {
-		free(source);
+/* The lengths stored with a source laid out by alloc_source(), field
+ * then value for each tag, or NULL if the caller built source itself.
+ * Nobody else can have put the field array right after the struct, as
+ * marquise_free_source() couldn't free it. */
+const size_t *source_lens(const marquise_source *source)
+{
+	if (source->fields != (char **)(source + 1)) {
 		return NULL;
 	}
+	return (const size_t *)(source->values + source->n_tags);
+}
 
-	char **_values = malloc(n_tags * sizeof(char*));
-	if (values == NULL) {
-		free(_fields);
-		free(source);
-		return NULL;
+/* Length of field (which is 0) or value (1) of source's tag i. */
+size_t source_tag_len(const marquise_source *source, const size_t *lens, size_t i, int which)
+{
+	if (lens != NULL) {
+		return lens[2 * i + which];
 	}
+	return strlen(which ? source->values[i] : source->fields[i]);
+}
 
-	source->fields = _fields;
-	source->values = _values;
-	source->n_tags = n_tags;
+marquise_source *marquise_new_source(char **fields, char **values, size_t n_tags)
+{
+	size_t i;
+	size_t strings_len = 0;
 
-	/* Iterate over fields,values in lock-step, malloc'ing and assigning to */
-	/* fields[i] and values[i] appropriately.                               */
-	/*                                                                      */
-	/* XXX: strdup() is totally UTF8-clean, right? */
+	/* Measure and validate everything in one pass over each tag. */
 	for (i = 0; i < n_tags; i++) {
-		/* Eugh, if these allocations fail we need to get out safely     */
-		/* and free() everything before bailing out. It's dirty but I    */
-		/* think this works.                                             */
-		source->fields[i] = strdup(fields[i]);
-		if (source->fields[i] == NULL && errno == ENOMEM) {
-			break;
-		}
-		source->values[i] = strdup(values[i]);
-		if (source->values[i] == NULL && errno == ENOMEM) {
-			break;
+		uint8_t field_valid, value_valid;
+		size_t field_len = scan_source_tag(fields[i], &field_valid);
+		size_t value_len = scan_source_tag(values[i], &value_valid);
+		if (!field_valid || !value_valid) {
+			errno = EINVAL;
+			return NULL;
 		}
+		strings_len += field_len + value_len + 2;
 	}
-	if (errno == ENOMEM) {
-		/* Should only get here if we break'd. */
-		marquise_free_source(source);
+
+	size_t *lens;
+	char *strings;
+	marquise_source *source = alloc_source(n_tags, strings_len, &lens, &strings);
+	if (source == NULL) {
 		return NULL;
 	}
 
+	/* stpcpy hands back the end of each copy, which gives us the
+	 * lengths without measuring again. */
+	for (i = 0; i < n_tags; i++) {
+		char *end = stpcpy(strings, fields[i]);
+		source->fields[i] = strings;
+		lens[2 * i] = end - strings;
+		strings = end + 1;
+		end = stpcpy(strings, values[i]);
+		source->values[i] = strings;
+		lens[2 * i + 1] = end - strings;
+		strings = end + 1;
+	}
 	return source;
 }
 
 void marquise_free_source(marquise_source *source)
 {
-	if (source != NULL) {
-		int i;
+	if (source == NULL) {
+		return;
+	}
+	/* Ours are a single allocation; see alloc_source(). */
+	if (source_lens(source) == NULL) {
+		size_t i;
 		for (i = 0; i < source->n_tags; i++) {
 			free(source->fields[i]);
 			free(source->values[i]);
 		}
 		free(source->fields);
 		free(source->values);
-		free(source);
 	}
+	free(source);
 }
 
-/* Takes a marquise_source and serialises it to a string, suitable to append
- * to a contents spool file. It is the caller's responsibility to free() the
- * serialised string once it is no longer needed.
- *
- * XXX: This is full of assumptions that fields and values are properly
- * null-terminated.
- */
-char *serialise_marquise_source(marquise_source *source)
+struct marquise_source_builder {
+	char   *strings;	/* Each tag's field then value, NUL-terminated. */
+	size_t  strings_len;
+	size_t  strings_cap;
+	size_t *lens;		/* Field and value lengths, two per tag. */
+	size_t  n_tags;
+	size_t  tags_cap;
+};
+
+marquise_source_builder *marquise_source_builder_new(void)
+{
+	marquise_source_builder *b = malloc(sizeof(marquise_source_builder));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->strings = NULL;
+	b->strings_len = 0;
+	b->strings_cap = 0;
+	b->lens = NULL;
+	b->n_tags = 0;
+	b->tags_cap = 0;
+	return b;
+}
+
+int marquise_source_builder_add(marquise_source_builder *b, const char *field, size_t field_len, const char *value, size_t value_len)
+{
+	if (!valid_source_tag_len(field, field_len) || !valid_source_tag_len(value, value_len) ||
+	    memchr(field, '\0', field_len) != NULL || memchr(value, '\0', value_len) != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t need = field_len + value_len + 2;
+	if (need < field_len || b->strings_len > SIZE_MAX - need) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (b->strings_len + need > b->strings_cap) {
+		size_t cap = b->strings_cap ? b->strings_cap : 256;
+		while (cap < b->strings_len + need) {
+			cap = (cap > SIZE_MAX / 2) ? b->strings_len + need : cap * 2;
+		}
+		char *strings = realloc(b->strings, cap);
+		if (strings == NULL) {
+			return -1;
+		}
+		b->strings = strings;
+		b->strings_cap = cap;
+	}
+	if (b->n_tags == b->tags_cap) {
+		size_t cap = b->tags_cap ? b->tags_cap * 2 : 16;
+		size_t *lens = realloc(b->lens, 2 * cap * sizeof(size_t));
+		if (lens == NULL) {
+			return -1;
+		}
+		b->lens = lens;
+		b->tags_cap = cap;
+	}
+
+	char *p = b->strings + b->strings_len;
+	memcpy(p, field, field_len);
+	p[field_len] = '\0';
+	memcpy(p + field_len + 1, value, value_len);
+	p[field_len + 1 + value_len] = '\0';
+	b->strings_len += need;
+	b->lens[2 * b->n_tags] = field_len;
+	b->lens[2 * b->n_tags + 1] = value_len;
+	b->n_tags++;
+	return 0;
+}
+
+marquise_source *marquise_source_builder_finish(marquise_source_builder *b)
+{
+	size_t *lens;
+	char *strings;
+	marquise_source *source = alloc_source(b->n_tags, b->strings_len, &lens, &strings);
+	if (source == NULL) {
+		return NULL;
+	}
+	if (b->strings_len > 0) {
+		memcpy(strings, b->strings, b->strings_len);
+	}
+	memcpy(lens, b->lens, 2 * b->n_tags * sizeof(size_t));
+	size_t i;
+	for (i = 0; i < b->n_tags; i++) {
+		source->fields[i] = strings;
+		strings += b->lens[2 * i] + 1;
+		source->values[i] = strings;
+		strings += b->lens[2 * i + 1] + 1;
+	}
+	/* Ready for the next source, keeping the memory. */
+	b->strings_len = 0;
+	b->n_tags = 0;
+	return source;
+}
+
+void marquise_source_builder_free(marquise_source_builder *b)
+{
+	if (b == NULL) {
+		return;
+	}
+	free(b->strings);
+	free(b->lens);
+	free(b);
+}
+
+void marquise_source_cache_stats(marquise_ctx *ctx, marquise_cache_stats *stats)
+{
+	g_mutex_lock(&ctx->cache_lock);
+	stats->hits = ctx->sd_hashes->hits;
+	stats->misses = ctx->sd_hashes->misses;
+	stats->evictions = ctx->sd_hashes->evictions;
+	stats->entries = ctx->sd_hashes->count + (ctx->sd_hashes->has_zero ? 1 : 0);
+	stats->limit = source_cache_limit(ctx->sd_hashes);
+	g_mutex_unlock(&ctx->cache_lock);
+}
+
+void marquise_get_stats(marquise_ctx *ctx, marquise_stats *out)
 {
 	int i;
-	const char* keyvalsep     = ":";
-	const char* keyvalpairsep = ",";
+	out->frames_points = __atomic_load_n(&ctx->stats.frames_points, __ATOMIC_RELAXED);
+	out->frames_contents = __atomic_load_n(&ctx->stats.frames_contents, __ATOMIC_RELAXED);
+	out->bytes_points = __atomic_load_n(&ctx->stats.bytes_points, __ATOMIC_RELAXED);
+	out->bytes_contents = __atomic_load_n(&ctx->stats.bytes_contents, __ATOMIC_RELAXED);
+	out->rotations = __atomic_load_n(&ctx->stats.rotations, __ATOMIC_RELAXED);
+	out->write_errors = __atomic_load_n(&ctx->stats.write_errors, __ATOMIC_RELAXED);
+	out->source_hits = __atomic_load_n(&ctx->sd_hashes->hits, __ATOMIC_RELAXED);
+	out->source_misses = __atomic_load_n(&ctx->sd_hashes->misses, __ATOMIC_RELAXED);
+	for (i = 0; i < MARQUISE_STATS_LATENCY_BUCKETS; i++) {
+		out->write_latency[i] = __atomic_load_n(&ctx->stats.write_latency[i], __ATOMIC_RELAXED);
+	}
+}
 
-	/* Measure the size of the source_dict */
-	int dict_size_accumulator = 0;
+/* Return the address hash of source's serialised form, exactly as
+ * marquise_hash_identifier() would compute it from the output of
+ * serialise_marquise_source(), without building the string. */
+uint64_t hash_marquise_source(marquise_source *source)
+{
+	unsigned char key[16];
+	memset(key, 0, 16);
+	siphash_state state;
+	siphash_init(&state, key);
+
+	const size_t *lens = source_lens(source);
+	size_t i;
+	for (i = 0; i < source->n_tags; i++) {
+		if (i > 0) {
+			siphash_update(&state, (const unsigned char *)",", 1);
+		}
+		siphash_update(&state, (const unsigned char *)source->fields[i], source_tag_len(source, lens, i, 0));
+		siphash_update(&state, (const unsigned char *)":", 1);
+		siphash_update(&state, (const unsigned char *)source->values[i], source_tag_len(source, lens, i, 1));
+	}
+	return siphash_final(&state) >> 1 << 1;
+}
+
+/* Serialise source, storing the length of the result (excluding the
+ * terminator) in *len. */
+char *serialise_source(marquise_source *source, size_t *len)
+{
+	const size_t *lens = source_lens(source);
+	size_t i;
+
+	/* Each pair is key:value, with a comma between pairs and a
+	 * terminating null byte at the end. */
+	size_t dict_size = 1;
 	for (i = 0; i < source->n_tags; i++) {
-		/* Add 1 for the key:value separating colon. */
-		dict_size_accumulator += strlen(source->fields[i]) + strlen(source->values[i]) + 1;
+		dict_size += source_tag_len(source, lens, i, 0) + source_tag_len(source, lens, i, 1) + 1 + (i > 0);
 	}
-	/* There's a comma between each key-value pair. */
-	dict_size_accumulator += source->n_tags - 1;
-	/* One more for the terminating null byte. */
-	dict_size_accumulator++;
 
-	/* Go ahead and allocate. */
-	char* serialised_dict = malloc(dict_size_accumulator);
+	char* serialised_dict = malloc(dict_size);
 	if (serialised_dict == NULL) {
 		return NULL;
 	}
-	char* serialised_dict_end = serialised_dict;
-	/* Ensure the string is always null-terminated. */
-	memset(serialised_dict, '\0', dict_size_accumulator);
 
 	/* Serialise the source_dict into serialised_dict. Like this:  k1:v1,k2:v2,k3:v3 */
+	char* serialised_dict_end = serialised_dict;
 	for (i = 0; i < source->n_tags; i++) {
-		serialised_dict_end = stpncpy(serialised_dict_end, source->fields[i], strlen(source->fields[i]));
-		serialised_dict_end = stpncpy(serialised_dict_end, keyvalsep, 1);
-		serialised_dict_end = stpncpy(serialised_dict_end, source->values[i], strlen(source->values[i]));
-
-		/* Don't add a pair-separator after the last key-value pair. */
-		if (i < source->n_tags-1) {
-			serialised_dict_end = stpncpy(serialised_dict_end, keyvalpairsep, 1);
+		/* Don't add a pair-separator before the first key-value pair. */
+		if (i > 0) {
+			*serialised_dict_end++ = ',';
 		}
+		size_t field_len = source_tag_len(source, lens, i, 0);
+		size_t value_len = source_tag_len(source, lens, i, 1);
+		memcpy(serialised_dict_end, source->fields[i], field_len);
+		serialised_dict_end += field_len;
+		*serialised_dict_end++ = ':';
+		memcpy(serialised_dict_end, source->values[i], value_len);
+		serialised_dict_end += value_len;
 	}
+	*serialised_dict_end = '\0';
 
+	*len = serialised_dict_end - serialised_dict;
 	return serialised_dict;
 }
 
+/* Takes a marquise_source and serialises it to a string, suitable to append
+ * to a contents spool file. It is the caller's responsibility to free() the
+ * serialised string once it is no longer needed.
+ */
+char *serialise_marquise_source(marquise_source *source)
+{
+	size_t len;
+	return serialise_source(source, &len);
+}
+
+/* Drop a source dict from the cache after failing to write it, so that
+ * the next update tries again. */
+void forget_source(marquise_ctx *ctx, uint64_t hash)
+{
+	int saved_errno = errno;
+	g_mutex_lock(&ctx->cache_lock);
+	source_cache_remove(ctx->sd_hashes, hash);
+	g_mutex_unlock(&ctx->cache_lock);
+	errno = saved_errno;
+}
+
+/* Hashing or serialising the sources in a batch, split into chunks
+ * across the context's source pool. */
+struct source_batch {
+	marquise_source **sources;
+	uint64_t *hashes;
+	/* When serialising, only the sources whose indices are in which,
+	 * into dicts and dict_lens. */
+	bool      serialise;
+	const size_t *which;
+	char    **dicts;
+	size_t   *dict_lens;
+	GMutex    lock;
+	GCond     done;
+	guint     pending;
+	bool      failed;
+};
+
+struct source_chunk {
+	struct source_batch *batch;
+	size_t begin;
+	size_t end;
+};
+
+/* Below this many sources per chunk, handing work to another thread
+ * costs more than it saves. */
+#define SOURCE_BATCH_MIN_CHUNK 256
+
+bool run_source_chunk(struct source_batch *batch, size_t begin, size_t end)
+{
+	size_t k;
+	for (k = begin; k < end; k++) {
+		if (batch->serialise) {
+			batch->dicts[k] = serialise_source(batch->sources[batch->which[k]], &batch->dict_lens[k]);
+			if (batch->dicts[k] == NULL) {
+				return false;
+			}
+		} else {
+			batch->hashes[k] = hash_marquise_source(batch->sources[k]);
+		}
+	}
+	return true;
+}
+
+void source_worker(gpointer data, gpointer user_data)
+{
+	struct source_chunk *chunk = data;
+	struct source_batch *batch = chunk->batch;
+	bool ok = run_source_chunk(batch, chunk->begin, chunk->end);
+	g_mutex_lock(&batch->lock);
+	if (!ok) {
+		batch->failed = true;
+	}
+	if (--batch->pending == 0) {
+		g_cond_signal(&batch->done);
+	}
+	g_mutex_unlock(&batch->lock);
+}
+
+/* Process n items of batch, in parallel if it's worth it. The calling
+ * thread takes the last chunk itself. Returns false if any failed. */
+bool run_source_batch(marquise_ctx *ctx, struct source_batch *batch, size_t n)
+{
+	size_t chunks = (n + SOURCE_BATCH_MIN_CHUNK - 1) / SOURCE_BATCH_MIN_CHUNK;
+	if (chunks > ctx->source_workers) {
+		chunks = ctx->source_workers;
+	}
+	if (ctx->source_pool == NULL || chunks <= 1) {
+		return run_source_chunk(batch, 0, n);
+	}
+
+	struct source_chunk chunk[chunks];
+	size_t per_chunk = (n + chunks - 1) / chunks;
+	size_t c;
+	batch->pending = 0;
+	batch->failed = false;
+	for (c = 0; c < chunks; c++) {
+		chunk[c].batch = batch;
+		chunk[c].begin = c * per_chunk;
+		chunk[c].end = (c + 1) * per_chunk < n ? (c + 1) * per_chunk : n;
+	}
+	g_mutex_lock(&batch->lock);
+	for (c = 0; c + 1 < chunks; c++) {
+		if (g_thread_pool_push(ctx->source_pool, &chunk[c], NULL)) {
+			batch->pending++;
+		} else if (!run_source_chunk(batch, chunk[c].begin, chunk[c].end)) {
+			batch->failed = true;
+		}
+	}
+	g_mutex_unlock(&batch->lock);
+
+	bool ok = run_source_chunk(batch, chunk[chunks - 1].begin, chunk[chunks - 1].end);
+	g_mutex_lock(&batch->lock);
+	while (batch->pending > 0) {
+		g_cond_wait(&batch->done, &batch->lock);
+	}
+	ok = ok && !batch->failed;
+	g_mutex_unlock(&batch->lock);
+	return ok;
+}
+
+int marquise_update_sources_batch(marquise_ctx *ctx, const uint64_t *addresses, marquise_source **sources, size_t n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	if (n > SIZE_MAX / 16 || n > (SIZE_MAX / sizeof(struct iovec) - 1) / 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (reserved_address(addresses[i])) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	uint64_t *hashes = malloc(n * sizeof(uint64_t));
+	size_t *misses = malloc(n * sizeof(size_t));
+	if (hashes == NULL || misses == NULL) {
+		free(hashes);
+		free(misses);
+		return -1;
+	}
+
+	struct source_batch batch;
+	batch.sources = sources;
+	batch.hashes = hashes;
+	batch.serialise = false;
+	g_mutex_init(&batch.lock);
+	g_cond_init(&batch.done);
+	run_source_batch(ctx, &batch, n);
+
+	/* One trip through the cache for the lot. A source repeated within
+	 * the batch is a hit the second time, as if sent one by one. */
+	size_t n_misses = 0;
+	g_mutex_lock(&ctx->cache_lock);
+	for (i = 0; i < n; i++) {
+		if (source_cache_insert(ctx->sd_hashes, hashes[i]) != 0) {
+			misses[n_misses++] = i;
+		} else {
+			PROBE1(source_hit, addresses[i]);
+		}
+	}
+	g_mutex_unlock(&ctx->cache_lock);
+
+	int ret = 0;
+	if (n_misses > 0) {
+		char **dicts = calloc(n_misses, sizeof(char *));
+		size_t *dict_lens = malloc(n_misses * sizeof(size_t));
+		uint8_t *headers = malloc(n_misses * 16);
+		struct iovec *iov = malloc((2 * n_misses + 1) * sizeof(struct iovec));
+		if (dicts == NULL || dict_lens == NULL || headers == NULL || iov == NULL) {
+			ret = -1;
+		} else {
+			batch.serialise = true;
+			batch.which = misses;
+			batch.dicts = dicts;
+			batch.dict_lens = dict_lens;
+			if (!run_source_batch(ctx, &batch, n_misses)) {
+				ret = -1;
+			}
+		}
+
+		if (ret == 0) {
+			/* All the misses go out together: each frame's header
+			 * followed by its serialised dict. */
+			for (i = 0; i < n_misses; i++) {
+				/* Fix the address, all sourcedicts have the LSB set to zero. */
+				uint64_t address = addresses[misses[i]] >> 1 << 1;
+				PROBE2(source_miss, addresses[misses[i]], dict_lens[i]);
+				U64TO8_LE(headers + 16 * i, address);
+				U64TO8_LE(headers + 16 * i + 8, (uint64_t)dict_lens[i]);
+				iov[2 * i + 1].iov_base = headers + 16 * i;
+				iov[2 * i + 1].iov_len = 16;
+				iov[2 * i + 2].iov_base = dicts[i];
+				iov[2 * i + 2].iov_len = dict_lens[i];
+			}
+			ret = write_frame_pairs(ctx, SPOOL_CONTENTS, iov, n_misses);
+		}
+
+		/* Anything not written must be tried again next time. */
+		if (ret != 0) {
+			int saved_errno = errno;
+			g_mutex_lock(&ctx->cache_lock);
+			for (i = 0; i < n_misses; i++) {
+				source_cache_remove(ctx->sd_hashes, hashes[misses[i]]);
+			}
+			g_mutex_unlock(&ctx->cache_lock);
+			errno = saved_errno;
+		}
+		if (dicts != NULL) {
+			for (i = 0; i < n_misses; i++) {
+				free(dicts[i]);
+			}
+		}
+		free(dicts);
+		free(dict_lens);
+		free(headers);
+		free(iov);
+	}
+
+	g_mutex_clear(&batch.lock);
+	g_cond_clear(&batch.done);
+	free(hashes);
+	free(misses);
+	return ret;
+}
+
 int marquise_update_source(marquise_ctx *ctx, uint64_t address, marquise_source *source)
 {
 	/* Appends the source_dict to the spool_path_contents file.
@@ -603,53 +3156,64 @@ int marquise_update_source(marquise_ctx *ctx, uint64_t address, marquise_source
 	size_t   buf_len;
 	size_t   header_size = sizeof(address) + sizeof(serialised_dict_len);
 
-	char* serialised_dict = serialise_marquise_source(source);
-	if (serialised_dict == NULL) {
+	if (reserved_address(address)) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	uint64_t *hash = malloc(sizeof(uint64_t));
-	serialised_dict_len = strlen(serialised_dict);
-	*hash = marquise_hash_identifier((const unsigned char*)serialised_dict, serialised_dict_len);
-
-	/* If hash is not present in the cache, add and continue, else early exit*/
-	if (g_tree_lookup(ctx->sd_hashes, (gpointer)hash) == NULL) {
-		int *dummy_value = malloc(sizeof(int)); //Dummy value, could be anything not NULL
-		*dummy_value = 1;
-		g_tree_insert(ctx->sd_hashes, (gpointer)hash, (gpointer)dummy_value);
-	} else {
-		free(serialised_dict);
-		free(hash);
+	/* Usually the source dict hasn't changed, so check the cache
+	 * before serialising anything. */
+	uint64_t hash = hash_marquise_source(source);
+
+	/* If hash is not present in the cache, add and continue, else early
+	 * exit. If the cache can't grow to take it we just write it again
+	 * next time. */
+	g_mutex_lock(&ctx->cache_lock);
+	int inserted = source_cache_insert(ctx->sd_hashes, hash);
+	g_mutex_unlock(&ctx->cache_lock);
+	if (inserted == 0) {
+		PROBE1(source_hit, address);
 		return 0;
 	}
 
+	size_t dict_len;
+	char* serialised_dict = serialise_source(source, &dict_len);
+	if (serialised_dict == NULL) {
+		forget_source(ctx, hash);
+		return -1;
+	}
+	serialised_dict_len = dict_len;
+	PROBE2(source_miss, address, dict_len);
+
 	/* Get sizes and sanity check our measurements. */
 	buf_len = header_size + serialised_dict_len;
 	if (buf_len < serialised_dict_len) {
 		// 0verflow
 		free(serialised_dict);
+		forget_source(ctx, hash);
 		errno = EINVAL;
 		return -1;
 	}
 
-	/* Looks safe to proceed. */
-	uint8_t *buf = malloc(buf_len);
-	if (buf == NULL) {
-		free(serialised_dict);
-		return -1;
-	}
-
 	/* Fix the address, all sourcedicts have the LSB set to zero. */
 	address = address >> 1 << 1;
 
-	/* Build the buffer. */
-	U64TO8_LE(buf, address);
-	U64TO8_LE(buf + sizeof(address), serialised_dict_len);
-	memcpy(buf + header_size, serialised_dict, serialised_dict_len);
-	free(serialised_dict);
+	/* Build the header; the serialised dict follows it straight from
+	 * its own buffer. */
+	uint8_t header[16];
+	U64TO8_LE(header, address);
+	U64TO8_LE(header + sizeof(address), serialised_dict_len);
+	struct iovec iov[3];
+	iov[1].iov_base = header;
+	iov[1].iov_len = header_size;
+	iov[2].iov_base = serialised_dict;
+	iov[2].iov_len = serialised_dict_len;
 
 	/* Write it out, we're done. */
-	int ret = rotating_write(ctx, buf, buf_len, SPOOL_CONTENTS);
-	free(buf);
+	int ret = rotating_writev(ctx, iov, 3, SPOOL_CONTENTS);
+	free(serialised_dict);
+	if (ret != 0) {
+		forget_source(ctx, hash);
+	}
 	return ret;
 }
@@ -9,33 +9,229 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <glib.h>
 
 #define MARQUISE_SPOOL_DIR "/var/spool/marquise"
 #define MARQUISE_LOCK_DIR "/var/run/marquise"
 #define DISABLE_NAMESPACE_LOCK false
 #define MAX_SPOOL_FILE_SIZE 1024*1024
+#define MARQUISE_ROTATE_SIZE MAX_SPOOL_FILE_SIZE
+#define MARQUISE_ROTATE_AGE 10000
+#define MARQUISE_ROTATE_INTERVAL 0
+#define MARQUISE_WRITE_BUFFER_SIZE 64*1024
+#define MARQUISE_SPOOL_WRITER "write"
+#define MARQUISE_SPOOL_FORMAT "classic"
+#define MARQUISE_SPOOL_COMPRESSION "none"
+#define MARQUISE_SPOOL_BLOCK_SIZE 64*1024
+#define MARQUISE_IO_URING_DEPTH 8
+#define MARQUISE_IO_URING_SYNC false
+#define MARQUISE_DURABILITY "none"
+#define MARQUISE_GROUP_COMMIT_INTERVAL 0
+#define MARQUISE_ASYNC false
+#define MARQUISE_ASYNC_QUEUE_SIZE 1024*1024
+#define MARQUISE_ASYNC_FLUSH_INTERVAL 100
+#define MARQUISE_SOURCE_CACHE_MEMORY 16*1024*1024
+#define MARQUISE_SOURCE_CACHE_PERSIST true
+#define MARQUISE_SOURCE_WORKERS 4
+#define MARQUISE_TELEMETRY_INTERVAL 0
 
 #define SPOOL_POINTS   0
 #define SPOOL_CONTENTS 1
 
+#define SPOOL_WRITER_WRITE 0
+#define SPOOL_WRITER_MMAP  1
+#define SPOOL_WRITER_IO_URING 2
+
+#define DURABILITY_NONE   0
+#define DURABILITY_ROTATE 1
+#define DURABILITY_GROUP  2
+#define DURABILITY_FRAME  3
+
 #ifndef g_test_fail
 #define g_test_fail() g_assert(1==0)
 #endif
 
 typedef int spool_type;
 
+/* A spool file made ready to be rotated to, called name under tmp/.
+ * With the mmap writer, map is its preallocated mapping. fd is -1 if
+ * there is no such file. */
+typedef struct {
+	int      fd;
+	char     name[8];
+	uint8_t *map;
+} marquise_spool_segment;
+
+/* An open spool file and the frames buffered for it which have not yet
+ * been written out. With the mmap writer, map is the preallocated
+ * segment the frames are stored into instead. The file is called name,
+ * and lives under tmp/ in the spool type's directory dirfd (dir_path)
+ * until it is published to new/; tmp_path is its full path. deadline is
+ * when (monotonic) it is due to be rotated by age or interval,
+ * G_MAXINT64 if never. next is the file to rotate to. With block
+ * compression, block collects what is to be compressed next. */
+typedef struct {
+	int      dirfd;
+	char    *dir_path;
+	int      fd;
+	char     name[8];
+	char    *tmp_path;
+	gint64   deadline;
+	uint8_t *buf;
+	size_t   buf_used;
+	uint8_t *map;
+	size_t   map_used;
+	size_t   map_size;
+	uint8_t *block;
+	size_t   block_used;
+	marquise_spool_segment next;
+} marquise_spool_writer;
+
+/* Per-thread staging rings used in asynchronous mode, and the io_uring
+ * writer's state; private to the library. */
+struct marquise_staging;
+struct marquise_uring;
+struct marquise_source_cache;
+struct marquise_telemetry;
+struct compact_encoder;
+struct spool_codec;
+
+#define MARQUISE_STATS_LATENCY_BUCKETS 32
+
+/* Counters for the write path since marquise_init, from
+ * marquise_get_stats. Frames and bytes are counted as they're handed to
+ * the spool writer, so they include any still in its buffer. */
+typedef struct {
+	uint64_t frames_points;
+	uint64_t frames_contents;
+	uint64_t bytes_points;
+	uint64_t bytes_contents;
+	uint64_t rotations;	/* Spool files finished and replaced. */
+	uint64_t write_errors;	/* Failed writes to the spool files. */
+	uint64_t source_hits;	/* Source dict updates skipped as already sent. */
+	uint64_t source_misses;	/* Source dict updates written. */
+	/* How long each write of buffered frames to the kernel took:
+	 * write_latency[i] counts those taking from 2^(i-1) up to 2^i
+	 * nanoseconds, the last bucket everything slower. io_uring writes
+	 * are timed from submission to completion. */
+	uint64_t write_latency[MARQUISE_STATS_LATENCY_BUCKETS];
+} marquise_stats;
+
 typedef struct {
 	char *marquise_namespace;
+	/* Where the current segments will be published. */
 	char *spool_path_points;
 	char *spool_path_contents;
 	char *lock_path;
 	int   lock_fd;
 	size_t bytes_written_points;
 	size_t bytes_written_contents;
-	GTree *sd_hashes;
+	struct marquise_source_cache *sd_hashes;
+	marquise_spool_writer writer_points;
+	marquise_spool_writer writer_contents;
+	/* Rotation policy: size in bytes, age and interval in microseconds
+	 * (zero for off). The rotator thread makes the next spool files
+	 * ready and does any rotating by time; rotator_lock protects
+	 * rotator_stopping and rotator_wanted, which asks it for another
+	 * spool file. rotated (under write_lock) says one has been used up
+	 * since the rotator was last asked. segment_seq feeds the files'
+	 * names. */
+	size_t   rotate_size;
+	gint64   rotate_age;
+	gint64   rotate_interval;
+	GThread *rotator;
+	GMutex   rotator_lock;
+	GCond    rotator_cond;
+	bool     rotator_stopping;
+	bool     rotator_wanted;
+	bool     rotated;
+	uint64_t segment_seq;
+	size_t write_buf_size;
+	int    writer_mode;
+	/* Collects points for the compact spool format; NULL for classic. */
+	struct compact_encoder *compact;
+	/* Compresses blocks of block_size bytes; NULL for no compression. */
+	struct spool_codec *codec;
+	size_t block_size;
+	struct marquise_uring *uring;
+	/* One of DURABILITY_*. For group commit, write_seq counts writes
+	 * (under write_lock) and synced_seq how many of those are on disk;
+	 * sync_lock protects synced_seq, syncing and last_sync. */
+	int      durability;
+	gint64   commit_interval;
+	GMutex   sync_lock;
+	GCond    sync_cond;
+	uint64_t write_seq;
+	uint64_t synced_seq;
+	bool     syncing;
+	gint64   last_sync;
+	/* Whether contents spool files are synced as they are finished
+	 * even with DURABILITY_NONE, because a persisted source dict
+	 * cache vouches for what's in them. */
+	bool     contents_sync;
+	marquise_stats stats;
+	/* Threads hashing and serialising for marquise_update_sources_batch;
+	 * NULL if it's to be done by the caller alone. */
+	GThreadPool *source_pool;
+	guint  source_workers;
+	/* Sends the context's own statistics, if that's enabled. */
+	struct marquise_telemetry *telemetry;
+	/* write_lock serialises everything that touches the spool files,
+	 * cache_lock the source dict cache. In asynchronous mode,
+	 * queue_lock protects the list of staging rings and the flusher's
+	 * flags. */
+	GMutex   write_lock;
+	GMutex   cache_lock;
+	bool     async;
+	guint    id;
+	GThread *flusher;
+	GMutex   queue_lock;
+	GCond    queue_cond;
+	GCond    space_cond;
+	GCond    stopped_cond;
+	struct marquise_staging *stagings;
+	uint8_t *drain_buf;
+	size_t   queue_size;
+	gint64   flush_interval;
+	bool     flush_requested;
+	bool     stopping;
+	bool     stopped;
+	bool     aborting;
+	bool     abandoned;
 } marquise_ctx;
 
+/* A simple datapoint, for use with marquise_send_simple_batch. */
+typedef struct {
+	uint64_t address;
+	uint64_t timestamp;
+	uint64_t value;
+} marquise_point;
+
+/* An extended datapoint, for use with marquise_send_extended_batch. */
+typedef struct {
+	uint64_t address;
+	uint64_t timestamp;
+	char    *value;
+	size_t   value_len;
+} marquise_extended_point;
+
+/* Counters for the source dict cache, from marquise_source_cache_stats. */
+typedef struct {
+	uint64_t hits;		/* Updates skipped as already sent. */
+	uint64_t misses;	/* Updates written to the spool. */
+	uint64_t evictions;	/* Entries dropped to stay under the cap. */
+	size_t   entries;	/* Source dicts currently cached. */
+	size_t   limit;		/* Most entries the cache will hold. */
+} marquise_cache_stats;
+
+/* A source dict. Those made by marquise_new_source() or a builder keep
+ * the struct, the arrays, the strings and their lengths in a single
+ * allocation. Callers may still build their own from separately
+ * malloc()ed arrays and NUL-terminated strings, which
+ * marquise_free_source() frees piece by piece. */
 typedef struct {
 	char **fields;
 	char **values;
@@ -54,6 +250,26 @@ marquise_source *marquise_new_source(char **fields, char **values, size_t n_tags
 
 void marquise_free_source(marquise_source *source);
 
+/* Builds sources one tag at a time from strings of known length, such
+ * as slices of a larger buffer, which needn't be NUL-terminated. A
+ * builder can be reused for any number of sources, and keeps its
+ * memory between them. Not safe for use by more than one thread at a
+ * time. */
+typedef struct marquise_source_builder marquise_source_builder;
+
+/* Returns NULL on failure. */
+marquise_source_builder *marquise_source_builder_new(void);
+
+/* Append a tag. Returns zero on success, or -1 with errno set to EINVAL
+ * if field or value contains ',', ':' or a NUL byte. */
+int marquise_source_builder_add(marquise_source_builder *b, const char *field, size_t field_len, const char *value, size_t value_len);
+
+/* Return a new source made of the tags added since the builder was
+ * created or last finished, and start afresh. Returns NULL on error. */
+marquise_source *marquise_source_builder_finish(marquise_source_builder *b);
+
+void marquise_source_builder_free(marquise_source_builder *b);
+
 /* Return the SipHash-2-4[0] of an array of bytes, suitable to use as an
  * address. Note that only the 63 most significant bits of this address
  * are unique; the LSB is used as a flag for an extended datapoint. The
@@ -63,30 +279,321 @@ void marquise_free_source(marquise_source *source);
  */
 uint64_t marquise_hash_identifier(const unsigned char *id, size_t id_len);
 
-/* Initialize the marquise context. Namespace must be unique on the
- * current host, and alphanumeric. Returns NULL on failure.
+/* Hash n identifiers at once, storing the address of ids[i] (of length
+ * id_lens[i]) in addresses[i]. The results are exactly those of
+ * marquise_hash_identifier, but several identifiers are hashed in
+ * parallel using SSE2 or AVX2 where the CPU supports them. */
+void marquise_hash_identifiers_batch(const unsigned char *const *ids, const size_t *id_lens, size_t n, uint64_t *addresses);
+
+/* An identifier builder hashes many identifiers which share a prefix,
+ * such as "hostname:web123,metric:cpu,core:", without rehashing the
+ * prefix each time: the SipHash state after the prefix is kept and
+ * each suffix is hashed on from there. Results are exactly those of
+ * marquise_hash_identifier on prefix and suffix joined together.
+ *
+ * A builder may also remember the addresses of up to cache_size
+ * recently hashed suffixes (zero disables this); suffixes longer than
+ * 48 bytes aren't cached.
  *
- * marquise_init will open a file in the SPOOL_DIR directory; this will
- * default to "/var/spool/marquise", but can be overridden by the
- * MARQUISE_SPOOL_DIR environment variable.
+ * A builder must not be used by more than one thread at a time.
  */
+typedef struct marquise_id_builder marquise_id_builder;
+
+/* Returns NULL on failure. */
+marquise_id_builder *marquise_id_builder_new(const unsigned char *prefix, size_t prefix_len, size_t cache_size);
+
+/* A new builder for the prefix of parent followed by more, with a cache
+ * of the same size. Returns NULL on failure. */
+marquise_id_builder *marquise_id_builder_extend(const marquise_id_builder *parent, const unsigned char *more, size_t more_len);
+
+/* The address of the builder's prefix followed by suffix. */
+uint64_t marquise_id_builder_hash(marquise_id_builder *b, const unsigned char *suffix, size_t suffix_len);
+
+/* How many lookups the builder's cache has answered, and how many it
+ * couldn't. */
+void marquise_id_builder_stats(const marquise_id_builder *b, uint64_t *hits, uint64_t *misses);
+
+void marquise_id_builder_free(marquise_id_builder *b);
+
+/* Settings for a context, for marquise_init_opts. Fill one in with
+ * marquise_options_init, which takes each setting from the environment
+ * variable named beside it, or the default of that name if the variable
+ * is unset or can't be parsed, then change whatever you like. Sizes and
+ * intervals in the environment are decimal; flags are true unless they
+ * start with "0". Strings are only read by marquise_init_opts itself. */
+typedef struct {
+	/* MARQUISE_SPOOL_DIR. Spool files go under <spool_dir>/<namespace>. */
+	const char *spool_dir;
+	/* MARQUISE_LOCK_DIR. Where the namespace's lock file goes. */
+	const char *lock_dir;
+	/* DISABLE_NAMESPACE_LOCK. Don't lock the namespace; then nothing is
+	 * recovered from tmp/ and the source cache isn't persisted. */
+	bool disable_namespace_lock;
+
+	/* MARQUISE_ROTATE_SIZE, MARQUISE_ROTATE_AGE, MARQUISE_ROTATE_INTERVAL.
+	 * Each spool file is written under tmp/ and renamed into new/, where
+	 * the daemon looks for it, once it is finished. A file is finished
+	 * when it reaches rotate_size bytes, when it has been open for
+	 * rotate_age milliseconds, or at the next multiple of
+	 * rotate_interval milliseconds of wall clock time, whichever comes
+	 * first; zero turns off the last two. Files with nothing in them are
+	 * left alone until they have something. Both files are published by
+	 * marquise_shutdown. Files a process left in tmp/ when it died are
+	 * published by the next marquise_init for the namespace, less any
+	 * frame it was partway through. The file each is rotated to is made
+	 * ready ahead of time by a background thread, so rotating costs a
+	 * send little more than the rename. */
+	size_t rotate_size;
+	size_t rotate_age;
+	size_t rotate_interval;
+
+	/* MARQUISE_WRITE_BUFFER_SIZE. Frames are buffered in memory, this
+	 * many bytes per spool file, before being written to the spool. Zero
+	 * disables buffering. */
+	size_t write_buffer_size;
+
+	/* MARQUISE_SPOOL_WRITER. "write" writes the buffered frames out.
+	 *
+	 * "mmap" preallocates each spool file to rotate_size and maps it,
+	 * and frames are stored straight into the mapping. The file is
+	 * trimmed to the data written when it is rotated or the context is
+	 * shut down, so until then it carries zeroed space at the end.
+	 *
+	 * "io_uring" buffers frames as usual and submits each full buffer to
+	 * an io_uring, with up to io_uring_depth writes in flight. Where
+	 * io_uring is not available, the ordinary writer is used. */
+	const char *spool_writer;
+	/* MARQUISE_IO_URING_DEPTH. */
+	size_t io_uring_depth;
+	/* MARQUISE_IO_URING_SYNC. The same as durability "rotate", for the
+	 * io_uring writer; it predates durability. */
+	bool io_uring_sync;
+
+	/* MARQUISE_SPOOL_FORMAT. If "compact", the points spool is written
+	 * in the compact format instead of as classic frames: simple points
+	 * are collected into blocks of about 64KiB of frames, grouped by
+	 * address, and stored as deltas of deltas, which needs a daemon that
+	 * reads the format (or marquise_compact_decode). Extended points are
+	 * kept verbatim, in a block after the simple points collected with
+	 * them. The default is "classic". */
+	const char *spool_format;
+
+	/* MARQUISE_SPOOL_COMPRESSION, MARQUISE_SPOOL_BLOCK_SIZE. If "zlib",
+	 * "zstd" or "lz4", what goes to both spool files is cut into blocks
+	 * of spool_block_size bytes, and each block is compressed before it
+	 * is written. Blocks are also cut short by marquise_flush and on
+	 * rotation. Where libmarquise was built without the codec asked
+	 * for, the first of zlib, zstd and lz4 that it has is used instead;
+	 * with none of them, marquise_init fails with ENOTSUP. Such files
+	 * can be read back with marquise_block_reader_open. The default is
+	 * "none". */
+	const char *spool_compression;
+	size_t spool_block_size;
+
+	/* MARQUISE_DURABILITY, MARQUISE_GROUP_COMMIT_INTERVAL. When spool
+	 * files are fdatasync()ed: "none" leaves it to the kernel; "rotate"
+	 * syncs each file as it is rotated out; "group" also has every send
+	 * wait until its frames are synced, with each sync shared by
+	 * everyone waiting for it and started at most every
+	 * group_commit_interval milliseconds; "frame" syncs after every
+	 * send. All but "none" sync in marquise_flush too. In asynchronous
+	 * mode, "group" and "frame" sync the spool after the queues are
+	 * drained, at most every group_commit_interval milliseconds, and
+	 * nothing waits for it. */
+	const char *durability;
+	size_t group_commit_interval;
+
+	/* MARQUISE_ASYNC, MARQUISE_ASYNC_QUEUE_SIZE,
+	 * MARQUISE_ASYNC_FLUSH_INTERVAL. In asynchronous mode the send and
+	 * update functions only copy frames into a staging ring belonging to
+	 * the calling thread, of async_queue_size bytes per spool file,
+	 * without taking any lock. A background thread merges the rings into
+	 * the spool files once one is half full or async_flush_interval
+	 * milliseconds have passed, whichever comes first. Senders block
+	 * only if their ring is full. */
+	bool async;
+	size_t async_queue_size;
+	size_t async_flush_interval;
+
+	/* MARQUISE_SOURCE_CACHE_MEMORY. The most memory, in bytes, the cache
+	 * of source dicts already sent may use. */
+	size_t source_cache_memory;
+	/* MARQUISE_SOURCE_CACHE_PERSIST. Save the source dict cache at
+	 * shutdown and load it at init, so that a restart doesn't send
+	 * every source dict again. Contents spool files are then
+	 * fdatasync()ed as they are rotated out or published by
+	 * marquise_shutdown even with durability "none", so that the cache
+	 * never records a source dict the disk may not have. */
+	bool source_cache_persist;
+	/* MARQUISE_SOURCE_WORKERS. Threads hashing and serialising large
+	 * batches for marquise_update_sources_batch. */
+	size_t source_workers;
+
+	/* MARQUISE_TELEMETRY_INTERVAL. If set, every this many milliseconds
+	 * the context sends its own statistics as simple points into its
+	 * spool. */
+	size_t telemetry_interval;
+} marquise_options;
+
+/* Fill in opts from the environment and the defaults. */
+void marquise_options_init(marquise_options *opts);
+
+/* Set the option that the environment variable name sets, parsing value
+ * as marquise_options_init would. Returns zero on success, -1 with errno
+ * set to EINVAL if there is no such option or value can't be parsed.
+ * String options keep a pointer to value. */
+int marquise_options_set(marquise_options *opts, const char *name, const char *value);
+
+/* Initialize a marquise context with the settings in opts, or as
+ * marquise_options_init would set them if opts is NULL. Namespace must
+ * be unique on the current host, and alphanumeric. Returns NULL on
+ * failure (with errno set), EINVAL for settings that don't make sense.
+ *
+ * A context may be shared between threads.
+ */
+marquise_ctx *marquise_init_opts(char *marquise_namespace, const marquise_options *opts);
+
+/* marquise_init_opts with its settings all taken from the environment. */
 marquise_ctx *marquise_init(char *marquise_namespace);
 
 /* Queue a simple datapoint (i.e., a 64-bit word) to be sent by
  * the Marquise daemon. Returns zero on success and nonzero on
- * failure. */
+ * failure. Addresses 0 and 1 are reserved, and fail with EINVAL. */
 int marquise_send_simple(marquise_ctx *ctx, uint64_t address, uint64_t timestamp, uint64_t value);
 
 /* Queue an extended datapoint (i.e., a string) to be sent by the
  * Marquise daemon. Returns zero on success and nonzero on failure. */
 int marquise_send_extended(marquise_ctx *ctx, uint64_t address, uint64_t timestamp, char *value, size_t value_len);
 
+/* Queue an extended datapoint whose value is the concatenation of the
+ * iovcnt buffers in value_iov, without the caller having to join them
+ * first. iovcnt may be at most IOV_MAX - 2. Returns zero on success and
+ * nonzero on failure. */
+int marquise_send_extended_iov(marquise_ctx *ctx, uint64_t address, uint64_t timestamp, const struct iovec *value_iov, int iovcnt);
+
+/* Queue n simple datapoints. Equivalent to calling marquise_send_simple
+ * for each point in turn, but the batch is serialised in one go and
+ * written with a single write per spool file. Returns zero on success
+ * and nonzero on failure; nothing is sent if any point is for a
+ * reserved address. */
+int marquise_send_simple_batch(marquise_ctx *ctx, const marquise_point *pts, size_t n);
+
+/* Queue n extended datapoints, as marquise_send_simple_batch. The
+ * values are written directly from the caller's memory. */
+int marquise_send_extended_batch(marquise_ctx *ctx, const marquise_extended_point *pts, size_t n);
+
 /* Queue a Source (address metadata) for update. The caller is
  * responsible for freeing the source (using `marquise_free_source`).
- * Returns zero on success, nonzero on failure.
+ * Returns zero on success, nonzero on failure. As with simple points,
+ * addresses 0 and 1 are reserved, and fail with EINVAL.
  */
 int marquise_update_source(marquise_ctx *ctx, uint64_t address, marquise_source *source);
 
+/* Fill in stats with the source dict cache's counters since
+ * marquise_init. The cache holds at most MARQUISE_SOURCE_CACHE_MEMORY
+ * bytes of hashes (overridable by the environment variable of that
+ * name); past that, the least recently used source dicts are evicted
+ * and written again the next time they are updated. Unless
+ * MARQUISE_SOURCE_CACHE_PERSIST is disabled, the cache is kept in a file
+ * under the namespace's spool directory and reloaded by marquise_init,
+ * provided the last context for the namespace shut down cleanly. */
+void marquise_source_cache_stats(marquise_ctx *ctx, marquise_cache_stats *stats);
+
+/* Fill in out with the context's counters. This takes no locks, so it
+ * is cheap enough to call often, but the counters are read one at a time
+ * and may not all reflect the same instant. */
+void marquise_get_stats(marquise_ctx *ctx, marquise_stats *out);
+
+/* Decode the len bytes at buf, the contents of a points spool file in
+ * the compact format, back into classic frames. Within each block the
+ * simple points come first, grouped by address in the order they were
+ * sent, then the extended points. Returns a buffer of *out_len bytes,
+ * which the caller must free, or NULL with errno set: EINVAL if buf
+ * isn't a compact spool file this version can read or is damaged. */
+uint8_t *marquise_compact_decode(const uint8_t *buf, size_t len, size_t *out_len);
+
+/* Reads back a spool file written with MARQUISE_SPOOL_COMPRESSION, a
+ * block at a time. */
+typedef struct marquise_block_reader marquise_block_reader;
+
+/* Open the block-compressed spool file at path. Returns NULL on failure
+ * (with errno set): EINVAL if it isn't a block-compressed spool file,
+ * ENOTSUP if it uses a codec this build of libmarquise doesn't have. */
+marquise_block_reader *marquise_block_reader_open(const char *path);
+
+/* Read up to len bytes of the file's decompressed contents into buf,
+ * exactly as they would have been written without compression. Returns
+ * the number of bytes read, zero at the end of the file, or -1 on
+ * failure (with errno set), EINVAL if a block is damaged or cut short.
+ * Only one block is held in memory at a time. */
+ssize_t marquise_block_read(marquise_block_reader *r, void *buf, size_t len);
+
+/* Safe to call with NULL. */
+void marquise_block_reader_close(marquise_block_reader *r);
+
+/* A spool file opened for reading with marquise_spool_open. */
+typedef struct marquise_spool marquise_spool;
+
+/* A frame read from a spool file. For a simple point, value is the
+ * value; for an extended point, data is the value, len bytes long; for
+ * a source dict from the contents spool, data is the serialised dict
+ * ("k:v,k:v") and timestamp is zero. frame is the whole frame as it is
+ * in the file, frame_len bytes long. The pointers are into the
+ * marquise_spool and good until it is closed. */
+typedef struct {
+	uint64_t       address;
+	uint64_t       timestamp;
+	uint64_t       value;
+	bool           extended;
+	const uint8_t *data;
+	size_t         len;
+	const uint8_t *frame;
+	size_t         frame_len;
+} marquise_frame;
+
+/* Open the spool file at path, of spool type t (SPOOL_POINTS or
+ * SPOOL_CONTENTS), for reading with marquise_spool_next. A classic file
+ * is mapped, and its frames are read in place without being copied. A
+ * block-compressed or compact file is decoded into memory first.
+ * Returns NULL on failure (with errno set). */
+marquise_spool *marquise_spool_open(const char *path, spool_type t);
+
+/* Fill in frame with the next frame. Returns 1 if there was one, 0 at
+ * the end of the file, or -1 with errno set to EINVAL if the file ends
+ * partway through a frame, as one still being written may. The
+ * truncated frame starts at marquise_spool_offset and is returned
+ * again, complete, by a later call on a fresh marquise_spool once the
+ * rest is written. A run of zeroes where a frame should start ends the
+ * file: it is the unused tail of an mmap writer's segment. */
+int marquise_spool_next(marquise_spool *s, marquise_frame *frame);
+
+/* How many bytes of whole frames have been read. */
+size_t marquise_spool_offset(const marquise_spool *s);
+
+/* Unmap and free s. Safe to call with NULL. */
+void marquise_spool_close(marquise_spool *s);
+
+/* As marquise_update_source, for n sources at once: sources[i] is the
+ * source dict for addresses[i]. Sources already sent are skipped, the
+ * rest are written in one go. Large batches are hashed and serialised
+ * on up to MARQUISE_SOURCE_WORKERS threads. Returns zero on success, -1
+ * on failure (with errno set), in which case none of the batch's new
+ * sources are considered sent. */
+int marquise_update_sources_batch(marquise_ctx *ctx, const uint64_t *addresses, marquise_source **sources, size_t n);
+
+/* Write out any frames buffered or queued in the context to the spool
+ * files. Returns zero on success, -1 on failure (with errno set). */
+int marquise_flush(marquise_ctx *ctx);
+
 /* Clean up, flush, close and free. Zero on success, nonzero on
  * other things. */
 int marquise_shutdown(marquise_ctx *ctx);
+
+/* As marquise_shutdown, but in asynchronous mode give up on draining
+ * the queue after timeout_ms milliseconds. Frames still queued at that
+ * point are discarded and -1 is returned with errno set to ETIMEDOUT.
+ * The call returns by the deadline even if a write is stuck, say on a
+ * hung filesystem; the context is then closed and freed, and its
+ * namespace released, in the background once that write returns. The
+ * context must not be used again either way. */
+int marquise_shutdown_timeout(marquise_ctx *ctx, unsigned int timeout_ms);
@@ -0,0 +1,58 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+/* USDT probes for tracing the library in place, with perf or bpftrace:
+ *
+ *	bpftrace -e 'usdt:/usr/lib/libmarquise.so:libmarquise:rotate { @[arg0] = hist(arg2); }'
+ *
+ * Each compiles to a nop, behind a check of its semaphore, which a
+ * tracer sets while attached; so the arguments are only evaluated while
+ * someone is listening, and the probes stay in release builds. Anything
+ * costly worked out just for a probe goes behind PROBE_ENABLED(name) as
+ * well. Without sys/sdt.h (or with ./configure --disable-sdt) they
+ * vanish altogether. The probes, and their arguments:
+ *
+ *	rotating_write	spool type, frame length
+ *	spool_write	spool type, nanoseconds taken, zero or -1 for failure
+ *	rotate		spool type, bytes in the finished file, nanoseconds taken
+ *	spool_path	path of the new spool file, its descriptor
+ *	source_hit	address
+ *	source_miss	address, serialised length
+ *
+ * Every probe needs its semaphore declared here and defined once, with
+ * PROBE_SEMAPHORE, in marquise.c.
+ */
+
+#ifdef HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define PROBE_SEMAPHORE(name) \
+	__extension__ unsigned short libmarquise_##name##_semaphore \
+	__attribute__((unused)) __attribute__((section(".probes")))
+#define PROBE_ENABLED(name)	__builtin_expect(libmarquise_##name##_semaphore, 0)
+#define PROBE1(name, a) \
+	do { if (PROBE_ENABLED(name)) { DTRACE_PROBE1(libmarquise, name, a); } } while (0)
+#define PROBE2(name, a, b) \
+	do { if (PROBE_ENABLED(name)) { DTRACE_PROBE2(libmarquise, name, a, b); } } while (0)
+#define PROBE3(name, a, b, c) \
+	do { if (PROBE_ENABLED(name)) { DTRACE_PROBE3(libmarquise, name, a, b, c); } } while (0)
+
+extern unsigned short libmarquise_rotating_write_semaphore;
+extern unsigned short libmarquise_spool_write_semaphore;
+extern unsigned short libmarquise_rotate_semaphore;
+extern unsigned short libmarquise_spool_path_semaphore;
+extern unsigned short libmarquise_source_hit_semaphore;
+extern unsigned short libmarquise_source_miss_semaphore;
+#else
+/* The arguments are still checked, but never evaluated. */
+#define PROBE_ENABLED(name)	0
+#define PROBE1(name, a)		do { if (0) { (void)(a); } } while (0)
+#define PROBE2(name, a, b)	do { if (0) { (void)(a); (void)(b); } } while (0)
+#define PROBE3(name, a, b, c)	do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#endif
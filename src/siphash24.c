@@ -14,6 +14,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "siphash24.h"
 typedef uint64_t u64;
 typedef uint32_t u32;
 typedef uint8_t u8;
@@ -132,3 +133,77 @@ uint64_t siphash(const unsigned char *in, unsigned long long inlen, const unsign
   return b;
 }
 
+
+/* The incremental interface. The state is the four words of the
+ * reference code above, plus the partial word it would pick up in its
+ * final switch. */
+void siphash_init( siphash_state *s, const unsigned char *k )
+{
+  u64 k0 = U8TO64_LE( k );
+  u64 k1 = U8TO64_LE( k + 8 );
+  s->v0 = 0x736f6d6570736575ULL ^ k0;
+  s->v1 = 0x646f72616e646f6dULL ^ k1;
+  s->v2 = 0x6c7967656e657261ULL ^ k0;
+  s->v3 = 0x7465646279746573ULL ^ k1;
+  s->tail = 0;
+  s->inlen = 0;
+}
+
+#define SIPCOMPRESS(m)      \
+  do {              \
+    v3 ^= (m);            \
+    for( i=0; i<cROUNDS; ++i ) SIPROUND;  \
+    v0 ^= (m);            \
+  } while(0)
+
+void siphash_update( siphash_state *s, const unsigned char *in, size_t inlen )
+{
+  u64 v0 = s->v0, v1 = s->v1, v2 = s->v2, v3 = s->v3;
+  u64 tail = s->tail;
+  int used = s->inlen & 7;
+  int i;
+  s->inlen += inlen;
+
+  /* Top up the partial word first. */
+  if ( used > 0 )
+  {
+    while ( used < 8 && inlen > 0 )
+    {
+      tail |= ( ( u64 )*in++ ) << ( 8 * used++ );
+      inlen--;
+    }
+    if ( used < 8 )
+    {
+      s->tail = tail;
+      return;
+    }
+    SIPCOMPRESS( tail );
+    tail = 0;
+  }
+
+  for ( ; inlen >= 8; in += 8, inlen -= 8 )
+  {
+    u64 m = U8TO64_LE( in );
+    SIPCOMPRESS( m );
+  }
+
+  for ( used = 0; inlen > 0; inlen-- )
+    tail |= ( ( u64 )*in++ ) << ( 8 * used++ );
+
+  s->v0 = v0; s->v1 = v1; s->v2 = v2; s->v3 = v3;
+  s->tail = tail;
+}
+
+uint64_t siphash_final( siphash_state *s )
+{
+  u64 v0 = s->v0, v1 = s->v1, v2 = s->v2, v3 = s->v3;
+  u64 b = ( ( u64 )s->inlen ) << 56 | s->tail;
+  int i;
+
+  SIPCOMPRESS( b );
+  v2 ^= 0xff;
+
+  for( i=0; i<dROUNDS; ++i ) SIPROUND;
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
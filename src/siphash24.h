@@ -13,5 +13,35 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 uint64_t siphash(const unsigned char *in, unsigned long long inlen, const unsigned char *k );
+
+/* Incremental SipHash-2-4: feeding a message through siphash_update in
+ * any number of pieces gives the same result as siphash() on the whole
+ * thing. */
+typedef struct
+{
+  uint64_t v0, v1, v2, v3;
+  uint64_t tail;    /* Bytes not yet making up a whole word. */
+  uint64_t inlen;   /* Total bytes so far. */
+} siphash_state;
+
+void siphash_init( siphash_state *s, const unsigned char *k );
+void siphash_update( siphash_state *s, const unsigned char *in, size_t inlen );
+uint64_t siphash_final( siphash_state *s );
+
+/* Hash n messages at once: out[i] = siphash( in[i], inlen[i], k ).
+ * Uses the widest SIMD lanes the CPU supports, chosen at runtime. */
+void siphash_batch( const unsigned char *const *in, const size_t *inlen, size_t n,
+                    const unsigned char *k, uint64_t *out );
+
+/* The individual implementations behind siphash_batch. */
+void siphash_batch_scalar( const unsigned char *const *in, const size_t *inlen, size_t n,
+                           const unsigned char *k, uint64_t *out );
+#if defined(__x86_64__) || defined(__i386__)
+void siphash_batch_sse2( const unsigned char *const *in, const size_t *inlen, size_t n,
+                         const unsigned char *k, uint64_t *out );
+void siphash_batch_avx2( const unsigned char *const *in, const size_t *inlen, size_t n,
+                         const unsigned char *k, uint64_t *out );
+#endif
@@ -0,0 +1,300 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+/* SipHash-2-4 over many messages at once, with the messages spread
+ * across the 64-bit lanes of SSE2 (two lanes) or AVX2 (four lanes)
+ * registers. Each lane computes exactly what siphash() would.
+ *
+ * Messages of different lengths run for different numbers of
+ * compression rounds; a lane that has already taken in its final block
+ * keeps its state unchanged while the others carry on, and all lanes
+ * are finalised together.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "siphash24.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIPHASH_HAVE_X86 1
+#endif
+
+typedef uint64_t u64;
+
+#define V0_INIT 0x736f6d6570736575ULL
+#define V1_INIT 0x646f72616e646f6dULL
+#define V2_INIT 0x6c7967656e657261ULL
+#define V3_INIT 0x7465646279746573ULL
+
+static u64 load_le64(const unsigned char *p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	u64 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+#else
+	u64 v = 0;
+	int i;
+	for (i = 7; i >= 0; i--) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+#endif
+}
+
+/* The final block of a message: its length in the top byte, and the
+ * bytes after the last whole word. */
+static u64 final_block(const unsigned char *in, size_t inlen)
+{
+	u64 b = ((u64)inlen) << 56;
+	size_t whole = inlen & ~(size_t)7;
+	size_t i;
+	for (i = whole; i < inlen; i++) {
+		b |= ((u64)in[i]) << (8 * (i - whole));
+	}
+	return b;
+}
+
+/* The message word for block j of a message, and whether the lane is
+ * still taking in input at that block. */
+static u64 block_word(const unsigned char *in, size_t inlen, size_t j, u64 *active)
+{
+	size_t words = inlen / 8;
+	*active = ~(u64)0;
+	if (j < words) {
+		return load_le64(in + 8 * j);
+	}
+	if (j == words) {
+		return final_block(in, inlen);
+	}
+	*active = 0;
+	return 0;
+}
+
+void siphash_batch_scalar(const unsigned char *const *in, const size_t *inlen, size_t n,
+                          const unsigned char *k, uint64_t *out)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		out[i] = siphash(in[i], inlen[i], k);
+	}
+}
+
+#ifdef SIPHASH_HAVE_X86
+
+#define SSE_ROTL(x, b) _mm_or_si128(_mm_slli_epi64((x), (b)), _mm_srli_epi64((x), 64 - (b)))
+#define SSE_ROTL32(x)  _mm_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define SSE_SIPROUND                                                        \
+	do {                                                                \
+		v0 = _mm_add_epi64(v0, v1); v1 = SSE_ROTL(v1, 13);          \
+		v1 = _mm_xor_si128(v1, v0); v0 = SSE_ROTL32(v0);            \
+		v2 = _mm_add_epi64(v2, v3); v3 = SSE_ROTL(v3, 16);          \
+		v3 = _mm_xor_si128(v3, v2);                                 \
+		v0 = _mm_add_epi64(v0, v3); v3 = SSE_ROTL(v3, 21);          \
+		v3 = _mm_xor_si128(v3, v0);                                 \
+		v2 = _mm_add_epi64(v2, v1); v1 = SSE_ROTL(v1, 17);          \
+		v1 = _mm_xor_si128(v1, v2); v2 = SSE_ROTL32(v2);            \
+	} while (0)
+/* Keep new where mask is set, old elsewhere. */
+#define SSE_SELECT(mask, new, old) \
+	_mm_or_si128(_mm_and_si128((mask), (new)), _mm_andnot_si128((mask), (old)))
+
+__attribute__((target("sse2")))
+static void siphash_x2(const unsigned char *const *in, const size_t *inlen, size_t lanes,
+                       u64 k0, u64 k1, uint64_t *out)
+{
+	__m128i v0 = _mm_set1_epi64x(V0_INIT ^ k0);
+	__m128i v1 = _mm_set1_epi64x(V1_INIT ^ k1);
+	__m128i v2 = _mm_set1_epi64x(V2_INIT ^ k0);
+	__m128i v3 = _mm_set1_epi64x(V3_INIT ^ k1);
+	size_t blocks = 0;
+	size_t common = (lanes == 2) ? SIZE_MAX : 0;
+	size_t l;
+	for (l = 0; l < lanes; l++) {
+		if (inlen[l] / 8 + 1 > blocks) {
+			blocks = inlen[l] / 8 + 1;
+		}
+		if (inlen[l] / 8 < common) {
+			common = inlen[l] / 8;
+		}
+	}
+
+	/* While every lane still has whole words to take in, no lane needs
+	 * masking. */
+	size_t j;
+	for (j = 0; j < common; j++) {
+		__m128i mv = _mm_set_epi64x(load_le64(in[1] + 8 * j), load_le64(in[0] + 8 * j));
+		v3 = _mm_xor_si128(v3, mv);
+		SSE_SIPROUND;
+		SSE_SIPROUND;
+		v0 = _mm_xor_si128(v0, mv);
+	}
+	for (; j < blocks; j++) {
+		u64 m[2] = { 0, 0 };
+		u64 active[2] = { 0, 0 };
+		for (l = 0; l < lanes; l++) {
+			m[l] = block_word(in[l], inlen[l], j, &active[l]);
+		}
+		__m128i mv = _mm_loadu_si128((const __m128i *)m);
+		__m128i av = _mm_loadu_si128((const __m128i *)active);
+		__m128i o0 = v0, o1 = v1, o2 = v2, o3 = v3;
+		v3 = _mm_xor_si128(v3, mv);
+		SSE_SIPROUND;
+		SSE_SIPROUND;
+		v0 = _mm_xor_si128(v0, mv);
+		v0 = SSE_SELECT(av, v0, o0);
+		v1 = SSE_SELECT(av, v1, o1);
+		v2 = SSE_SELECT(av, v2, o2);
+		v3 = SSE_SELECT(av, v3, o3);
+	}
+
+	v2 = _mm_xor_si128(v2, _mm_set1_epi64x(0xff));
+	SSE_SIPROUND;
+	SSE_SIPROUND;
+	SSE_SIPROUND;
+	SSE_SIPROUND;
+	u64 r[2];
+	_mm_storeu_si128((__m128i *)r, _mm_xor_si128(_mm_xor_si128(v0, v1), _mm_xor_si128(v2, v3)));
+	memcpy(out, r, lanes * sizeof(u64));
+}
+
+__attribute__((target("sse2")))
+void siphash_batch_sse2(const unsigned char *const *in, const size_t *inlen, size_t n,
+                        const unsigned char *k, uint64_t *out)
+{
+	u64 k0 = load_le64(k);
+	u64 k1 = load_le64(k + 8);
+	size_t i;
+	for (i = 0; i < n; i += 2) {
+		siphash_x2(in + i, inlen + i, n - i < 2 ? n - i : 2, k0, k1, out + i);
+	}
+}
+
+#define AVX_ROTL(x, b) _mm256_or_si256(_mm256_slli_epi64((x), (b)), _mm256_srli_epi64((x), 64 - (b)))
+#define AVX_ROTL32(x)  _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+/* A rotation by whole bytes is a single byte shuffle. */
+#define AVX_ROTL16(x)  _mm256_shuffle_epi8((x), rot16)
+#define AVX_SIPROUND                                                        \
+	do {                                                                \
+		v0 = _mm256_add_epi64(v0, v1); v1 = AVX_ROTL(v1, 13);       \
+		v1 = _mm256_xor_si256(v1, v0); v0 = AVX_ROTL32(v0);         \
+		v2 = _mm256_add_epi64(v2, v3); v3 = AVX_ROTL16(v3);            \
+		v3 = _mm256_xor_si256(v3, v2);                              \
+		v0 = _mm256_add_epi64(v0, v3); v3 = AVX_ROTL(v3, 21);       \
+		v3 = _mm256_xor_si256(v3, v0);                              \
+		v2 = _mm256_add_epi64(v2, v1); v1 = AVX_ROTL(v1, 17);       \
+		v1 = _mm256_xor_si256(v1, v2); v2 = AVX_ROTL32(v2);         \
+	} while (0)
+
+__attribute__((target("avx2")))
+static void siphash_x4(const unsigned char *const *in, const size_t *inlen, size_t lanes,
+                       u64 k0, u64 k1, uint64_t *out)
+{
+	const __m256i rot16 = _mm256_set_epi8(13, 12, 11, 10, 9, 8, 15, 14, 5, 4, 3, 2, 1, 0, 7, 6,
+	                                      13, 12, 11, 10, 9, 8, 15, 14, 5, 4, 3, 2, 1, 0, 7, 6);
+	__m256i v0 = _mm256_set1_epi64x(V0_INIT ^ k0);
+	__m256i v1 = _mm256_set1_epi64x(V1_INIT ^ k1);
+	__m256i v2 = _mm256_set1_epi64x(V2_INIT ^ k0);
+	__m256i v3 = _mm256_set1_epi64x(V3_INIT ^ k1);
+	size_t blocks = 0;
+	size_t common = (lanes == 4) ? SIZE_MAX : 0;
+	size_t l;
+	for (l = 0; l < lanes; l++) {
+		if (inlen[l] / 8 + 1 > blocks) {
+			blocks = inlen[l] / 8 + 1;
+		}
+		if (inlen[l] / 8 < common) {
+			common = inlen[l] / 8;
+		}
+	}
+
+	/* While every lane still has whole words to take in, no lane needs
+	 * masking. */
+	size_t j;
+	for (j = 0; j < common; j++) {
+		__m256i mv = _mm256_set_epi64x(load_le64(in[3] + 8 * j), load_le64(in[2] + 8 * j),
+		                               load_le64(in[1] + 8 * j), load_le64(in[0] + 8 * j));
+		v3 = _mm256_xor_si256(v3, mv);
+		AVX_SIPROUND;
+		AVX_SIPROUND;
+		v0 = _mm256_xor_si256(v0, mv);
+	}
+	for (; j < blocks; j++) {
+		u64 m[4] = { 0, 0, 0, 0 };
+		u64 active[4] = { 0, 0, 0, 0 };
+		for (l = 0; l < lanes; l++) {
+			m[l] = block_word(in[l], inlen[l], j, &active[l]);
+		}
+		__m256i mv = _mm256_loadu_si256((const __m256i *)m);
+		__m256i av = _mm256_loadu_si256((const __m256i *)active);
+		__m256i o0 = v0, o1 = v1, o2 = v2, o3 = v3;
+		v3 = _mm256_xor_si256(v3, mv);
+		AVX_SIPROUND;
+		AVX_SIPROUND;
+		v0 = _mm256_xor_si256(v0, mv);
+		v0 = _mm256_blendv_epi8(o0, v0, av);
+		v1 = _mm256_blendv_epi8(o1, v1, av);
+		v2 = _mm256_blendv_epi8(o2, v2, av);
+		v3 = _mm256_blendv_epi8(o3, v3, av);
+	}
+
+	v2 = _mm256_xor_si256(v2, _mm256_set1_epi64x(0xff));
+	AVX_SIPROUND;
+	AVX_SIPROUND;
+	AVX_SIPROUND;
+	AVX_SIPROUND;
+	u64 r[4];
+	_mm256_storeu_si256((__m256i *)r, _mm256_xor_si256(_mm256_xor_si256(v0, v1), _mm256_xor_si256(v2, v3)));
+	memcpy(out, r, lanes * sizeof(u64));
+}
+
+__attribute__((target("avx2")))
+void siphash_batch_avx2(const unsigned char *const *in, const size_t *inlen, size_t n,
+                        const unsigned char *k, uint64_t *out)
+{
+	u64 k0 = load_le64(k);
+	u64 k1 = load_le64(k + 8);
+	size_t i;
+	for (i = 0; i < n; i += 4) {
+		siphash_x4(in + i, inlen + i, n - i < 4 ? n - i : 4, k0, k1, out + i);
+	}
+}
+
+#endif
+
+typedef void (*siphash_batch_fn)(const unsigned char *const *, const size_t *, size_t,
+                                 const unsigned char *, uint64_t *);
+
+/* Pick the widest implementation this CPU runs. Racing threads all
+ * arrive at the same answer, so the result is stored without a lock. */
+static siphash_batch_fn select_batch(void)
+{
+#ifdef SIPHASH_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return siphash_batch_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return siphash_batch_sse2;
+	}
+#endif
+	return siphash_batch_scalar;
+}
+
+void siphash_batch(const unsigned char *const *in, const size_t *inlen, size_t n,
+                   const unsigned char *k, uint64_t *out)
+{
+	static siphash_batch_fn batch_fn = NULL;
+	siphash_batch_fn fn = __atomic_load_n(&batch_fn, __ATOMIC_RELAXED);
+	if (fn == NULL) {
+		fn = select_batch();
+		__atomic_store_n(&batch_fn, fn, __ATOMIC_RELAXED);
+	}
+	fn(in, inlen, n, k, out);
+}
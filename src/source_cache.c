@@ -0,0 +1,485 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "source_cache.h"
+#include "siphash24.h"
+
+#define SOURCE_CACHE_MAGIC "MQSDCACH"
+/* Written in native byte order, so a file from a host of the other
+ * endianness reads back wrong and is discarded. */
+#define SOURCE_CACHE_BYTE_ORDER 0x01020304
+
+/* The start of the cache file. The slots follow it, then the
+ * reference bytes. */
+struct source_cache_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t capacity;
+	uint64_t count;
+	uint64_t hand;
+	uint32_t has_zero;
+	uint32_t clean;		/* Set by source_cache_persist(). */
+	uint64_t checksum;	/* SipHash of the slots and reference bytes. */
+	uint64_t reserved;
+};
+
+/* Grow, or evict, once the table is three quarters full. */
+#define SOURCE_CACHE_MIN_SLOTS 16
+#define source_cache_full(count, capacity) ((count) + 1 > (capacity) / 4 * 3)
+
+/* The counters only change with the cache locked, but marquise_get_stats()
+ * reads them without taking the lock, so each store is atomic. */
+#define bump(counter) __atomic_store_n(&(counter), (counter) + 1, __ATOMIC_RELAXED)
+
+/* Source dict hashes are SipHash output, so the low bits are already
+ * well distributed and can index the table directly. */
+static size_t home_slot(size_t capacity, uint64_t hash)
+{
+	return hash & (capacity - 1);
+}
+
+static size_t probe(const uint64_t *slots, size_t capacity, uint64_t hash)
+{
+	size_t mask = capacity - 1;
+	size_t i = home_slot(capacity, hash);
+	while (slots[i] != 0 && slots[i] != hash) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+struct marquise_source_cache *source_cache_new(size_t capacity, size_t max_bytes)
+{
+	struct marquise_source_cache *c = malloc(sizeof(struct marquise_source_cache));
+	if (c == NULL) {
+		return NULL;
+	}
+	size_t max_slots = SOURCE_CACHE_MIN_SLOTS;
+	while (max_slots <= SIZE_MAX / SOURCE_CACHE_SLOT_BYTES / 2 &&
+	       max_slots * 2 * SOURCE_CACHE_SLOT_BYTES <= max_bytes) {
+		max_slots *= 2;
+	}
+	size_t slots = SOURCE_CACHE_MIN_SLOTS;
+	while (slots < max_slots && source_cache_full(capacity, slots)) {
+		slots *= 2;
+	}
+	c->slots = calloc(slots, sizeof(uint64_t));
+	c->refs = calloc(slots, 1);
+	if (c->slots == NULL || c->refs == NULL) {
+		free(c->slots);
+		free(c->refs);
+		free(c);
+		return NULL;
+	}
+	c->capacity = slots;
+	c->max_slots = max_slots;
+	c->count = 0;
+	c->hand = 0;
+	c->has_zero = false;
+	c->hits = 0;
+	c->misses = 0;
+	c->evictions = 0;
+	c->path = NULL;
+	c->fd = -1;
+	c->map = NULL;
+	c->map_len = 0;
+	return c;
+}
+
+size_t source_cache_limit(const struct marquise_source_cache *c)
+{
+	return c->max_slots / 4 * 3;
+}
+
+bool source_cache_contains(const struct marquise_source_cache *c, uint64_t hash)
+{
+	if (hash == 0) {
+		return c->has_zero;
+	}
+	return c->slots[probe(c->slots, c->capacity, hash)] == hash;
+}
+
+/* A table of slots and reference bytes, either on the heap or in a
+ * mapped file. */
+struct table {
+	uint64_t *slots;
+	uint8_t  *refs;
+	int       fd;
+	struct source_cache_header *map;
+	size_t    map_len;
+};
+
+static void free_table(struct table *t)
+{
+	if (t->map != NULL) {
+		munmap(t->map, t->map_len);
+		close(t->fd);
+	} else {
+		free(t->slots);
+		free(t->refs);
+	}
+}
+
+/* Map a new, empty table of capacity slots in a file next to path,
+ * which install_table() renames over it. */
+static int new_file_table(const char *path, size_t capacity, struct table *t)
+{
+	size_t path_len = strlen(path);
+	char tmp_path[path_len + 5];
+	memcpy(tmp_path, path, path_len);
+	memcpy(tmp_path + path_len, ".tmp", 5);
+
+	if (capacity > (SIZE_MAX - sizeof(struct source_cache_header)) / SOURCE_CACHE_SLOT_BYTES) {
+		errno = ENOMEM;
+		return -1;
+	}
+	t->map_len = sizeof(struct source_cache_header) + capacity * SOURCE_CACHE_SLOT_BYTES;
+	t->fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (t->fd < 0) {
+		return -1;
+	}
+	if (ftruncate(t->fd, t->map_len) != 0) {
+		close(t->fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	t->map = mmap(NULL, t->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if (t->map == MAP_FAILED) {
+		t->map = NULL;
+		close(t->fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	if (rename(tmp_path, path) != 0) {
+		munmap(t->map, t->map_len);
+		t->map = NULL;
+		close(t->fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	memcpy(t->map->magic, SOURCE_CACHE_MAGIC, sizeof(t->map->magic));
+	t->map->version = SOURCE_CACHE_FILE_VERSION;
+	t->map->byte_order = SOURCE_CACHE_BYTE_ORDER;
+	t->map->capacity = capacity;
+	t->map->clean = 0;
+	t->slots = (uint64_t *)(t->map + 1);
+	t->refs = (uint8_t *)(t->slots + capacity);
+	return 0;
+}
+
+/* Allocate an empty table for c with capacity slots, in c's file if it
+ * has one. If the file can't be replaced, c stops being backed by it;
+ * whatever is left there isn't marked clean, so it won't be loaded. */
+static int new_table(struct marquise_source_cache *c, size_t capacity, struct table *t)
+{
+	if (c->path != NULL) {
+		if (new_file_table(c->path, capacity, t) == 0) {
+			return 0;
+		}
+		free(c->path);
+		c->path = NULL;
+	}
+	t->map = NULL;
+	t->map_len = 0;
+	t->fd = -1;
+	t->slots = calloc(capacity, sizeof(uint64_t));
+	t->refs = calloc(capacity, 1);
+	if (t->slots == NULL || t->refs == NULL) {
+		free(t->slots);
+		free(t->refs);
+		return -1;
+	}
+	return 0;
+}
+
+/* Replace c's table with t, freeing the old one. */
+static void install_table(struct marquise_source_cache *c, struct table *t, size_t capacity)
+{
+	struct table old = { c->slots, c->refs, c->fd, c->map, c->map_len };
+	free_table(&old);
+	c->slots = t->slots;
+	c->refs = t->refs;
+	c->fd = t->fd;
+	c->map = t->map;
+	c->map_len = t->map_len;
+	c->capacity = capacity;
+}
+
+static int grow(struct marquise_source_cache *c)
+{
+	size_t capacity = c->capacity * 2;
+	struct table t;
+	if (new_table(c, capacity, &t) != 0) {
+		return -1;
+	}
+	size_t i;
+	for (i = 0; i < c->capacity; i++) {
+		if (c->slots[i] != 0) {
+			size_t j = probe(t.slots, capacity, c->slots[i]);
+			t.slots[j] = c->slots[i];
+			t.refs[j] = c->refs[i];
+		}
+	}
+	install_table(c, &t, capacity);
+	c->hand = 0;
+	return 0;
+}
+
+/* Empty slot i, then close the gap by shifting back any later entries
+ * in the run which would otherwise become unreachable. */
+static void remove_slot(struct marquise_source_cache *c, size_t i)
+{
+	size_t mask = c->capacity - 1;
+	size_t j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (c->slots[j] == 0) {
+			break;
+		}
+		/* The entry at j may move to i only if its home slot isn't
+		 * cyclically within (i, j]. */
+		size_t home = home_slot(c->capacity, c->slots[j]);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			c->slots[i] = c->slots[j];
+			c->refs[i] = c->refs[j];
+			i = j;
+		}
+	}
+	c->slots[i] = 0;
+	c->refs[i] = 0;
+	c->count--;
+}
+
+/* Sweep the hand round, giving each referenced entry a second chance,
+ * and evict the first one which hasn't been looked up since the hand
+ * last passed it. */
+static void evict(struct marquise_source_cache *c)
+{
+	size_t mask = c->capacity - 1;
+	for (;;) {
+		size_t i = c->hand;
+		if (c->slots[i] != 0) {
+			if (c->refs[i] == 0) {
+				/* Leave the hand here: whatever shifts back
+				 * into the slot hasn't been looked at yet. */
+				remove_slot(c, i);
+				bump(c->evictions);
+				return;
+			}
+			c->refs[i] = 0;
+		}
+		c->hand = (i + 1) & mask;
+	}
+}
+
+int source_cache_insert(struct marquise_source_cache *c, uint64_t hash)
+{
+	if (hash == 0) {
+		if (c->has_zero) {
+			bump(c->hits);
+			return 0;
+		}
+		bump(c->misses);
+		c->has_zero = true;
+		return 1;
+	}
+	size_t i = probe(c->slots, c->capacity, hash);
+	if (c->slots[i] == hash) {
+		bump(c->hits);
+		c->refs[i] = 1;
+		return 0;
+	}
+	bump(c->misses);
+	if (source_cache_full(c->count, c->capacity)) {
+		if (c->capacity < c->max_slots) {
+			if (grow(c) != 0) {
+				return -1;
+			}
+		} else {
+			evict(c);
+		}
+		i = probe(c->slots, c->capacity, hash);
+	}
+	c->slots[i] = hash;
+	c->refs[i] = 1;
+	c->count++;
+	return 1;
+}
+
+void source_cache_remove(struct marquise_source_cache *c, uint64_t hash)
+{
+	if (hash == 0) {
+		c->has_zero = false;
+		return;
+	}
+	size_t i = probe(c->slots, c->capacity, hash);
+	if (c->slots[i] == hash) {
+		remove_slot(c, i);
+	}
+}
+
+static uint64_t table_checksum(const uint64_t *slots, size_t capacity)
+{
+	unsigned char key[16];
+	memset(key, 0, 16);
+	return siphash((const unsigned char *)slots, capacity * SOURCE_CACHE_SLOT_BYTES, key);
+}
+
+/* Check that the mapped file at map is one we wrote and persisted, and
+ * that its table is intact. */
+static bool valid_file(const struct source_cache_header *map, size_t map_len)
+{
+	if (map_len < sizeof(struct source_cache_header) ||
+	    memcmp(map->magic, SOURCE_CACHE_MAGIC, sizeof(map->magic)) != 0 ||
+	    map->version != SOURCE_CACHE_FILE_VERSION ||
+	    map->byte_order != SOURCE_CACHE_BYTE_ORDER ||
+	    map->clean != 1) {
+		return false;
+	}
+	size_t capacity = map->capacity;
+	if (capacity < SOURCE_CACHE_MIN_SLOTS || (capacity & (capacity - 1)) != 0 ||
+	    capacity > (map_len - sizeof(struct source_cache_header)) / SOURCE_CACHE_SLOT_BYTES ||
+	    map_len != sizeof(struct source_cache_header) + capacity * SOURCE_CACHE_SLOT_BYTES ||
+	    map->hand >= capacity || map->count >= capacity || map->has_zero > 1) {
+		return false;
+	}
+	const uint64_t *slots = (const uint64_t *)(map + 1);
+	if (table_checksum(slots, capacity) != map->checksum) {
+		return false;
+	}
+	/* Every hash must be where a lookup would find it. */
+	size_t count = 0;
+	size_t i;
+	for (i = 0; i < capacity; i++) {
+		if (slots[i] != 0) {
+			if (probe(slots, capacity, slots[i]) != i) {
+				return false;
+			}
+			count++;
+		}
+	}
+	return count == map->count;
+}
+
+/* Load the file at c->path into the empty cache c, adopting the mapping
+ * if its table fits within c->max_slots or copying the hashes out of it
+ * if not. Returns zero on success, -1 if there is nothing usable. */
+static int load_file(struct marquise_source_cache *c)
+{
+	int fd = open(c->path, O_RDWR);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct source_cache_header)) {
+		close(fd);
+		return -1;
+	}
+	size_t map_len = st.st_size;
+	struct source_cache_header *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	if (!valid_file(map, map_len)) {
+		fprintf(stderr, "source_cache: discarding %s, it is corrupt or was not closed cleanly\n", c->path);
+		munmap(map, map_len);
+		close(fd);
+		return -1;
+	}
+
+	size_t capacity = map->capacity;
+	uint64_t *slots = (uint64_t *)(map + 1);
+	if (capacity <= c->max_slots) {
+		struct table t = { slots, (uint8_t *)(slots + capacity), fd, map, map_len };
+		install_table(c, &t, capacity);
+		c->count = map->count;
+		c->hand = map->hand;
+		c->has_zero = map->has_zero;
+	} else {
+		/* The cache has been made smaller since this was written;
+		 * keep as much of it as fits. */
+		size_t i;
+		for (i = 0; i < capacity; i++) {
+			if (slots[i] != 0 && source_cache_insert(c, slots[i]) < 0) {
+				break;
+			}
+		}
+		if (map->has_zero) {
+			source_cache_insert(c, 0);
+		}
+		munmap(map, map_len);
+		close(fd);
+	}
+	return 0;
+}
+
+struct marquise_source_cache *source_cache_open(const char *path, size_t capacity, size_t max_bytes)
+{
+	struct marquise_source_cache *c = source_cache_new(capacity, max_bytes);
+	if (c == NULL) {
+		return NULL;
+	}
+	c->path = strdup(path);
+	if (c->path == NULL) {
+		return c;
+	}
+	/* Nothing inserted from here on has been written anywhere yet;
+	 * until source_cache_persist() says otherwise the file mustn't be
+	 * trusted. */
+	if (load_file(c) == 0 && c->map != NULL) {
+		c->map->clean = 0;
+	} else {
+		/* Move whatever we have into a fresh file. */
+		struct table t;
+		if (new_table(c, c->capacity, &t) == 0) {
+			memcpy(t.slots, c->slots, c->capacity * sizeof(uint64_t));
+			memcpy(t.refs, c->refs, c->capacity);
+			install_table(c, &t, c->capacity);
+		}
+	}
+	c->hits = 0;
+	c->misses = 0;
+	c->evictions = 0;
+	return c;
+}
+
+int source_cache_persist(struct marquise_source_cache *c)
+{
+	if (c->map == NULL) {
+		return 0;
+	}
+	c->map->count = c->count;
+	c->map->hand = c->hand;
+	c->map->has_zero = c->has_zero;
+	c->map->checksum = table_checksum(c->slots, c->capacity);
+	c->map->clean = 1;
+	return msync(c->map, c->map_len, MS_SYNC);
+}
+
+void source_cache_free(struct marquise_source_cache *c)
+{
+	if (c == NULL) {
+		return;
+	}
+	struct table t = { c->slots, c->refs, c->fd, c->map, c->map_len };
+	free_table(&t);
+	free(c->path);
+	free(c);
+}
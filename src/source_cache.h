@@ -0,0 +1,94 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+/* The source dict cache: the set of hashes of source dicts already
+ * written to the contents spool, so that unchanged ones aren't queued
+ * again.
+ *
+ * It is an open-addressing table of 64-bit hashes with linear probing.
+ * Hashes are stored inline, so there is no allocation per entry and a
+ * lookup usually touches a single cache line. Zero marks an empty slot;
+ * a hash of zero is tracked separately. Callers provide their own
+ * locking.
+ *
+ * The table grows until it reaches max_slots; after that, inserting a
+ * new hash evicts an old one, chosen with the CLOCK algorithm. An
+ * evicted source dict is simply written again the next time it is
+ * updated.
+ *
+ * A cache opened with source_cache_open() keeps its table in a file
+ * mapped into memory, so that it survives a restart. The file is only
+ * trusted if source_cache_persist() was called before it was last
+ * closed, meaning that everything in it made it to the spool;
+ * otherwise, or if it is damaged, it is thrown away and the cache
+ * starts empty.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SOURCE_CACHE_INITIAL_SIZE 1024
+
+/* What each slot costs: the hash and its CLOCK reference byte. */
+#define SOURCE_CACHE_SLOT_BYTES (sizeof(uint64_t) + 1)
+
+/* Bump this whenever the layout of the file changes. */
+#define SOURCE_CACHE_FILE_VERSION 1
+
+struct source_cache_header;
+
+struct marquise_source_cache {
+	uint64_t *slots;
+	uint8_t  *refs;		/* Set when the hash in the slot is looked up. */
+	size_t    capacity;	/* Always a power of two. */
+	size_t    max_slots;	/* Capacity is never grown past this. */
+	size_t    count;	/* Non-zero hashes stored. */
+	size_t    hand;		/* The CLOCK hand, an index into slots. */
+	bool      has_zero;
+	uint64_t  hits;
+	uint64_t  misses;
+	uint64_t  evictions;
+	/* Only for a cache backed by a file. */
+	char     *path;
+	int       fd;
+	struct source_cache_header *map;
+	size_t    map_len;
+};
+
+/* Returns a cache with room for at least capacity hashes before it has
+ * to grow, using no more than about max_bytes for its table, or NULL if
+ * it can't be allocated. */
+struct marquise_source_cache *source_cache_new(size_t capacity, size_t max_bytes);
+
+/* As source_cache_new(), but backed by the file at path, picking up
+ * whatever was persisted there. If the file can't be used the cache
+ * just lives in memory. */
+struct marquise_source_cache *source_cache_open(const char *path, size_t capacity, size_t max_bytes);
+
+/* The most hashes c will hold before it starts evicting. */
+size_t source_cache_limit(const struct marquise_source_cache *c);
+
+bool source_cache_contains(const struct marquise_source_cache *c, uint64_t hash);
+
+/* Add hash to the cache, counting a hit or a miss. Returns 1 if it was
+ * added, 0 if it was already present, or -1 if the table couldn't grow
+ * to take it. */
+int source_cache_insert(struct marquise_source_cache *c, uint64_t hash);
+
+/* Forget hash, if it is present. */
+void source_cache_remove(struct marquise_source_cache *c, uint64_t hash);
+
+/* Mark a file-backed cache as safe to load next time and write it out.
+ * Call this only once every source dict in the cache is in the spool,
+ * and don't insert anything afterwards. Returns zero on success, -1 on
+ * error. */
+int source_cache_persist(struct marquise_source_cache *c);
+
+void source_cache_free(struct marquise_source_cache *c);
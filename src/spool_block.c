@@ -0,0 +1,443 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "spool_block.h"
+#include "marquise.h"
+
+/* Write the 32-bit value in v to the byte array p. */
+#define U32TO8_LE(p, v)                \
+	(p)[0] = (uint8_t)((v));       \
+	(p)[1] = (uint8_t)((v) >>  8); \
+	(p)[2] = (uint8_t)((v) >> 16); \
+	(p)[3] = (uint8_t)((v) >> 24);
+
+/* Read a 32-bit value from the little-endian byte array p. */
+#define U8TO32_LE(p)                   \
+	(((uint32_t)((p)[0])      ) |  \
+	 ((uint32_t)((p)[1]) <<  8) |  \
+	 ((uint32_t)((p)[2]) << 16) |  \
+	 ((uint32_t)((p)[3]) << 24))
+
+/* zlib's fastest setting; spool bandwidth is what we're saving, not
+ * the last few percent of it. */
+#define SPOOL_ZLIB_LEVEL 1
+#define SPOOL_ZSTD_LEVEL 1
+
+struct spool_codec {
+	int      id;
+	size_t   block_size;
+	/* The block being put together: header, then payload. */
+	uint8_t *out;
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+struct marquise_block_reader {
+	int      fd;
+	int      codec;
+	uint8_t *in;		/* The block's compressed payload. */
+	size_t   in_size;
+	uint8_t *raw;		/* The block decompressed. */
+	size_t   raw_size;
+	size_t   raw_len;
+	size_t   raw_pos;	/* How much of raw has been read. */
+#ifdef HAVE_ZLIB
+	z_stream z;
+	bool     z_ready;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *zstd;
+#endif
+};
+
+/* Whether we were built with codec id. */
+static bool codec_built(int id)
+{
+	switch (id) {
+#ifdef HAVE_ZLIB
+	case SPOOL_CODEC_ZLIB:
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case SPOOL_CODEC_ZSTD:
+		return true;
+#endif
+#ifdef HAVE_LZ4
+	case SPOOL_CODEC_LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+/* The codec called name, or 0 if there's no such codec. One we weren't
+ * built with gets the first we were of zlib, zstd and lz4 instead, or
+ * -1 if we have none of them. */
+static int codec_id(const char *name)
+{
+	int id;
+	if (strcmp(name, "zlib") == 0) {
+		id = SPOOL_CODEC_ZLIB;
+	} else if (strcmp(name, "zstd") == 0) {
+		id = SPOOL_CODEC_ZSTD;
+	} else if (strcmp(name, "lz4") == 0) {
+		id = SPOOL_CODEC_LZ4;
+	} else {
+		return 0;
+	}
+	if (codec_built(id)) {
+		return id;
+	}
+	for (id = SPOOL_CODEC_ZLIB; id <= SPOOL_CODEC_LZ4; id++) {
+		if (codec_built(id)) {
+			return id;
+		}
+	}
+	return -1;
+}
+
+struct spool_codec *spool_codec_new(const char *name, size_t block_size)
+{
+	int id = codec_id(name);
+	if (id == 0 || block_size == 0 || block_size > SPOOL_BLOCK_MAX_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (id < 0) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	struct spool_codec *c = calloc(1, sizeof(struct spool_codec));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->id = id;
+	c->block_size = block_size;
+	/* A block that doesn't fit in its raw size is stored raw, so
+	 * that's all the room compressing it gets. */
+	c->out = malloc(SPOOL_BLOCK_HEADER_LEN + block_size);
+	if (c->out == NULL) {
+		free(c);
+		return NULL;
+	}
+#ifdef HAVE_ZLIB
+	if (id == SPOOL_CODEC_ZLIB && deflateInit(&c->z, SPOOL_ZLIB_LEVEL) != Z_OK) {
+		free(c->out);
+		free(c);
+		errno = ENOMEM;
+		return NULL;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (id == SPOOL_CODEC_ZSTD) {
+		c->zstd = ZSTD_createCCtx();
+		if (c->zstd == NULL) {
+			free(c->out);
+			free(c);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+#endif
+	return c;
+}
+
+void spool_codec_free(struct spool_codec *c)
+{
+	if (c == NULL) {
+		return;
+	}
+#ifdef HAVE_ZLIB
+	if (c->id == SPOOL_CODEC_ZLIB) {
+		deflateEnd(&c->z);
+	}
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(c->zstd);
+#endif
+	free(c->out);
+	free(c);
+}
+
+void spool_codec_file_header(const struct spool_codec *c, uint8_t *header)
+{
+	memcpy(header, SPOOL_BLOCK_MAGIC, 4);
+	header[4] = SPOOL_BLOCK_VERSION;
+	header[5] = (uint8_t)c->id;
+	header[6] = header[7] = 0;
+}
+
+const uint8_t *spool_codec_compress(struct spool_codec *c, const uint8_t *raw, size_t len, size_t *block_len)
+{
+	uint8_t *payload = c->out + SPOOL_BLOCK_HEADER_LEN;
+	/* Zero if it didn't come out smaller. */
+	size_t compressed = 0;
+
+#ifdef HAVE_ZLIB
+	if (c->id == SPOOL_CODEC_ZLIB) {
+		deflateReset(&c->z);
+		c->z.next_in = (Bytef *)raw;
+		c->z.avail_in = len;
+		c->z.next_out = payload;
+		c->z.avail_out = len;
+		if (deflate(&c->z, Z_FINISH) == Z_STREAM_END) {
+			compressed = c->z.total_out;
+		}
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (c->id == SPOOL_CODEC_ZSTD) {
+		size_t ret = ZSTD_compressCCtx(c->zstd, payload, len, raw, len, SPOOL_ZSTD_LEVEL);
+		if (!ZSTD_isError(ret)) {
+			compressed = ret;
+		}
+	}
+#endif
+#ifdef HAVE_LZ4
+	if (c->id == SPOOL_CODEC_LZ4) {
+		int ret = LZ4_compress_default((const char *)raw, (char *)payload, len, len);
+		if (ret > 0) {
+			compressed = ret;
+		}
+	}
+#endif
+
+	if (compressed == 0 || compressed >= len) {
+		memcpy(payload, raw, len);
+		compressed = len;
+	}
+	U32TO8_LE(c->out, (uint32_t)compressed);
+	U32TO8_LE(c->out + 4, (uint32_t)len);
+	*block_len = SPOOL_BLOCK_HEADER_LEN + compressed;
+	return c->out;
+}
+
+/* Read up to len bytes from fd, stopping short only at the end of the
+ * file. Returns how many were read, or -1 on error. */
+static ssize_t read_full(int fd, uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = read(fd, buf + done, len - done);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+/* Make *buf at least len bytes long. Zero on success, -1 on failure. */
+static int reserve(uint8_t **buf, size_t *size, size_t len)
+{
+	if (len <= *size) {
+		return 0;
+	}
+	uint8_t *p = realloc(*buf, len);
+	if (p == NULL) {
+		return -1;
+	}
+	*buf = p;
+	*size = len;
+	return 0;
+}
+
+/* Decompress the compressed bytes of r->in into exactly raw_len bytes
+ * of r->raw. Zero on success, -1 if they don't. */
+static int decompress(marquise_block_reader *r, size_t compressed, size_t raw_len)
+{
+	if (compressed == raw_len) {
+		memcpy(r->raw, r->in, raw_len);
+		return 0;
+	}
+#ifdef HAVE_ZLIB
+	if (r->codec == SPOOL_CODEC_ZLIB) {
+		inflateReset(&r->z);
+		r->z.next_in = r->in;
+		r->z.avail_in = compressed;
+		r->z.next_out = r->raw;
+		r->z.avail_out = raw_len;
+		int ret = inflate(&r->z, Z_FINISH);
+		return (ret == Z_STREAM_END && r->z.total_out == raw_len && r->z.avail_in == 0) ? 0 : -1;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (r->codec == SPOOL_CODEC_ZSTD) {
+		size_t ret = ZSTD_decompressDCtx(r->zstd, r->raw, raw_len, r->in, compressed);
+		return (!ZSTD_isError(ret) && ret == raw_len) ? 0 : -1;
+	}
+#endif
+#ifdef HAVE_LZ4
+	if (r->codec == SPOOL_CODEC_LZ4) {
+		int ret = LZ4_decompress_safe((const char *)r->in, (char *)r->raw, compressed, raw_len);
+		return (ret >= 0 && (size_t)ret == raw_len) ? 0 : -1;
+	}
+#endif
+	return -1;
+}
+
+/* Read and decompress the next block. Returns 1 if there was one, 0 at
+ * the end of the file, -1 with errno set on failure. */
+static int next_block(marquise_block_reader *r)
+{
+	uint8_t header[SPOOL_BLOCK_HEADER_LEN];
+	ssize_t ret = read_full(r->fd, header, SPOOL_BLOCK_HEADER_LEN);
+	if (ret == 0) {
+		return 0;
+	}
+	if (ret < 0) {
+		return -1;
+	}
+	/* Blocks are never empty, so zeroes are the unused tail of a file
+	 * from the mmap writer that wasn't trimmed. */
+	static const uint8_t zeroes[SPOOL_BLOCK_HEADER_LEN];
+	if (memcmp(header, zeroes, ret) == 0) {
+		return 0;
+	}
+	size_t compressed = U8TO32_LE(header);
+	size_t raw_len = U8TO32_LE(header + 4);
+	if (ret < SPOOL_BLOCK_HEADER_LEN || raw_len > SPOOL_BLOCK_MAX_SIZE || compressed > raw_len) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (reserve(&r->in, &r->in_size, compressed) != 0 ||
+	    reserve(&r->raw, &r->raw_size, raw_len) != 0) {
+		return -1;
+	}
+	ret = read_full(r->fd, r->in, compressed);
+	if (ret < 0) {
+		return -1;
+	}
+	if ((size_t)ret < compressed || decompress(r, compressed, raw_len) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	r->raw_len = raw_len;
+	r->raw_pos = 0;
+	return 1;
+}
+
+marquise_block_reader *marquise_block_reader_open(const char *path)
+{
+	uint8_t header[SPOOL_BLOCK_FILE_HEADER_LEN];
+	marquise_block_reader *r = calloc(1, sizeof(marquise_block_reader));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (r->fd < 0) {
+		free(r);
+		return NULL;
+	}
+	ssize_t ret = read_full(r->fd, header, SPOOL_BLOCK_FILE_HEADER_LEN);
+	if (ret != SPOOL_BLOCK_FILE_HEADER_LEN || memcmp(header, SPOOL_BLOCK_MAGIC, 4) != 0 ||
+	    header[4] != SPOOL_BLOCK_VERSION) {
+		marquise_block_reader_close(r);
+		errno = (ret < 0) ? errno : EINVAL;
+		return NULL;
+	}
+	r->codec = header[5];
+	if (!codec_built(r->codec)) {
+		marquise_block_reader_close(r);
+		errno = ENOTSUP;
+		return NULL;
+	}
+#ifdef HAVE_ZLIB
+	if (r->codec == SPOOL_CODEC_ZLIB) {
+		if (inflateInit(&r->z) != Z_OK) {
+			marquise_block_reader_close(r);
+			errno = ENOMEM;
+			return NULL;
+		}
+		r->z_ready = true;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (r->codec == SPOOL_CODEC_ZSTD) {
+		r->zstd = ZSTD_createDCtx();
+		if (r->zstd == NULL) {
+			marquise_block_reader_close(r);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+#endif
+	/* lz4 has nothing to set up. */
+	return r;
+}
+
+ssize_t marquise_block_read(marquise_block_reader *r, void *buf, size_t len)
+{
+	while (r->raw_pos == r->raw_len) {
+		int ret = next_block(r);
+		if (ret <= 0) {
+			return ret;
+		}
+	}
+	size_t n = r->raw_len - r->raw_pos;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(buf, r->raw + r->raw_pos, n);
+	r->raw_pos += n;
+	return n;
+}
+
+void marquise_block_reader_close(marquise_block_reader *r)
+{
+	if (r == NULL) {
+		return;
+	}
+	int saved_errno = errno;
+	close(r->fd);
+#ifdef HAVE_ZLIB
+	if (r->z_ready) {
+		inflateEnd(&r->z);
+	}
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeDCtx(r->zstd);
+#endif
+	free(r->in);
+	free(r->raw);
+	free(r);
+	errno = saved_errno;
+}
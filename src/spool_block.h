@@ -0,0 +1,64 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+/* Block-compressed spool files, chosen with MARQUISE_SPOOL_COMPRESSION.
+ * Whatever would have been written to the spool file (classic frames,
+ * or the compact format) is cut into blocks of MARQUISE_SPOOL_BLOCK_SIZE
+ * bytes, and each block is compressed on its own. Frames may straddle
+ * blocks. Blocks are cut short when the spool is flushed or rotated.
+ *
+ * A file starts with an eight-byte header: the magic "MQSZ", a version
+ * byte (SPOOL_BLOCK_VERSION), the codec (one of SPOOL_CODEC_*) and two
+ * zero bytes. Each block follows with an eight-byte header: its
+ * compressed size and its raw size, as 32-bit little-endian integers.
+ * A block that wouldn't get any smaller is stored as it is, with the
+ * two sizes equal. Blocks are never empty, so a block header of zeroes
+ * ends the file: it is the unused tail of an mmap writer's segment.
+ *
+ * Each codec is only available if libmarquise was built with it.
+ * Asking for one it wasn't gets the first it was of zlib, zstd and lz4
+ * instead.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SPOOL_BLOCK_MAGIC "MQSZ"
+#define SPOOL_BLOCK_VERSION 1
+#define SPOOL_BLOCK_FILE_HEADER_LEN 8
+#define SPOOL_BLOCK_HEADER_LEN 8
+
+/* Keeps a damaged size from asking for the earth. */
+#define SPOOL_BLOCK_MAX_SIZE 16*1024*1024
+
+#define SPOOL_CODEC_ZLIB 1
+#define SPOOL_CODEC_ZSTD 2
+#define SPOOL_CODEC_LZ4  3
+
+struct spool_codec;
+
+/* A codec by name, "zlib", "zstd" or "lz4", compressing blocks of up to
+ * block_size bytes. Returns NULL with errno set to EINVAL for any other
+ * name or a block size over SPOOL_BLOCK_MAX_SIZE, to ENOTSUP if
+ * libmarquise was built without any codec at all, or if it can't be set
+ * up. */
+struct spool_codec *spool_codec_new(const char *name, size_t block_size);
+
+/* Safe to call with NULL. */
+void spool_codec_free(struct spool_codec *c);
+
+/* Fill in the SPOOL_BLOCK_FILE_HEADER_LEN bytes at header that a file
+ * written with c starts with. */
+void spool_codec_file_header(const struct spool_codec *c, uint8_t *header);
+
+/* Compress the len bytes at raw, no more than the codec's block size,
+ * into a block with its header. Returns the block, which belongs to the
+ * codec and is good until it's next used, with its length in
+ * *block_len. */
+const uint8_t *spool_codec_compress(struct spool_codec *c, const uint8_t *raw, size_t len, size_t *block_len);
@@ -0,0 +1,241 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+/* Reading spool files back. A classic file is mapped and its frames are
+ * handed out as pointers into the mapping. A block-compressed or
+ * compact file has to be turned back into classic frames first, so it
+ * is decoded into memory and read from there.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "marquise.h"
+#include "compact.h"
+#include "spool_block.h"
+
+/* Read a 64-bit value from the little-endian byte array p. */
+#define U8TO64_LE(p)                   \
+	(((uint64_t)((p)[0])      ) |  \
+	 ((uint64_t)((p)[1]) <<  8) |  \
+	 ((uint64_t)((p)[2]) << 16) |  \
+	 ((uint64_t)((p)[3]) << 24) |  \
+	 ((uint64_t)((p)[4]) << 32) |  \
+	 ((uint64_t)((p)[5]) << 40) |  \
+	 ((uint64_t)((p)[6]) << 48) |  \
+	 ((uint64_t)((p)[7]) << 56))
+
+struct marquise_spool {
+	spool_type     type;
+	const uint8_t *data;
+	size_t         len;
+	size_t         pos;	/* Where the next frame starts. */
+	/* Exactly one of these holds data. */
+	uint8_t       *map;
+	uint8_t       *decoded;
+};
+
+/* Read the whole of the block-compressed file at path into a buffer of
+ * *len bytes. Returns NULL with errno set on failure. */
+static uint8_t *decompress_file(const char *path, size_t *len)
+{
+	marquise_block_reader *r = marquise_block_reader_open(path);
+	if (r == NULL) {
+		return NULL;
+	}
+	size_t size = 1024 * 1024;
+	size_t used = 0;
+	uint8_t *buf = malloc(size);
+	ssize_t n = 0;
+	while (buf != NULL && (n = marquise_block_read(r, buf + used, size - used)) > 0) {
+		used += n;
+		if (used == size) {
+			uint8_t *p = realloc(buf, size * 2);
+			if (p == NULL) {
+				free(buf);
+			}
+			buf = p;
+			size *= 2;
+		}
+	}
+	marquise_block_reader_close(r);
+	if (n < 0) {
+		free(buf);
+		return NULL;
+	}
+	*len = used;
+	return buf;
+}
+
+/* Replace s's data, which is in the compact format, with the classic
+ * frames it holds. Zero on success, -1 with errno set on failure. */
+static int decode_compact(marquise_spool *s)
+{
+	size_t len;
+	uint8_t *decoded = marquise_compact_decode(s->data, s->len, &len);
+	if (decoded == NULL) {
+		return -1;
+	}
+	if (s->map != NULL) {
+		munmap(s->map, s->len);
+		s->map = NULL;
+	}
+	free(s->decoded);
+	s->decoded = decoded;
+	s->data = decoded;
+	s->len = len;
+	return 0;
+}
+
+marquise_spool *marquise_spool_open(const char *path, spool_type type)
+{
+	struct stat st;
+	if (type != SPOOL_POINTS && type != SPOOL_CONTENTS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	marquise_spool *s = calloc(1, sizeof(marquise_spool));
+	if (s == NULL) {
+		return NULL;
+	}
+	s->type = type;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		marquise_spool_close(s);
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		marquise_spool_close(s);
+		return NULL;
+	}
+	/* There's no mapping nothing, and nothing to read either. */
+	if (st.st_size > 0) {
+		s->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (s->map == MAP_FAILED) {
+			s->map = NULL;
+			close(fd);
+			marquise_spool_close(s);
+			return NULL;
+		}
+		madvise(s->map, st.st_size, MADV_SEQUENTIAL);
+		s->data = s->map;
+		s->len = st.st_size;
+	}
+	close(fd);
+
+	if (s->len >= SPOOL_BLOCK_FILE_HEADER_LEN && memcmp(s->data, SPOOL_BLOCK_MAGIC, 4) == 0) {
+		munmap(s->map, s->len);
+		s->map = NULL;
+		s->decoded = decompress_file(path, &s->len);
+		s->data = s->decoded;
+		if (s->decoded == NULL) {
+			marquise_spool_close(s);
+			return NULL;
+		}
+	}
+	if (type == SPOOL_POINTS && s->len >= COMPACT_FILE_HEADER_LEN &&
+	    memcmp(s->data, COMPACT_MAGIC, 4) == 0 && decode_compact(s) != 0) {
+		marquise_spool_close(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* Return whether the len bytes at p are all zero. */
+static bool all_zero(const uint8_t *p, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (p[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int marquise_spool_next(marquise_spool *s, marquise_frame *frame)
+{
+	const uint8_t *p = s->data + s->pos;
+	size_t avail = s->len - s->pos;
+	size_t header_len = (s->type == SPOOL_POINTS) ? 24 : 16;
+
+	if (avail == 0) {
+		return 0;
+	}
+	/* No frame header is all zeroes, as the addresses which could make
+	 * one are refused, so that's the unused tail of an untrimmed file
+	 * from the mmap writer. */
+	if (all_zero(p, avail < header_len ? avail : header_len)) {
+		s->pos = s->len;
+		return 0;
+	}
+	if (avail < header_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	frame->address = U8TO64_LE(p);
+	frame->frame = p;
+	if (s->type == SPOOL_CONTENTS) {
+		frame->extended = false;
+		frame->timestamp = 0;
+		frame->value = 0;
+		frame->len = U8TO64_LE(p + 8);
+	} else if (p[0] & 1) {
+		/* Extended frames have the LSB of the address set. */
+		frame->extended = true;
+		frame->timestamp = U8TO64_LE(p + 8);
+		frame->value = 0;
+		frame->len = U8TO64_LE(p + 16);
+	} else {
+		frame->extended = false;
+		frame->timestamp = U8TO64_LE(p + 8);
+		frame->value = U8TO64_LE(p + 16);
+		frame->data = p + 16;
+		frame->len = 8;
+		frame->frame_len = 24;
+		s->pos += 24;
+		return 1;
+	}
+	if (frame->len > avail - header_len) {
+		errno = EINVAL;
+		return -1;
+	}
+	frame->data = p + header_len;
+	frame->frame_len = header_len + frame->len;
+	s->pos += frame->frame_len;
+	return 1;
+}
+
+size_t marquise_spool_offset(const marquise_spool *s)
+{
+	return s->pos;
+}
+
+void marquise_spool_close(marquise_spool *s)
+{
+	if (s == NULL) {
+		return;
+	}
+	int saved_errno = errno;
+	if (s->map != NULL) {
+		munmap(s->map, s->len);
+	}
+	free(s->decoded);
+	free(s);
+	errno = saved_errno;
+}
@@ -0,0 +1,435 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spool_uring.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+#define SLOT_FREE     0
+#define SLOT_FILLING  1
+#define SLOT_INFLIGHT 2
+
+/* A buffer of frames for spool type t, bound for offset in fd. done
+ * counts what has been written so far, so that short writes can be
+ * resubmitted. submitted_ns is when it was first submitted. sync is set
+ * if an fdatasync() of fd was linked after the write, and resubmitted
+ * once the write has had to be resubmitted, which cancels it. */
+typedef struct {
+	uint8_t *buf;
+	size_t   len;
+	size_t   done;
+	off_t    offset;
+	uint64_t submitted_ns;
+	int      fd;
+	int      t;
+	int      state;
+	bool     sync;
+	bool     resubmitted;
+} uring_slot;
+
+/* A file rotated away from, to be closed once the outstanding writes
+ * and sync against it have completed. */
+typedef struct {
+	int      fd;
+	unsigned outstanding;
+} uring_retiring;
+
+struct marquise_uring {
+	struct io_uring ring;
+	unsigned int    depth;
+	size_t          buf_size;
+	/* depth slots in flight, plus one being filled per spool type. */
+	uring_slot     *slots;
+	unsigned int    n_slots;
+	int             filling[2];
+	off_t           offset[2];
+	unsigned int    inflight;
+	uring_retiring *retiring;
+	unsigned int    n_retiring;
+	int             error;
+	uring_done_fn   done;
+	void           *done_data;
+};
+
+/* Slot writes carry the slot index as their user data; syncs carry
+ * -1 - fd. */
+#define SYNC_DATA(fd) ((void *)(intptr_t)(-1 - (fd)))
+
+/* Free everything but the ring itself. */
+static void free_uring(struct marquise_uring *u)
+{
+	unsigned int i;
+	for (i = 0; i < u->n_slots; i++) {
+		free(u->slots[i].buf);
+	}
+	free(u->slots);
+	free(u->retiring);
+	free(u);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct marquise_uring *uring_init(unsigned int depth, size_t buf_size, uring_done_fn done, void *done_data)
+{
+	unsigned int i;
+	if (depth == 0 || buf_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct marquise_uring *u = calloc(1, sizeof(struct marquise_uring));
+	if (u == NULL) {
+		return NULL;
+	}
+	u->depth = depth;
+	u->buf_size = buf_size;
+	u->done = done;
+	u->done_data = done_data;
+	u->n_slots = depth + 2;
+	u->filling[0] = -1;
+	u->filling[1] = -1;
+	/* The ring first, so that a kernel which won't have it costs no
+	 * buffers. Room for a write and a linked sync per slot. */
+	int ret = io_uring_queue_init(2 * u->n_slots, &u->ring, 0);
+	if (ret < 0) {
+		free(u);
+		errno = -ret;
+		return NULL;
+	}
+	u->slots = calloc(u->n_slots, sizeof(uring_slot));
+	u->retiring = calloc(u->n_slots, sizeof(uring_retiring));
+	if (u->slots == NULL || u->retiring == NULL) {
+		u->n_slots = 0;
+	}
+	for (i = 0; i < u->n_slots; i++) {
+		u->slots[i].buf = malloc(buf_size);
+		if (u->slots[i].buf == NULL) {
+			break;
+		}
+	}
+	if (u->n_slots == 0 || i < u->n_slots) {
+		io_uring_queue_exit(&u->ring);
+		free_uring(u);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return u;
+}
+
+/* Note that another operation is outstanding against fd, if it is a
+ * retired file. */
+static void op_added(struct marquise_uring *u, int fd)
+{
+	unsigned int i;
+	for (i = 0; i < u->n_retiring; i++) {
+		if (u->retiring[i].fd == fd) {
+			u->retiring[i].outstanding++;
+			return;
+		}
+	}
+}
+
+/* Note that one of the operations outstanding against fd is done, and
+ * close it if it was the last on a retired file. */
+static void op_done(struct marquise_uring *u, int fd)
+{
+	unsigned int i;
+	for (i = 0; i < u->n_retiring; i++) {
+		if (u->retiring[i].fd == fd) {
+			if (--u->retiring[i].outstanding == 0) {
+				close(fd);
+				u->retiring[i] = u->retiring[--u->n_retiring];
+			}
+			return;
+		}
+	}
+}
+
+static void record_error(struct marquise_uring *u, int err)
+{
+	if (u->error == 0) {
+		u->error = err;
+	}
+}
+
+static struct io_uring_sqe *prep_slot_write(struct marquise_uring *u, int idx)
+{
+	uring_slot *slot = &u->slots[idx];
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+	io_uring_prep_write(sqe, slot->fd, slot->buf + slot->done, slot->len - slot->done, slot->offset + slot->done);
+	io_uring_sqe_set_data(sqe, (void *)(intptr_t)idx);
+	return sqe;
+}
+
+/* Queue an fdatasync() of fd to run once everything submitted before it
+ * has completed. */
+static void prep_sync(struct marquise_uring *u, int fd)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+	io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+	io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+	io_uring_sqe_set_data(sqe, SYNC_DATA(fd));
+	u->inflight++;
+}
+
+/* Handle completions: at least one if wait is set, otherwise only those
+ * already available. */
+static void reap(struct marquise_uring *u, bool wait)
+{
+	struct io_uring_cqe *cqe;
+	int ret = wait ? io_uring_wait_cqe(&u->ring, &cqe) : io_uring_peek_cqe(&u->ring, &cqe);
+	bool resubmit = false;
+	while (ret == 0) {
+		intptr_t data = (intptr_t)io_uring_cqe_get_data(cqe);
+		int res = cqe->res;
+		io_uring_cqe_seen(&u->ring, cqe);
+
+		if (data < 0) {
+			/* A cancelled sync means its write failed, which has
+			 * been recorded already, or came up short, in which
+			 * case the sync is queued again once the rest is
+			 * written. */
+			if (res < 0 && res != -ECANCELED) {
+				record_error(u, -res);
+			}
+			u->inflight--;
+			op_done(u, -1 - (int)data);
+		} else {
+			uring_slot *slot = &u->slots[data];
+			if (res < 0) {
+				record_error(u, -res);
+			} else {
+				slot->done += res;
+			}
+			if (res > 0 && slot->done < slot->len) {
+				prep_slot_write(u, data);
+				slot->resubmitted = true;
+				resubmit = true;
+			} else {
+				if (res == 0 && slot->done < slot->len) {
+					record_error(u, EIO);
+				}
+				u->done(u->done_data, slot->t, now_ns() - slot->submitted_ns,
+					slot->done < slot->len ? -1 : 0);
+				if (slot->sync && slot->resubmitted && slot->done == slot->len) {
+					op_added(u, slot->fd);
+					prep_sync(u, slot->fd);
+					resubmit = true;
+				}
+				slot->state = SLOT_FREE;
+				u->inflight--;
+				op_done(u, slot->fd);
+			}
+		}
+		ret = io_uring_peek_cqe(&u->ring, &cqe);
+	}
+	if (resubmit) {
+		io_uring_submit(&u->ring);
+	}
+}
+
+/* Submit the slot being filled for spool type t, if it holds anything,
+ * optionally followed by an fdatasync() of its file which runs only
+ * after every earlier write has completed. */
+static void submit_filling(struct marquise_uring *u, int t, bool sync, int sync_fd)
+{
+	int idx = u->filling[t];
+	if (idx >= 0 && u->slots[idx].len == 0) {
+		u->slots[idx].state = SLOT_FREE;
+		idx = -1;
+	}
+	u->filling[t] = -1;
+	if (idx < 0 && !sync) {
+		return;
+	}
+
+	struct io_uring_sqe *sqe;
+	if (idx >= 0) {
+		uring_slot *slot = &u->slots[idx];
+		slot->state = SLOT_INFLIGHT;
+		slot->submitted_ns = now_ns();
+		u->offset[t] += slot->len;
+		u->inflight++;
+		sqe = prep_slot_write(u, idx);
+		if (sync) {
+			/* The chain starts once everything before it is done, and
+			 * the sync only runs if the write succeeds in full. */
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN | IOSQE_IO_LINK);
+			sqe = io_uring_get_sqe(&u->ring);
+			io_uring_prep_fsync(sqe, slot->fd, IORING_FSYNC_DATASYNC);
+			io_uring_sqe_set_data(sqe, SYNC_DATA(slot->fd));
+			slot->sync = true;
+			u->inflight++;
+		}
+	} else {
+		prep_sync(u, sync_fd);
+	}
+	io_uring_submit(&u->ring);
+}
+
+/* Return a free slot, waiting for a write to complete if need be. */
+static int free_slot(struct marquise_uring *u)
+{
+	unsigned int i;
+	for (;;) {
+		for (i = 0; i < u->n_slots; i++) {
+			if (u->slots[i].state == SLOT_FREE) {
+				return i;
+			}
+		}
+		reap(u, true);
+	}
+}
+
+/* Report, and clear, the first error since the last report. */
+static int take_error(struct marquise_uring *u)
+{
+	if (u->error == 0) {
+		return 0;
+	}
+	errno = u->error;
+	u->error = 0;
+	return -1;
+}
+
+int uring_append(struct marquise_uring *u, int t, int fd, const struct iovec *iov, int iovcnt)
+{
+	int i;
+	reap(u, false);
+	for (i = 0; i < iovcnt; i++) {
+		const uint8_t *src = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while (left > 0) {
+			if (u->filling[t] < 0) {
+				int idx = free_slot(u);
+				u->slots[idx].state = SLOT_FILLING;
+				u->slots[idx].fd = fd;
+				u->slots[idx].t = t;
+				u->slots[idx].offset = u->offset[t];
+				u->slots[idx].len = 0;
+				u->slots[idx].done = 0;
+				u->slots[idx].sync = false;
+				u->slots[idx].resubmitted = false;
+				u->filling[t] = idx;
+			}
+			uring_slot *slot = &u->slots[u->filling[t]];
+			size_t n = u->buf_size - slot->len;
+			if (n > left) {
+				n = left;
+			}
+			memcpy(slot->buf + slot->len, src, n);
+			slot->len += n;
+			src += n;
+			left -= n;
+			if (slot->len == u->buf_size) {
+				submit_filling(u, t, false, fd);
+			}
+		}
+	}
+	return take_error(u);
+}
+
+int uring_rotate(struct marquise_uring *u, int t, int old_fd, bool sync)
+{
+	unsigned int i;
+	/* Make room first, so that nothing against old_fd completes between
+	 * counting and recording what's outstanding. */
+	while (u->n_retiring == u->n_slots) {
+		reap(u, true);
+	}
+	submit_filling(u, t, sync, old_fd);
+	u->offset[t] = 0;
+
+	unsigned int outstanding = 0;
+	for (i = 0; i < u->n_slots; i++) {
+		if (u->slots[i].state == SLOT_INFLIGHT && u->slots[i].fd == old_fd) {
+			outstanding++;
+		}
+	}
+	if (sync) {
+		outstanding++;
+	}
+	if (outstanding == 0) {
+		close(old_fd);
+	} else {
+		u->retiring[u->n_retiring].fd = old_fd;
+		u->retiring[u->n_retiring].outstanding = outstanding;
+		u->n_retiring++;
+	}
+	return take_error(u);
+}
+
+int uring_flush(struct marquise_uring *u)
+{
+	submit_filling(u, 0, false, -1);
+	submit_filling(u, 1, false, -1);
+	while (u->inflight > 0) {
+		reap(u, true);
+	}
+	return take_error(u);
+}
+
+void uring_free(struct marquise_uring *u)
+{
+	if (u == NULL) {
+		return;
+	}
+	uring_flush(u);
+	io_uring_queue_exit(&u->ring);
+	free_uring(u);
+}
+
+#else /* !HAVE_LIBURING */
+
+struct marquise_uring *uring_init(unsigned int depth, size_t buf_size, uring_done_fn done, void *done_data)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+int uring_append(struct marquise_uring *u, int t, int fd, const struct iovec *iov, int iovcnt)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int uring_rotate(struct marquise_uring *u, int t, int old_fd, bool sync)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int uring_flush(struct marquise_uring *u)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void uring_free(struct marquise_uring *u)
+{
+}
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,52 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+/* io_uring spool writer. Frames are copied into a pool of buffers, and
+ * each buffer is submitted as a write at an explicit file offset once
+ * it fills, with a bounded number of writes in flight. Spool types are
+ * the SPOOL_POINTS/SPOOL_CONTENTS indices.
+ *
+ * Without liburing, uring_init() always fails and the writer falls
+ * back to write(2).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct marquise_uring;
+
+/* Called with done_data as each buffer's write completes: the spool
+ * type it was for, nanoseconds from its submission to its completion,
+ * and zero, or -1 if it failed. */
+typedef void (*uring_done_fn)(void *done_data, int t, uint64_t ns, int ret);
+
+/* Set up a ring allowing depth writes in flight, of buffers of buf_size
+ * bytes, calling done as each completes. Returns NULL (with errno set)
+ * if io_uring is unavailable. */
+struct marquise_uring *uring_init(unsigned int depth, size_t buf_size, uring_done_fn done, void *done_data);
+
+/* Queue the iovcnt buffers in iov for appending to fd, the current file
+ * of spool type t. Zero on success, -1 with errno set if this or an
+ * earlier write failed. */
+int uring_append(struct marquise_uring *u, int t, int fd, const struct iovec *iov, int iovcnt);
+
+/* Submit everything queued for old_fd, the file spool type t is
+ * rotating away from, optionally followed by an fdatasync(), and close
+ * old_fd once those complete. Later appends for t start at offset 0 of
+ * the new file. Zero on success, -1 with errno set on failure. */
+int uring_rotate(struct marquise_uring *u, int t, int old_fd, bool sync);
+
+/* Submit everything queued and wait for all of it to complete. Zero on
+ * success, -1 with errno set if any write failed. */
+int uring_flush(struct marquise_uring *u);
+
+/* Flush and tear down the ring. */
+void uring_free(struct marquise_uring *u);
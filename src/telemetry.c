@@ -0,0 +1,235 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "marquise.h"
+#include "telemetry.h"
+
+enum {
+	METRIC_FRAMES_PER_SECOND,
+	METRIC_BYTES_PER_SECOND,
+	METRIC_ROTATIONS,
+	METRIC_WRITE_ERRORS,
+	METRIC_SOURCE_CACHE_HIT_RATE,
+	METRIC_WRITE_LATENCY_P50,
+	METRIC_WRITE_LATENCY_P99,
+	METRIC_WRITE_LATENCY_P999,
+	N_METRICS
+};
+
+static const struct {
+	const char *name;
+	const char *unit;
+} metrics[N_METRICS] = {
+	{ "frames_per_second", "frames/s" },
+	{ "bytes_per_second", "bytes/s" },
+	{ "rotations", "count" },
+	{ "write_errors", "count" },
+	{ "source_cache_hit_rate", "basis_points" },
+	{ "write_latency_p50", "ns" },
+	{ "write_latency_p99", "ns" },
+	{ "write_latency_p999", "ns" },
+};
+
+struct marquise_telemetry {
+	marquise_ctx *ctx;
+	GThread *thread;
+	GMutex   lock;
+	GCond    cond;
+	bool     stopping;
+	gint64   interval;
+	uint64_t addresses[N_METRICS];
+	marquise_source *sources[N_METRICS];
+	bool     registered[N_METRICS];
+	/* The counters as of the last round, for rates over the interval. */
+	marquise_stats last;
+	gint64   last_time;
+};
+
+/* Send the source dict of each metric which hasn't been sent yet. */
+static void register_sources(struct marquise_telemetry *t)
+{
+	int i;
+	for (i = 0; i < N_METRICS; i++) {
+		if (!t->registered[i] &&
+		    marquise_update_source(t->ctx, t->addresses[i], t->sources[i]) == 0) {
+			t->registered[i] = true;
+		}
+	}
+}
+
+/* The latency below which fraction q of the writes counted in hist
+ * fell, taking the top of the bucket it lands in. Zero if there were
+ * no writes. */
+static uint64_t latency_percentile(const uint64_t *hist, uint64_t total, double q)
+{
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t target = (uint64_t)(q * total);
+	uint64_t seen = 0;
+	int i;
+	for (i = 0; i < MARQUISE_STATS_LATENCY_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > target) {
+			break;
+		}
+	}
+	if (i >= MARQUISE_STATS_LATENCY_BUCKETS) {
+		i = MARQUISE_STATS_LATENCY_BUCKETS - 1;
+	}
+	return (uint64_t)1 << i;
+}
+
+/* Send one round of metrics, covering the time since the last. */
+static void send_metrics(struct marquise_telemetry *t)
+{
+	marquise_stats now;
+	marquise_point pts[N_METRICS];
+	uint64_t hist[MARQUISE_STATS_LATENCY_BUCKETS];
+	uint64_t writes = 0;
+	int i;
+
+	marquise_get_stats(t->ctx, &now);
+	gint64 time = g_get_monotonic_time();
+	double seconds = (time - t->last_time) / 1e6;
+	uint64_t timestamp = (uint64_t)g_get_real_time() * 1000;
+	for (i = 0; i < MARQUISE_STATS_LATENCY_BUCKETS; i++) {
+		hist[i] = now.write_latency[i] - t->last.write_latency[i];
+		writes += hist[i];
+	}
+	uint64_t frames = (now.frames_points + now.frames_contents) -
+	                  (t->last.frames_points + t->last.frames_contents);
+	uint64_t bytes = (now.bytes_points + now.bytes_contents) -
+	                 (t->last.bytes_points + t->last.bytes_contents);
+	uint64_t hits = now.source_hits - t->last.source_hits;
+	uint64_t lookups = hits + (now.source_misses - t->last.source_misses);
+
+	uint64_t values[N_METRICS];
+	bool have[N_METRICS];
+	values[METRIC_FRAMES_PER_SECOND] = seconds > 0 ? (uint64_t)(frames / seconds) : 0;
+	values[METRIC_BYTES_PER_SECOND] = seconds > 0 ? (uint64_t)(bytes / seconds) : 0;
+	values[METRIC_ROTATIONS] = now.rotations;
+	values[METRIC_WRITE_ERRORS] = now.write_errors;
+	values[METRIC_SOURCE_CACHE_HIT_RATE] = lookups > 0 ? hits * 10000 / lookups : 0;
+	values[METRIC_WRITE_LATENCY_P50] = latency_percentile(hist, writes, 0.5);
+	values[METRIC_WRITE_LATENCY_P99] = latency_percentile(hist, writes, 0.99);
+	values[METRIC_WRITE_LATENCY_P999] = latency_percentile(hist, writes, 0.999);
+	/* A rate or percentile over nothing isn't zero, so leave it out. */
+	for (i = 0; i < N_METRICS; i++) {
+		have[i] = true;
+	}
+	have[METRIC_SOURCE_CACHE_HIT_RATE] = lookups > 0;
+	have[METRIC_WRITE_LATENCY_P50] = writes > 0;
+	have[METRIC_WRITE_LATENCY_P99] = writes > 0;
+	have[METRIC_WRITE_LATENCY_P999] = writes > 0;
+
+	size_t n = 0;
+	for (i = 0; i < N_METRICS; i++) {
+		if (have[i]) {
+			pts[n].address = t->addresses[i];
+			pts[n].timestamp = timestamp;
+			pts[n].value = values[i];
+			n++;
+		}
+	}
+
+	register_sources(t);
+	/* Nowhere to report a failure but the next round's write_errors. */
+	marquise_send_simple_batch(t->ctx, pts, n);
+
+	/* Our own points count towards the next round, which is fair
+	 * enough: they went through the same spool. */
+	t->last = now;
+	t->last_time = time;
+}
+
+static gpointer telemetry_thread(gpointer data)
+{
+	struct marquise_telemetry *t = data;
+
+	g_mutex_lock(&t->lock);
+	while (!t->stopping) {
+		gint64 deadline = g_get_monotonic_time() + t->interval;
+		while (!t->stopping) {
+			if (!g_cond_wait_until(&t->cond, &t->lock, deadline)) {
+				break;
+			}
+		}
+		if (t->stopping) {
+			break;
+		}
+		g_mutex_unlock(&t->lock);
+		send_metrics(t);
+		g_mutex_lock(&t->lock);
+	}
+	g_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+static void free_telemetry(struct marquise_telemetry *t)
+{
+	int i;
+	for (i = 0; i < N_METRICS; i++) {
+		marquise_free_source(t->sources[i]);
+	}
+	g_mutex_clear(&t->lock);
+	g_cond_clear(&t->cond);
+	free(t);
+}
+
+struct marquise_telemetry *telemetry_start(marquise_ctx *ctx, gint64 interval)
+{
+	struct marquise_telemetry *t = calloc(1, sizeof(struct marquise_telemetry));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->ctx = ctx;
+	t->interval = interval;
+	g_mutex_init(&t->lock);
+	g_cond_init(&t->cond);
+
+	const char *hostname = g_get_host_name();
+	int i;
+	for (i = 0; i < N_METRICS; i++) {
+		char *fields[5] = { "hostname", "metric", "namespace", "service", "unit" };
+		char *values[5] = { (char *)hostname, (char *)metrics[i].name,
+		                    ctx->marquise_namespace, "libmarquise", (char *)metrics[i].unit };
+		t->sources[i] = marquise_new_source(fields, values, 5);
+		if (t->sources[i] == NULL) {
+			free_telemetry(t);
+			return NULL;
+		}
+		gchar *id = g_strdup_printf("hostname:%s,metric:%s,namespace:%s,service:libmarquise,unit:%s",
+		                            hostname, metrics[i].name, ctx->marquise_namespace, metrics[i].unit);
+		t->addresses[i] = marquise_hash_identifier((const unsigned char *)id, strlen(id));
+		g_free(id);
+	}
+
+	marquise_get_stats(ctx, &t->last);
+	t->last_time = g_get_monotonic_time();
+	t->thread = g_thread_new("marquise-telemetry", telemetry_thread, t);
+	return t;
+}
+
+void telemetry_stop(struct marquise_telemetry *t)
+{
+	if (t == NULL) {
+		return;
+	}
+	g_mutex_lock(&t->lock);
+	t->stopping = true;
+	g_cond_broadcast(&t->cond);
+	g_mutex_unlock(&t->lock);
+	g_thread_join(t->thread);
+	free_telemetry(t);
+}
@@ -0,0 +1,30 @@
+/* This file is part of libmarquise.
+ *
+ * Copyright 2014 Anchor Systems Pty Ltd and others.
+ *
+ * The code in this file, and the program it is a part of, is made
+ * available to you by its authors as open source software: you can
+ * redistribute it and/or modify it under the terms of the BSD license.
+ */
+
+/* Self-telemetry: a thread which, every interval, sends the context's
+ * own throughput, rotations, source cache hit rate and write latency
+ * percentiles as simple points through the context itself, under
+ * addresses hashed from well-known identifiers. The matching source
+ * dicts are sent the first time round.
+ *
+ * Each identifier is "hostname:<host>,metric:<name>,namespace:<ns>,
+ * service:libmarquise,unit:<unit>", with the metrics listed in
+ * telemetry.c.
+ */
+
+#include <stdint.h>
+
+struct marquise_telemetry;
+
+/* Start sending ctx's metrics every interval microseconds. Returns NULL
+ * if the identifiers can't be built. */
+struct marquise_telemetry *telemetry_start(marquise_ctx *ctx, gint64 interval);
+
+/* Stop the thread and free t. Safe to call with NULL. */
+void telemetry_stop(struct marquise_telemetry *t);
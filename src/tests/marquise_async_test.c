@@ -0,0 +1,145 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../marquise.h"
+#include "marquise_test.h"
+
+#define SIMPLE_ADDRESS   1234567890123456780
+#define SIMPLE_TIMESTAMP 1405392588998566144
+#define SIMPLE_VALUE     133713371337
+#define EXTENDED_ADDRESS   1234567890999999999
+#define EXTENDED_TIMESTAMP 1405392588999999999
+#define EXTENDED_VALUE     "This is data これはデータ and Sinhala ශුද්ධ සිංහල"
+#define EXTENDED_VALUE_LEN sizeof(EXTENDED_VALUE)-1
+
+off_t spool_size(const char *path) {
+	struct stat spool_stat;
+	if (stat(path, &spool_stat) != 0) {
+		return -1;
+	}
+	return spool_stat.st_size;
+}
+
+void test_async_flush() {
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_ASYNC", "1", "MARQUISE_ASYNC_FLUSH_INTERVAL", "50", NULL);
+	if (ctx == NULL) {
+		return;
+	}
+
+	if (marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE) != 0) {
+		perror("marquise_send_simple failed");
+		g_test_fail();
+		return;
+	}
+	if (marquise_send_extended(ctx, EXTENDED_ADDRESS, EXTENDED_TIMESTAMP, EXTENDED_VALUE, EXTENDED_VALUE_LEN) != 0) {
+		perror("marquise_send_extended failed");
+		g_test_fail();
+		return;
+	}
+	if (marquise_flush(ctx) != 0) {
+		perror("marquise_flush failed");
+		g_test_fail();
+		return;
+	}
+	if (spool_size(ctx->writer_points.tmp_path) != 24 + 24 + EXTENDED_VALUE_LEN) {
+		printf("marquise_flush did not drain the queue\n");
+		g_test_fail();
+		return;
+	}
+	marquise_shutdown(ctx);
+}
+
+void test_async_deadline() {
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_ASYNC", "1", "MARQUISE_ASYNC_FLUSH_INTERVAL", "50", NULL);
+	if (ctx == NULL) {
+		return;
+	}
+
+	if (marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE) != 0) {
+		perror("marquise_send_simple failed");
+		g_test_fail();
+		return;
+	}
+	/* The flusher has to pick this up by itself within the interval. */
+	int i;
+	for (i = 0; i < 100 && spool_size(ctx->writer_points.tmp_path) != 24; i++) {
+		usleep(10000);
+	}
+	if (spool_size(ctx->writer_points.tmp_path) != 24) {
+		printf("flusher thread did not write the frame within its deadline\n");
+		g_test_fail();
+		return;
+	}
+	marquise_shutdown(ctx);
+}
+
+void test_async_shutdown_drains() {
+	int i;
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_ASYNC", "1", "MARQUISE_ASYNC_FLUSH_INTERVAL", "50", NULL);
+	if (ctx == NULL) {
+		return;
+	}
+
+	for (i = 0; i < 1000; i++) {
+		marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + i, SIMPLE_VALUE);
+	}
+	char *spool_path = strdup(ctx->spool_path_points);
+	if (marquise_shutdown_timeout(ctx, 10000) != 0) {
+		perror("marquise_shutdown_timeout failed");
+		g_test_fail();
+		return;
+	}
+	if (spool_size(spool_path) != 1000 * 24) {
+		printf("marquise_shutdown_timeout did not drain the queue\n");
+		g_test_fail();
+		return;
+	}
+	free(spool_path);
+}
+
+/* A flusher stuck in a write mustn't hold up a shutdown with a timeout.
+ * Holding write_lock stands in for a write that never returns. */
+void test_async_shutdown_stuck() {
+	int i;
+	/* The rotator would want write_lock too. */
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_ASYNC", "1", "MARQUISE_ROTATE_AGE", "0", NULL);
+	if (ctx == NULL) {
+		return;
+	}
+
+	marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE);
+	char *lock_path = strdup(ctx->lock_path);
+	GMutex *write_lock = &ctx->write_lock;
+	g_mutex_lock(write_lock);
+	gint64 start = g_get_monotonic_time();
+	int ret = marquise_shutdown_timeout(ctx, 100);
+	int saved_errno = errno;
+	gint64 elapsed = g_get_monotonic_time() - start;
+	/* The flusher finishes off the context once it gets the lock. */
+	g_mutex_unlock(write_lock);
+	g_assert_cmpint(ret, ==, -1);
+	g_assert_cmpint(saved_errno, ==, ETIMEDOUT);
+	g_assert_cmpint(elapsed, <, 5 * G_USEC_PER_SEC);
+
+	for (i = 0; i < 500 && access(lock_path, F_OK) == 0; i++) {
+		usleep(10000);
+	}
+	if (access(lock_path, F_OK) == 0) {
+		printf("namespace was not released after the stuck write\n");
+		g_test_fail();
+	}
+	free(lock_path);
+}
+
+int main(int argc, char **argv) {
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/marquise_async/flush", test_async_flush);
+	g_test_add_func("/marquise_async/deadline", test_async_deadline);
+	g_test_add_func("/marquise_async/shutdown_drains", test_async_shutdown_drains);
+	g_test_add_func("/marquise_async/shutdown_stuck", test_async_shutdown_stuck);
+	return g_test_run();
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "../marquise.h"
 
@@ -20,6 +21,7 @@ void test_cache() {
 	/* Initialise context */
 	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
 	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SOURCE_CACHE_PERSIST", "0", 1);
 	marquise_ctx *ctx = marquise_init("marquisetest");
 	if (ctx == NULL) {
 		perror("marquise_init failed");
@@ -91,6 +93,14 @@ void test_cache() {
 		return;
 	}
 
+	/* One repeat, two new source dicts. */
+	marquise_cache_stats stats;
+	marquise_source_cache_stats(ctx, &stats);
+	g_assert_cmpuint(stats.hits, ==, 1);
+	g_assert_cmpuint(stats.misses, ==, 2);
+	g_assert_cmpuint(stats.evictions, ==, 0);
+	g_assert_cmpuint(stats.entries, ==, 2);
+
 	/* Cleanup */
 	free(init_path);
 	marquise_free_source(test_src);
@@ -102,8 +112,65 @@ void test_cache() {
 	}
 }
 
+/* Send test_src with a fresh context, returning the number of bytes
+ * it put in the contents spool, or -1 on failure. */
+long send_once(marquise_source *test_src) {
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	if (ctx == NULL) {
+		perror("marquise_init failed");
+		return -1;
+	}
+	if (marquise_update_source(ctx, TEST_ADDRESS, test_src) != 0) {
+		perror("marquise_update_source failed");
+		marquise_shutdown(ctx);
+		return -1;
+	}
+	long written = ctx->bytes_written_contents;
+	if (marquise_shutdown(ctx) != 0) {
+		perror("marquise_shutdown failed");
+		return -1;
+	}
+	return written;
+}
+
+/* The cache carries over to the next context for the namespace, unless
+ * its file has been damaged. */
+void test_cache_persist() {
+	char* fields[2] = { "persist", "pid" };
+	char pid[32];
+	snprintf(pid, sizeof(pid), "%d", getpid());
+	char* values[2] = { "yes", pid };
+
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SOURCE_CACHE_PERSIST", "1", 1);
+	marquise_source *test_src = marquise_new_source(fields, values, 2);
+	g_assert(test_src != NULL);
+
+	g_assert_cmpint(send_once(test_src), >, 0);
+	g_assert_cmpint(send_once(test_src), ==, 0);
+
+	/* Flip a bit in the middle of the table. */
+	FILE *cache = fopen("/tmp/marquisetest/source_cache", "r+");
+	g_assert(cache != NULL);
+	g_assert(fseek(cache, 0, SEEK_END) == 0);
+	long len = ftell(cache);
+	g_assert(fseek(cache, len / 2, SEEK_SET) == 0);
+	int byte = fgetc(cache);
+	g_assert(fseek(cache, len / 2, SEEK_SET) == 0);
+	fputc(byte ^ 0x10, cache);
+	fclose(cache);
+
+	g_assert_cmpint(send_once(test_src), >, 0);
+	g_assert_cmpint(send_once(test_src), ==, 0);
+
+	marquise_free_source(test_src);
+	unsetenv("MARQUISE_SOURCE_CACHE_PERSIST");
+}
+
 int main(int argc, char **argv) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/marquise_cache/cache", test_cache);
+	g_test_add_func("/marquise_cache/cache_persist", test_cache_persist);
 	return g_test_run();
 }
@@ -0,0 +1,274 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "../marquise.h"
+#include "marquise_test.h"
+
+/* Be careful with the addresses we write, the LSB will be cleared for
+   simple points and set for extended points. Simple addresses go up in
+   steps of two, so that the decoded series come back in this order. */
+#define SIMPLE_ADDRESS   1234567890123456780
+#define SIMPLE_TIMESTAMP 1405392588998566144
+#define SIMPLE_INTERVAL  10000000000
+#define N_ADDRESSES      3
+#define N_POINTS         500
+#define EXTENDED_ADDRESS   1234567890999999999
+#define EXTENDED_TIMESTAMP 1405392588999999999
+#define EXTENDED_VALUE     "This is data これはデータ and Sinhala ශුද්ධ සිංහල"
+#define EXTENDED_VALUE_LEN sizeof(EXTENDED_VALUE)-1
+
+/* Read 64 bits from little-endian byte array p, make a 64-bit value. */
+#define LE8TOU64(v, p) v = \
+	(((uint64_t)p[0])      ) + \
+	(((uint64_t)p[1]) <<  8) + \
+	(((uint64_t)p[2]) << 16) + \
+	(((uint64_t)p[3]) << 24) + \
+	(((uint64_t)p[4]) << 32) + \
+	(((uint64_t)p[5]) << 40) + \
+	(((uint64_t)p[6]) << 48) + \
+	(((uint64_t)p[7]) << 56)
+
+/* Shut ctx down and read back the points spool file it published. */
+gchar *shutdown_and_read(marquise_ctx *ctx, gsize *len) {
+	gchar *contents;
+	char *written_spool_path = strdup(ctx->spool_path_points);
+	if (marquise_shutdown(ctx) != 0) {
+		printf("marquise_shutdown failed: %s\n", strerror(errno));
+		free(written_spool_path);
+		g_test_fail();
+		return NULL;
+	}
+	if (!g_file_get_contents(written_spool_path, &contents, len, NULL)) {
+		printf("failed to read back spool file %s\n", written_spool_path);
+		free(written_spool_path);
+		g_test_fail();
+		return NULL;
+	}
+	free(written_spool_path);
+	return contents;
+}
+
+/* Check the point decoded at p. */
+void check_point(const uint8_t *p, uint64_t want_address, uint64_t want_timestamp, uint64_t want_value) {
+	uint64_t address;
+	uint64_t timestamp;
+	uint64_t value;
+	LE8TOU64(address,    p);
+	LE8TOU64(timestamp, (p+8));
+	LE8TOU64(value,     (p+16));
+	g_assert_cmpuint(address, ==, want_address);
+	g_assert_cmpuint(timestamp, ==, want_timestamp);
+	g_assert_cmpuint(value, ==, want_value);
+}
+
+uint64_t simple_value(int a, int i) {
+	/* A counter for the first address, a gauge wandering either side
+	 * of a level for the others. */
+	if (a == 0) {
+		return 133713371337 + (uint64_t)i * 1000;
+	}
+	return 5000 + (i * 7919 % 13) - 6 + a;
+}
+
+void check_compact_write_readback() {
+	int a, i;
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_SPOOL_FORMAT", "compact", NULL);
+	if (ctx == NULL) {
+		return;
+	}
+
+	// Interleave the series, as a collector would send them
+	for (i = 0; i < N_POINTS; i++) {
+		for (a = 0; a < N_ADDRESSES; a++) {
+			uint64_t timestamp = SIMPLE_TIMESTAMP + (uint64_t)i * SIMPLE_INTERVAL + a;
+			if (marquise_send_simple(ctx, SIMPLE_ADDRESS + 2 * a, timestamp, simple_value(a, i)) != 0) {
+				printf("marquise_send_simple failed: %s\n", strerror(errno));
+				g_test_fail();
+				return;
+			}
+		}
+	}
+
+	// An extended point, in fragments
+	char *value = EXTENDED_VALUE;
+	struct iovec fragments[2];
+	fragments[0].iov_base = value;
+	fragments[0].iov_len = 5;
+	fragments[1].iov_base = value + 5;
+	fragments[1].iov_len = EXTENDED_VALUE_LEN - 5;
+	if (marquise_send_extended_iov(ctx, EXTENDED_ADDRESS, EXTENDED_TIMESTAMP, fragments, 2) != 0) {
+		printf("marquise_send_extended_iov failed: %s\n", strerror(errno));
+		g_test_fail();
+		return;
+	}
+
+	gsize len;
+	gchar *contents = shutdown_and_read(ctx, &len);
+	if (contents == NULL) {
+		return;
+	}
+
+	// Self-describing, and much smaller than the frames it holds
+	size_t raw_len = N_ADDRESSES * N_POINTS * 24 + 24 + EXTENDED_VALUE_LEN;
+	g_assert(memcmp(contents, "MQPC\001", 5) == 0);
+	g_assert_cmpuint(len * 4, <, raw_len);
+
+	size_t decoded_len;
+	uint8_t *decoded = marquise_compact_decode((uint8_t *)contents, len, &decoded_len);
+	if (decoded == NULL) {
+		printf("marquise_compact_decode failed: %s\n", strerror(errno));
+		g_free(contents);
+		g_test_fail();
+		return;
+	}
+	g_assert_cmpuint(decoded_len, ==, raw_len);
+
+	// Each series in turn, then the extended point
+	uint8_t *p = decoded;
+	for (a = 0; a < N_ADDRESSES; a++) {
+		for (i = 0; i < N_POINTS; i++) {
+			check_point(p, SIMPLE_ADDRESS + 2 * a,
+			            SIMPLE_TIMESTAMP + (uint64_t)i * SIMPLE_INTERVAL + a,
+			            simple_value(a, i));
+			p += 24;
+		}
+	}
+	check_point(p, EXTENDED_ADDRESS, EXTENDED_TIMESTAMP, EXTENDED_VALUE_LEN);
+	g_assert(memcmp(p + 24, EXTENDED_VALUE, EXTENDED_VALUE_LEN) == 0);
+
+	free(decoded);
+	g_free(contents);
+}
+
+void test_compact_write_readback() {
+	check_compact_write_readback();
+}
+
+/* The same again with blocks stored into a mapped segment. */
+void test_compact_write_readback_mmap() {
+	setenv("MARQUISE_SPOOL_WRITER", "mmap", 1);
+	check_compact_write_readback();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
+/* Enough points for several blocks, with timestamps going backwards
+ * and values jumping across the whole range, still come back exactly,
+ * in the order they were sent. */
+void test_compact_irregular() {
+	int i;
+	int n = 20000;
+	marquise_point *pts = malloc(n * sizeof(marquise_point));
+	g_assert(pts != NULL);
+	uint64_t x = 88172645463325252ULL;
+	for (i = 0; i < n; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		pts[i].address = SIMPLE_ADDRESS;
+		pts[i].timestamp = (i % 3 == 0) ? x : SIMPLE_TIMESTAMP - (uint64_t)i;
+		pts[i].value = (i % 2 == 0) ? x * 31 : i;
+	}
+
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_SPOOL_FORMAT", "compact", NULL);
+	if (ctx == NULL) {
+		free(pts);
+		return;
+	}
+	if (marquise_send_simple_batch(ctx, pts, n / 2) != 0 ||
+	    marquise_send_simple_batch(ctx, pts + n / 2, n - n / 2) != 0) {
+		printf("marquise_send_simple_batch failed: %s\n", strerror(errno));
+		free(pts);
+		g_test_fail();
+		return;
+	}
+	gsize len;
+	gchar *contents = shutdown_and_read(ctx, &len);
+	if (contents == NULL) {
+		free(pts);
+		return;
+	}
+
+	size_t decoded_len;
+	uint8_t *decoded = marquise_compact_decode((uint8_t *)contents, len, &decoded_len);
+	g_assert(decoded != NULL);
+	g_assert_cmpuint(decoded_len, ==, n * 24);
+	for (i = 0; i < n; i++) {
+		check_point(decoded + 24 * i, pts[i].address, pts[i].timestamp, pts[i].value);
+	}
+
+	free(decoded);
+	g_free(contents);
+	free(pts);
+}
+
+/* Anything that isn't a whole compact spool file is turned away. */
+void test_compact_decode_invalid() {
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_SPOOL_FORMAT", "compact", NULL);
+	if (ctx == NULL) {
+		return;
+	}
+	g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, 1), ==, 0);
+	g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + 1, 2), ==, 0);
+	gsize len;
+	gchar *contents = shutdown_and_read(ctx, &len);
+	if (contents == NULL) {
+		return;
+	}
+	uint8_t *buf = (uint8_t *)contents;
+	size_t decoded_len;
+
+	// Cut short anywhere past the file header
+	size_t cut;
+	for (cut = 9; cut < len; cut++) {
+		errno = 0;
+		g_assert(marquise_compact_decode(buf, cut, &decoded_len) == NULL);
+		g_assert_cmpint(errno, ==, EINVAL);
+	}
+
+	// A version from the future
+	buf[4]++;
+	errno = 0;
+	g_assert(marquise_compact_decode(buf, len, &decoded_len) == NULL);
+	g_assert_cmpint(errno, ==, EINVAL);
+	buf[4]--;
+
+	// Not a compact file at all
+	buf[0] = 'X';
+	errno = 0;
+	g_assert(marquise_compact_decode(buf, len, &decoded_len) == NULL);
+	g_assert_cmpint(errno, ==, EINVAL);
+	buf[0] = 'M';
+
+	// Just the file header is a file with nothing in it
+	uint8_t *decoded = marquise_compact_decode(buf, 8, &decoded_len);
+	g_assert(decoded != NULL);
+	g_assert_cmpuint(decoded_len, ==, 0);
+	free(decoded);
+
+	g_free(contents);
+}
+
+/* A format we don't know is refused. */
+void test_compact_unknown_format() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SPOOL_FORMAT", "gorilla", 1);
+	errno = 0;
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	unsetenv("MARQUISE_SPOOL_FORMAT");
+	g_assert(ctx == NULL);
+	g_assert_cmpint(errno, ==, EINVAL);
+}
+
+int main(int argc, char **argv) {
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/marquise_compact_write_readback/compact_write_readback", test_compact_write_readback);
+	g_test_add_func("/marquise_compact_write_readback/compact_write_readback_mmap", test_compact_write_readback_mmap);
+	g_test_add_func("/marquise_compact_write_readback/compact_irregular", test_compact_irregular);
+	g_test_add_func("/marquise_compact_write_readback/compact_decode_invalid", test_compact_decode_invalid);
+	g_test_add_func("/marquise_compact_write_readback/compact_unknown_format", test_compact_unknown_format);
+	return g_test_run();
+}
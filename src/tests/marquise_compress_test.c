@@ -0,0 +1,231 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../marquise.h"
+#include "marquise_test.h"
+
+#define SIMPLE_ADDRESS   1234567890123456780
+#define EXTENDED_ADDRESS 1234567890999999999
+#define TIMESTAMP        1405392588998566144
+#define N_POINTS         2000
+#define BLOCK_SIZE       "4096"
+
+/* Write the 64-bit value in v to the little-endian byte array p. */
+#define U64TOLE8(p, v) do {                           \
+	int _i;                                       \
+	for (_i = 0; _i < 8; _i++) {                  \
+		(p)[_i] = (uint8_t)((uint64_t)(v) >> (8 * _i)); \
+	}                                             \
+} while (0)
+
+/* A context writing blocks of BLOCK_SIZE bytes compressed with codec. */
+marquise_ctx *init_compressed(const char *codec) {
+	return init_test_ctx("MARQUISE_SPOOL_COMPRESSION", codec, "MARQUISE_SPOOL_BLOCK_SIZE", BLOCK_SIZE, NULL);
+}
+
+/* Send a mix of log lines and counters, building up the classic frames
+ * they'd make in expected. Returns the published points spool path. */
+char *send_points(marquise_ctx *ctx, GByteArray *expected) {
+	int i;
+	for (i = 0; i < N_POINTS; i++) {
+		uint8_t header[24];
+		uint64_t timestamp = TIMESTAMP + (uint64_t)i * 1000000000;
+		if (i % 4 == 0) {
+			gchar *line = g_strdup_printf("{\"level\":\"info\",\"msg\":\"request served\",\"path\":\"/api/v1/items/%d\",\"status\":200}", i % 37);
+			size_t len = strlen(line);
+			g_assert_cmpint(marquise_send_extended(ctx, EXTENDED_ADDRESS, timestamp, line, len), ==, 0);
+			U64TOLE8(header, EXTENDED_ADDRESS);
+			U64TOLE8(header + 8, timestamp);
+			U64TOLE8(header + 16, len);
+			g_byte_array_append(expected, header, 24);
+			g_byte_array_append(expected, (uint8_t *)line, len);
+			g_free(line);
+		} else {
+			g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, timestamp, i), ==, 0);
+			U64TOLE8(header, SIMPLE_ADDRESS);
+			U64TOLE8(header + 8, timestamp);
+			U64TOLE8(header + 16, i);
+			g_byte_array_append(expected, header, 24);
+		}
+	}
+	return strdup(ctx->spool_path_points);
+}
+
+/* Read the whole of a block-compressed file back, a few bytes at a time
+ * so that reads straddle blocks. */
+GByteArray *read_back(const char *path) {
+	marquise_block_reader *r = marquise_block_reader_open(path);
+	if (r == NULL) {
+		printf("marquise_block_reader_open failed: %s\n", strerror(errno));
+		g_test_fail();
+		return NULL;
+	}
+	GByteArray *got = g_byte_array_new();
+	uint8_t buf[1000];
+	ssize_t n;
+	while ((n = marquise_block_read(r, buf, sizeof(buf))) > 0) {
+		g_byte_array_append(got, buf, n);
+	}
+	g_assert_cmpint(n, ==, 0);
+	marquise_block_reader_close(r);
+	return got;
+}
+
+void check_compress_readback(const char *codec) {
+	marquise_ctx *ctx = init_compressed(codec);
+	if (ctx == NULL) {
+		return;
+	}
+	GByteArray *expected = g_byte_array_new();
+	char *path = send_points(ctx, expected);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+
+	struct stat st;
+	g_assert_cmpint(stat(path, &st), ==, 0);
+	g_assert_cmpint(st.st_size * 4, <, expected->len);
+
+	GByteArray *got = read_back(path);
+	if (got != NULL) {
+		g_assert_cmpuint(got->len, ==, expected->len);
+		g_assert(memcmp(got->data, expected->data, expected->len) == 0);
+		g_byte_array_free(got, TRUE);
+	}
+	g_byte_array_free(expected, TRUE);
+	free(path);
+}
+
+void test_compress_readback_zlib() {
+	check_compress_readback("zlib");
+}
+
+/* zstd and lz4 read back the same, whether or not this build has them
+ * or falls back to another codec. */
+void test_compress_readback_zstd() {
+	check_compress_readback("zstd");
+}
+
+void test_compress_readback_lz4() {
+	check_compress_readback("lz4");
+}
+
+/* Blocks are cut by marquise_flush, so everything sent so far can be
+ * read back while the file is still being written. */
+void test_compress_flush() {
+	marquise_ctx *ctx = init_compressed("zlib");
+	if (ctx == NULL) {
+		return;
+	}
+	GByteArray *expected = g_byte_array_new();
+	free(send_points(ctx, expected));
+	g_assert_cmpint(marquise_flush(ctx), ==, 0);
+
+	GByteArray *got = read_back(ctx->writer_points.tmp_path);
+	if (got != NULL) {
+		g_assert_cmpuint(got->len, ==, expected->len);
+		g_assert(memcmp(got->data, expected->data, expected->len) == 0);
+		g_byte_array_free(got, TRUE);
+	}
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+	g_byte_array_free(expected, TRUE);
+}
+
+/* Damage is reported rather than read past. */
+void test_compress_damaged() {
+	marquise_ctx *ctx = init_compressed("zlib");
+	if (ctx == NULL) {
+		return;
+	}
+	GByteArray *expected = g_byte_array_new();
+	char *path = send_points(ctx, expected);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+	g_byte_array_free(expected, TRUE);
+
+	gchar *contents;
+	gsize len;
+	g_assert(g_file_get_contents(path, &contents, &len, NULL));
+	marquise_block_reader *r;
+	uint8_t buf[4096];
+	ssize_t n;
+	const char *damaged = "/tmp/marquise_compress_test_damaged";
+
+	// Cut short in the middle of a block
+	g_assert(g_file_set_contents(damaged, contents, len - 10, NULL));
+	r = marquise_block_reader_open(damaged);
+	g_assert(r != NULL);
+	while ((n = marquise_block_read(r, buf, sizeof(buf))) > 0);
+	g_assert_cmpint(n, ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	marquise_block_reader_close(r);
+
+	// A flipped bit in the first block's payload
+	contents[8 + 8 + 20] ^= 0x10;
+	g_assert(g_file_set_contents(damaged, contents, len, NULL));
+	r = marquise_block_reader_open(damaged);
+	g_assert(r != NULL);
+	g_assert_cmpint(marquise_block_read(r, buf, sizeof(buf)), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	marquise_block_reader_close(r);
+	contents[8 + 8 + 20] ^= 0x10;
+
+	// A codec we've never heard of
+	contents[5] = 99;
+	g_assert(g_file_set_contents(damaged, contents, len, NULL));
+	errno = 0;
+	g_assert(marquise_block_reader_open(damaged) == NULL);
+	g_assert_cmpint(errno, ==, ENOTSUP);
+
+	// Not a block-compressed file at all
+	contents[0] = 'X';
+	g_assert(g_file_set_contents(damaged, contents, len, NULL));
+	errno = 0;
+	g_assert(marquise_block_reader_open(damaged) == NULL);
+	g_assert_cmpint(errno, ==, EINVAL);
+
+	unlink(damaged);
+	g_free(contents);
+	free(path);
+}
+
+/* A codec we don't know is refused. */
+void test_compress_unknown_codec() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SPOOL_COMPRESSION", "brotli", 1);
+	errno = 0;
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	unsetenv("MARQUISE_SPOOL_COMPRESSION");
+	g_assert(ctx == NULL);
+	g_assert_cmpint(errno, ==, EINVAL);
+}
+
+/* Built without any codec, asking for compression is refused rather
+ * than quietly writing uncompressed files. */
+void test_compress_no_codec() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SPOOL_COMPRESSION", "zlib", 1);
+	errno = 0;
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	unsetenv("MARQUISE_SPOOL_COMPRESSION");
+	g_assert(ctx == NULL);
+	g_assert_cmpint(errno, ==, ENOTSUP);
+}
+
+int main(int argc, char **argv) {
+	g_test_init(&argc, &argv, NULL);
+#ifdef HAVE_SPOOL_CODEC
+	g_test_add_func("/marquise_compress/readback_zlib", test_compress_readback_zlib);
+	g_test_add_func("/marquise_compress/readback_zstd", test_compress_readback_zstd);
+	g_test_add_func("/marquise_compress/readback_lz4", test_compress_readback_lz4);
+	g_test_add_func("/marquise_compress/flush", test_compress_flush);
+	g_test_add_func("/marquise_compress/damaged", test_compress_damaged);
+#else
+	g_test_add_func("/marquise_compress/no_codec", test_compress_no_codec);
+#endif
+	g_test_add_func("/marquise_compress/unknown_codec", test_compress_unknown_codec);
+	return g_test_run();
+}
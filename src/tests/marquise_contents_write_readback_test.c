@@ -22,7 +22,7 @@
 	(((uint64_t)p[7]) << 56)
 
 
-void test_contents_write_readback() {
+void check_contents_write_readback() {
 	int ret;
 	char* fields[3] = { "foo", "bar", "baz" };
 	char* values[3] = { "one", "two", "three" };
@@ -30,6 +30,8 @@ void test_contents_write_readback() {
 	// Init
 	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
 	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	/* Every run has to write the source dict out again. */
+	setenv("MARQUISE_SOURCE_CACHE_PERSIST", "0", 1);
 	marquise_ctx *ctx = marquise_init("marquisetest");
 	if (ctx == NULL) {
 		perror("marquise_init failed");
@@ -162,8 +164,92 @@ void test_contents_write_readback() {
 }
 
 
+void test_contents_write_readback() {
+	check_contents_write_readback();
+}
+
+/* The same again with frames stored into a mapped segment. */
+void test_contents_write_readback_mmap() {
+	setenv("MARQUISE_SPOOL_WRITER", "mmap", 1);
+	check_contents_write_readback();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
+/* And with frames written through an io_uring, or by write() where
+ * libmarquise was built without it. */
+void test_contents_write_readback_io_uring() {
+	setenv("MARQUISE_SPOOL_WRITER", "io_uring", 1);
+	check_contents_write_readback();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
+/* A batch large enough to be spread across the source workers, which
+ * repeats one of its own sources and one already sent. Each new source
+ * should be written exactly once, in order. */
+#define BATCH_SIZE 1000
+
+void test_contents_batch_write_readback() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SOURCE_CACHE_PERSIST", "0", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	g_assert(ctx != NULL);
+
+	uint64_t addresses[BATCH_SIZE];
+	marquise_source *sources[BATCH_SIZE];
+	char value[BATCH_SIZE][16];
+	int i;
+	for (i = 0; i < BATCH_SIZE; i++) {
+		char *fields[1] = { "n" };
+		char *values[1] = { value[i] };
+		/* The last source is the same dict as the sixth. */
+		snprintf(value[i], sizeof(value[i]), "%d", i == BATCH_SIZE - 1 ? 5 : i);
+		addresses[i] = TEST_ADDRESS + 2 * i + 1;
+		sources[i] = marquise_new_source(fields, values, 1);
+		g_assert(sources[i] != NULL);
+	}
+
+	g_assert_cmpint(marquise_update_source(ctx, addresses[0], sources[0]), ==, 0);
+	g_assert_cmpint(marquise_update_sources_batch(ctx, addresses, sources, BATCH_SIZE), ==, 0);
+	/* Nothing new the second time around. */
+	g_assert_cmpint(marquise_update_sources_batch(ctx, addresses, sources, BATCH_SIZE), ==, 0);
+	for (i = 0; i < BATCH_SIZE; i++) {
+		marquise_free_source(sources[i]);
+	}
+
+	char *written_spool_path = strdup(ctx->spool_path_contents);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+
+	gchar *contents;
+	gsize len;
+	g_assert(g_file_get_contents(written_spool_path, &contents, &len, NULL));
+	free(written_spool_path);
+
+	unsigned char *p = (unsigned char *)contents;
+	unsigned char *end = p + len;
+	for (i = 0; i < BATCH_SIZE - 1; i++) {
+		uint64_t address, length;
+		char expected[16];
+		g_assert(end - p >= 16);
+		LE8TOU64(address, p);
+		LE8TOU64(length, (p + 8));
+		p += 16;
+		g_assert_cmpuint(address, ==, addresses[i] >> 1 << 1);
+		g_assert(end - p >= length);
+		snprintf(expected, sizeof(expected), "n:%d", i);
+		g_assert_cmpuint(length, ==, strlen(expected));
+		g_assert(memcmp(p, expected, length) == 0);
+		p += length;
+	}
+	g_assert(p == end);
+	g_free(contents);
+}
+
 int main(int argc, char **argv) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/marquise_contents_write_readback/contents_write_readback", test_contents_write_readback);
+	g_test_add_func("/marquise_contents_write_readback/contents_write_readback_mmap", test_contents_write_readback_mmap);
+	g_test_add_func("/marquise_contents_write_readback/contents_write_readback_io_uring", test_contents_write_readback_io_uring);
+	g_test_add_func("/marquise_contents_write_readback/contents_batch_write_readback", test_contents_batch_write_readback);
 	return g_test_run();
 }
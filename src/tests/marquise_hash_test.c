@@ -3,6 +3,10 @@
 #include <string.h>
 
 #include "../marquise.h"
+#include "../siphash24.h"
+
+extern uint64_t hash_marquise_source(marquise_source *source);
+extern char* serialise_marquise_source(marquise_source *source);
 
 void test_hash_identifier() {
 	const char *id = "hostname:fe1.example.com,metric:BytesUsed,service:memory,";
@@ -18,9 +22,128 @@ void test_hash_clear_lsb() {
 	g_assert_cmpint(address, ==, -8873247187777138600);
 }
 
+/* Feeding siphash_update in pieces of every size gives the one-shot
+ * result, whatever the alignment of the pieces. */
+void test_siphash_incremental() {
+	unsigned char key[16];
+	unsigned char msg[64];
+	int i;
+	for (i = 0; i < 16; i++) {
+		key[i] = i;
+	}
+	for (i = 0; i < 64; i++) {
+		msg[i] = i * 7 + 3;
+	}
+	size_t len, piece;
+	for (len = 0; len <= 64; len++) {
+		uint64_t expected = siphash(msg, len, key);
+		for (piece = 1; piece <= 9; piece++) {
+			siphash_state state;
+			siphash_init(&state, key);
+			size_t done = 0;
+			while (done < len) {
+				size_t n = len - done < piece ? len - done : piece;
+				siphash_update(&state, msg + done, n);
+				siphash_update(&state, msg + done, 0);
+				done += n;
+			}
+			g_assert_cmpuint(siphash_final(&state), ==, expected);
+		}
+	}
+}
+
+/* Hashing a source dict in place matches hashing its serialisation. */
+void test_hash_source() {
+	char* fields[3] = { "hostname", "metric", "service" };
+	char* values[3] = { "fe1.example.com", "BytesUsed", "memory" };
+	size_t n;
+	for (n = 1; n <= 3; n++) {
+		marquise_source *source = marquise_new_source(fields, values, n);
+		g_assert(source != NULL);
+		char *serialised = serialise_marquise_source(source);
+		g_assert(serialised != NULL);
+		uint64_t expected = marquise_hash_identifier((const unsigned char*) serialised, strlen(serialised));
+		g_assert_cmpuint(hash_marquise_source(source), ==, expected);
+		free(serialised);
+		marquise_free_source(source);
+	}
+}
+
+/* Every batch implementation this CPU runs agrees with siphash(), for
+ * batches of every size up to a few vectors and lengths which don't
+ * line up across lanes. */
+void check_batch(void (*batch)(const unsigned char *const *, const size_t *, size_t,
+                               const unsigned char *, uint64_t *)) {
+	unsigned char key[16];
+	unsigned char msg[100];
+	const unsigned char *in[11];
+	size_t inlen[11];
+	uint64_t out[11];
+	int i;
+	for (i = 0; i < 16; i++) {
+		key[i] = 15 - i;
+	}
+	for (i = 0; i < 100; i++) {
+		msg[i] = i * 13 + 1;
+	}
+	size_t n, shift;
+	for (n = 0; n <= 11; n++) {
+		for (shift = 0; shift < 20; shift++) {
+			for (i = 0; i < n; i++) {
+				inlen[i] = (i * 17 + shift * 5) % 90;
+				in[i] = msg + (i + shift) % 10;
+			}
+			out[n < 11 ? n : 10] = 0xdeadbeef;
+			batch(in, inlen, n, key, out);
+			for (i = 0; i < n; i++) {
+				g_assert_cmpuint(out[i], ==, siphash(in[i], inlen[i], key));
+			}
+			if (n < 11) {
+				g_assert_cmpuint(out[n], ==, 0xdeadbeef);
+			}
+		}
+	}
+}
+
+void test_siphash_batch() {
+	check_batch(siphash_batch_scalar);
+	check_batch(siphash_batch);
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		check_batch(siphash_batch_sse2);
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		check_batch(siphash_batch_avx2);
+	}
+#endif
+}
+
+void test_hash_identifiers_batch() {
+	const char *ids[3] = {
+		"hostname:fe1.example.com,metric:BytesUsed,service:memory,",
+		"bytes:tx,collection_point:syd1,ip:110.173.152.33,",
+		"",
+	};
+	size_t id_lens[3];
+	uint64_t addresses[3];
+	int i;
+	for (i = 0; i < 3; i++) {
+		id_lens[i] = strlen(ids[i]);
+	}
+	marquise_hash_identifiers_batch((const unsigned char *const *) ids, id_lens, 3, addresses);
+	g_assert_cmpint(addresses[0], ==, 7602883380529707052);
+	g_assert_cmpint(addresses[1], ==, -8873247187777138600);
+	g_assert_cmpuint(addresses[2], ==, marquise_hash_identifier((const unsigned char *) "", 0));
+}
+
 int main(int argc, char **argv) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/marquise_hash_identifier/hash", test_hash_identifier);
 	g_test_add_func("/marquise_hash_identifier/clear_lsb", test_hash_clear_lsb);
+	g_test_add_func("/marquise_hash_identifier/siphash_incremental", test_siphash_incremental);
+	g_test_add_func("/marquise_hash_identifier/hash_source", test_hash_source);
+	g_test_add_func("/marquise_hash_identifier/siphash_batch", test_siphash_batch);
+	g_test_add_func("/marquise_hash_identifier/hash_identifiers_batch", test_hash_identifiers_batch);
 	return g_test_run();
 }
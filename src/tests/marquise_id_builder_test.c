@@ -0,0 +1,75 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../marquise.h"
+
+#define TEST_IDENTIFIER "hostname:fe1.example.com,metric:BytesUsed,service:memory,"
+
+/* Every split of an identifier into prefix and suffix hashes to the
+ * same address as the whole identifier. */
+void test_builder_matches() {
+	const unsigned char *id = (const unsigned char *) TEST_IDENTIFIER;
+	size_t id_len = strlen(TEST_IDENTIFIER);
+	uint64_t expected = marquise_hash_identifier(id, id_len);
+	g_assert_cmpint(expected, ==, 7602883380529707052);
+
+	size_t split;
+	for (split = 0; split <= id_len; split++) {
+		marquise_id_builder *b = marquise_id_builder_new(id, split, 0);
+		g_assert(b != NULL);
+		g_assert_cmpuint(marquise_id_builder_hash(b, id + split, id_len - split), ==, expected);
+		/* The prefix state isn't disturbed by hashing a suffix. */
+		g_assert_cmpuint(marquise_id_builder_hash(b, id + split, id_len - split), ==, expected);
+		marquise_id_builder_free(b);
+	}
+}
+
+void test_builder_extend() {
+	const unsigned char *id = (const unsigned char *) TEST_IDENTIFIER;
+	size_t id_len = strlen(TEST_IDENTIFIER);
+	uint64_t expected = marquise_hash_identifier(id, id_len);
+
+	marquise_id_builder *host = marquise_id_builder_new(id, 9, 16);
+	g_assert(host != NULL);
+	marquise_id_builder *metric = marquise_id_builder_extend(host, id + 9, 22);
+	g_assert(metric != NULL);
+	g_assert_cmpuint(marquise_id_builder_hash(metric, id + 31, id_len - 31), ==, expected);
+	g_assert_cmpuint(marquise_id_builder_hash(host, id + 9, id_len - 9), ==, expected);
+	marquise_id_builder_free(metric);
+	marquise_id_builder_free(host);
+}
+
+/* The cache answers repeats, and never confuses suffixes which land in
+ * the same slot. */
+void test_builder_cache() {
+	const char *prefix = "hostname:web17.example.com,service:cpu,metric:";
+	marquise_id_builder *b = marquise_id_builder_new((const unsigned char *) prefix, strlen(prefix), 4);
+	g_assert(b != NULL);
+
+	int round, i;
+	for (round = 0; round < 3; round++) {
+		for (i = 0; i < 20; i++) {
+			char suffix[32];
+			char whole[128];
+			int suffix_len = snprintf(suffix, sizeof(suffix), "core%d,", i % 6);
+			int whole_len = snprintf(whole, sizeof(whole), "%s%s", prefix, suffix);
+			g_assert_cmpuint(marquise_id_builder_hash(b, (const unsigned char *) suffix, suffix_len), ==,
+			                 marquise_hash_identifier((const unsigned char *) whole, whole_len));
+		}
+	}
+	uint64_t hits, misses;
+	marquise_id_builder_stats(b, &hits, &misses);
+	g_assert_cmpuint(hits + misses, ==, 60);
+	g_assert_cmpuint(hits, >, 0);
+	marquise_id_builder_free(b);
+}
+
+int main(int argc, char **argv) {
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/marquise_id_builder/matches", test_builder_matches);
+	g_test_add_func("/marquise_id_builder/extend", test_builder_extend);
+	g_test_add_func("/marquise_id_builder/cache", test_builder_cache);
+	return g_test_run();
+}
@@ -90,12 +90,76 @@ void test_disable_namespace_lock() {
 	marquise_shutdown(ctx2);
 }
 
+void test_options_env_default() {
+	marquise_options opts;
+	setenv("MARQUISE_ROTATE_SIZE", "1234", 1);
+	setenv("MARQUISE_ASYNC", "1", 1);
+	marquise_options_init(&opts);
+	g_assert_cmpuint(opts.rotate_size, ==, 1234);
+	g_assert(opts.async);
+
+	/* What won't parse leaves the default. */
+	setenv("MARQUISE_ROTATE_SIZE", "12x", 1);
+	marquise_options_init(&opts);
+	g_assert_cmpuint(opts.rotate_size, ==, MARQUISE_ROTATE_SIZE);
+	unsetenv("MARQUISE_ROTATE_SIZE");
+	unsetenv("MARQUISE_ASYNC");
+}
+
+void test_options_set() {
+	marquise_options opts;
+	marquise_options_init(&opts);
+	g_assert_cmpint(marquise_options_set(&opts, "MARQUISE_ROTATE_AGE", "250"), ==, 0);
+	g_assert_cmpuint(opts.rotate_age, ==, 250);
+	g_assert_cmpint(marquise_options_set(&opts, "MARQUISE_SOURCE_CACHE_PERSIST", "0"), ==, 0);
+	g_assert(!opts.source_cache_persist);
+	g_assert_cmpint(marquise_options_set(&opts, "MARQUISE_DURABILITY", "group"), ==, 0);
+	g_assert_cmpstr(opts.durability, ==, "group");
+
+	errno = 0;
+	g_assert_cmpint(marquise_options_set(&opts, "MARQUISE_NO_SUCH_OPTION", "1"), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	errno = 0;
+	g_assert_cmpint(marquise_options_set(&opts, "MARQUISE_ROTATE_AGE", "-1"), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	errno = 0;
+	g_assert_cmpint(marquise_options_set(&opts, "MARQUISE_ROTATE_AGE", ""), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	g_assert_cmpuint(opts.rotate_age, ==, 250);
+}
+
+void test_init_opts() {
+	marquise_options opts;
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SPOOL_WRITER", "nonsense", 1);
+
+	/* Without options, the settings come from the environment... */
+	errno = 0;
+	g_assert(marquise_init_opts("marquisetest7", NULL) == NULL);
+	g_assert_cmpint(errno, ==, EINVAL);
+
+	/* ...which only supplies the defaults for options passed in. */
+	marquise_options_init(&opts);
+	opts.spool_writer = "write";
+	marquise_ctx *ctx = marquise_init_opts("marquisetest7", &opts);
+	if (ctx == NULL) {
+		printf("marquise_init failed: %s\n", strerror(errno));
+		g_test_fail();
+	}
+	marquise_shutdown(ctx);
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
 int main(int argc, char **argv) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/marquise_init/init", test_init);
 	g_test_add_func("/marquise_init/init_no_dir", test_init_no_dir);
 	g_test_add_func("/marquise_init/lock_dir", test_lock_dir);
 	g_test_add_func("/marquise_init/lock_dir_twice", test_lock_dir_twice);
+	g_test_add_func("/marquise_init/options_env_default", test_options_env_default);
+	g_test_add_func("/marquise_init/options_set", test_options_set);
+	g_test_add_func("/marquise_init/init_opts", test_init_opts);
 	g_test_add_func("/marquise_init/disable_namespace_lock", test_disable_namespace_lock);
 	return g_test_run();
 }
@@ -28,7 +28,7 @@
 	(((uint64_t)p[7]) << 56)
 
 
-void test_points_write_readback() {
+void check_points_write_readback() {
 	int ret;
 
 	// Init
@@ -208,8 +208,109 @@ void test_points_write_readback() {
 	}
 }
 
+void test_points_write_readback() {
+	check_points_write_readback();
+}
+
+/* The same again with frames stored into a mapped segment. */
+void test_points_write_readback_mmap() {
+	setenv("MARQUISE_SPOOL_WRITER", "mmap", 1);
+	check_points_write_readback();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
+/* And with frames written through an io_uring, or by write() where
+ * libmarquise was built without it. */
+void test_points_write_readback_io_uring() {
+	setenv("MARQUISE_SPOOL_WRITER", "io_uring", 1);
+	check_points_write_readback();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
+/* Asking for an io_uring too deep for any kernel to set up gets the
+ * ordinary writer, which works as usual. */
+void test_points_write_readback_io_uring_fallback() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SPOOL_WRITER", "io_uring", 1);
+	setenv("MARQUISE_IO_URING_DEPTH", "100000", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	g_assert(ctx != NULL);
+	g_assert(ctx->uring == NULL);
+	g_assert_cmpint(ctx->writer_mode, ==, SPOOL_WRITER_WRITE);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+	check_points_write_readback();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+	unsetenv("MARQUISE_IO_URING_DEPTH");
+}
+
+/* An extended point sent in fragments reads back as one frame. */
+void test_points_write_readback_iov() {
+	int ret;
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	if (ctx == NULL) {
+		printf("marquise_init failed: %s\n", strerror(errno));
+		g_test_fail();
+		return;
+	}
+
+	char *value = EXTENDED_VALUE;
+	struct iovec fragments[3];
+	fragments[0].iov_base = value;
+	fragments[0].iov_len = 5;
+	fragments[1].iov_base = value + 5;
+	fragments[1].iov_len = 0;
+	fragments[2].iov_base = value + 5;
+	fragments[2].iov_len = EXTENDED_VALUE_LEN - 5;
+	ret = marquise_send_extended_iov(ctx, EXTENDED_ADDRESS, EXTENDED_TIMESTAMP, fragments, 3);
+	if (ret != 0) {
+		printf("marquise_send_extended_iov failed: %s\n", strerror(errno));
+		g_test_fail();
+		return;
+	}
+
+	char *written_spool_path = strdup(ctx->spool_path_points);
+	ret = marquise_shutdown(ctx);
+	if (ret != 0) {
+		printf("marquise_shutdown failed: %s\n", strerror(errno));
+		free(written_spool_path);
+		g_test_fail();
+		return;
+	}
+
+	gchar *contents;
+	gsize len;
+	if (!g_file_get_contents(written_spool_path, &contents, &len, NULL)) {
+		printf("failed to read back spool file %s\n", written_spool_path);
+		free(written_spool_path);
+		g_test_fail();
+		return;
+	}
+	free(written_spool_path);
+
+	g_assert_cmpuint(len, ==, 24 + EXTENDED_VALUE_LEN);
+	unsigned char *header = (unsigned char *)contents;
+	uint64_t address;
+	uint64_t timestamp;
+	uint64_t extended_value_len;
+	LE8TOU64(address,             header);
+	LE8TOU64(timestamp,          (header+8));
+	LE8TOU64(extended_value_len, (header+16));
+	g_assert_cmpuint(address, ==, EXTENDED_ADDRESS);
+	g_assert_cmpuint(timestamp, ==, EXTENDED_TIMESTAMP);
+	g_assert_cmpuint(extended_value_len, ==, EXTENDED_VALUE_LEN);
+	g_assert(memcmp(contents + 24, EXTENDED_VALUE, EXTENDED_VALUE_LEN) == 0);
+	g_free(contents);
+}
+
 int main(int argc, char **argv) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/marquise_points_write_readback/points_write_readback", test_points_write_readback);
+	g_test_add_func("/marquise_points_write_readback/points_write_readback_mmap", test_points_write_readback_mmap);
+	g_test_add_func("/marquise_points_write_readback/points_write_readback_io_uring", test_points_write_readback_io_uring);
+	g_test_add_func("/marquise_points_write_readback/points_write_readback_io_uring_fallback", test_points_write_readback_io_uring_fallback);
+	g_test_add_func("/marquise_points_write_readback/points_write_readback_iov", test_points_write_readback_iov);
 	return g_test_run();
 }
@@ -2,6 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "../marquise.h"
 
@@ -47,9 +51,227 @@ void test_rotate() {
 	marquise_shutdown(ctx);
 }
 
+void check_rotate_batch() {
+	/* A segment takes frames until one of them reaches
+	 * MAX_SPOOL_FILE_SIZE, so that's how many the first file gets. */
+	size_t first_file_points = (MAX_SPOOL_FILE_SIZE + 23) / 24;
+	size_t n = first_file_points + 10;
+	size_t i;
+	struct stat spool_stat;
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	if (ctx == NULL) {
+		printf("marquise_init failed: %s\n", strerror(errno));
+		g_test_fail();
+		return;
+	}
+	marquise_point *pts = malloc(n * sizeof(marquise_point));
+	for (i = 0; i < n; i++) {
+		pts[i].address = SIMPLE_ADDRESS;
+		pts[i].timestamp = SIMPLE_TIMESTAMP + i;
+		pts[i].value = SIMPLE_VALUE;
+	}
+	char *initial_points_file = strdup(ctx->spool_path_points);
+	if (marquise_send_simple_batch(ctx, pts, n) != 0) {
+		printf("marquise_send_simple_batch failed: %s\n", strerror(errno));
+		g_test_fail();
+		return;
+	}
+	if (strcmp(initial_points_file, ctx->spool_path_points) == 0) {
+		printf("rotation of spool files failed: batch should have rotated but did not\n");
+		g_test_fail();
+		return;
+	}
+	if (stat(initial_points_file, &spool_stat) != 0 || spool_stat.st_size != first_file_points * 24) {
+		printf("batch was not split at the rotation boundary\n");
+		g_test_fail();
+		return;
+	}
+	if (ctx->bytes_written_points != (n - first_file_points) * 24) {
+		printf("remainder of batch not written to the new spool file\n");
+		g_test_fail();
+		return;
+	}
+	free(pts);
+	free(initial_points_file);
+	marquise_shutdown(ctx);
+}
+
+void test_rotate_batch() {
+	check_rotate_batch();
+}
+
+/* A mapped segment must be trimmed back to its frames on rotation. */
+void test_rotate_batch_mmap() {
+	setenv("MARQUISE_SPOOL_WRITER", "mmap", 1);
+	check_rotate_batch();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
+/* And with everything for the old segment in flight on an io_uring. */
+void test_rotate_batch_io_uring() {
+	setenv("MARQUISE_SPOOL_WRITER", "io_uring", 1);
+	check_rotate_batch();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
+/* A segment is written under tmp/ and only appears in new/ once it
+ * reaches MARQUISE_ROTATE_SIZE. */
+void test_rotate_size() {
+	struct stat spool_stat;
+	int i;
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_ROTATE_SIZE", "240", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	unsetenv("MARQUISE_ROTATE_SIZE");
+	g_assert(ctx != NULL);
+	char *first_points_file = strdup(ctx->spool_path_points);
+	for (i = 0; i < 9; i++) {
+		g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + i, SIMPLE_VALUE), ==, 0);
+	}
+	g_assert_cmpint(stat(first_points_file, &spool_stat), !=, 0);
+	g_assert_cmpint(stat(ctx->writer_points.tmp_path, &spool_stat), ==, 0);
+	g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + 9, SIMPLE_VALUE), ==, 0);
+	g_assert_cmpint(stat(first_points_file, &spool_stat), ==, 0);
+	g_assert_cmpint(spool_stat.st_size, ==, 240);
+	g_assert_cmpstr(first_points_file, !=, ctx->spool_path_points);
+
+	/* The last segment is published at shutdown, the empty one not. */
+	g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + 10, SIMPLE_VALUE), ==, 0);
+	char *last_points_file = strdup(ctx->spool_path_points);
+	char *contents_file = strdup(ctx->spool_path_contents);
+	char *contents_tmp_file = strdup(ctx->writer_contents.tmp_path);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+	g_assert_cmpint(stat(last_points_file, &spool_stat), ==, 0);
+	g_assert_cmpint(spool_stat.st_size, ==, 24);
+	g_assert_cmpint(stat(contents_file, &spool_stat), !=, 0);
+	g_assert_cmpint(stat(contents_tmp_file, &spool_stat), !=, 0);
+	free(first_points_file);
+	free(last_points_file);
+	free(contents_file);
+	free(contents_tmp_file);
+}
+
+/* An idle segment is published by the rotator thread once it has been
+ * open for MARQUISE_ROTATE_AGE, without another send to prompt it. */
+void test_rotate_age() {
+	struct stat spool_stat;
+	marquise_stats stats;
+	int i;
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_ROTATE_AGE", "50", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	unsetenv("MARQUISE_ROTATE_AGE");
+	g_assert(ctx != NULL);
+	/* Let the first deadline pass with nothing written. */
+	usleep(100000);
+	marquise_get_stats(ctx, &stats);
+	g_assert_cmpint(stats.rotations, ==, 0);
+
+	g_mutex_lock(&ctx->write_lock);
+	char *points_file = strdup(ctx->spool_path_points);
+	g_mutex_unlock(&ctx->write_lock);
+	g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE), ==, 0);
+	for (i = 0; i < 200 && stat(points_file, &spool_stat) != 0; i++) {
+		usleep(10000);
+	}
+	g_assert_cmpint(stat(points_file, &spool_stat), ==, 0);
+	g_assert_cmpint(spool_stat.st_size, ==, 24);
+	/* The rename comes just before the count. */
+	g_mutex_lock(&ctx->write_lock);
+	g_mutex_unlock(&ctx->write_lock);
+	marquise_get_stats(ctx, &stats);
+	g_assert_cmpint(stats.rotations, ==, 1);
+	free(points_file);
+	marquise_shutdown(ctx);
+}
+
+/* Segments left in tmp/ by a process that died are published by the
+ * next marquise_init, less the frame one was partway through or the
+ * zeroes at the end of one from the mmap writer; one with nothing in it
+ * is removed. */
+void check_rotate_recover() {
+	const char *tmp_dir = "/tmp/marquisetest/points/tmp/";
+	const char *new_dir = "/tmp/marquisetest/points/new/";
+	uint8_t frame[24];
+	uint8_t partial[24 + 10];
+	uint8_t zeroed[24 + 100];
+	int i;
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	/* Only for the directories. */
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	g_assert(ctx != NULL);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+
+	/* An even first byte makes it a simple frame. */
+	for (i = 0; i < 24; i++) {
+		frame[i] = 2 * i + 2;
+	}
+	memcpy(partial, frame, 24);
+	memcpy(partial + 24, frame, 10);
+	memset(zeroed, 0, sizeof(zeroed));
+	memcpy(zeroed, frame, 24);
+	char partial_path[64];
+	char zeroed_path[64];
+	char empty_path[64];
+	snprintf(partial_path, sizeof(partial_path), "%scrashA", tmp_dir);
+	snprintf(zeroed_path, sizeof(zeroed_path), "%scrashB", tmp_dir);
+	snprintf(empty_path, sizeof(empty_path), "%scrashC", tmp_dir);
+	g_assert(g_file_set_contents(partial_path, (gchar *)partial, sizeof(partial), NULL));
+	g_assert(g_file_set_contents(zeroed_path, (gchar *)zeroed, sizeof(zeroed), NULL));
+	g_assert(g_file_set_contents(empty_path, "", 0, NULL));
+
+	ctx = marquise_init("marquisetest");
+	g_assert(ctx != NULL);
+	g_assert(!g_file_test(partial_path, G_FILE_TEST_EXISTS));
+	g_assert(!g_file_test(zeroed_path, G_FILE_TEST_EXISTS));
+	g_assert(!g_file_test(empty_path, G_FILE_TEST_EXISTS));
+	DIR *dir = opendir(new_dir);
+	g_assert(dir != NULL);
+	struct dirent *entry;
+	int found = 0;
+	while ((entry = readdir(dir)) != NULL) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s%s", new_dir, entry->d_name);
+		gchar *contents;
+		gsize len;
+		if (g_file_get_contents(path, &contents, &len, NULL)) {
+			if (len == 24 && memcmp(contents, frame, 24) == 0) {
+				found++;
+				unlink(path);
+			}
+			g_free(contents);
+		}
+	}
+	closedir(dir);
+	g_assert_cmpint(found, ==, 2);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+}
+
+void test_rotate_recover() {
+	check_rotate_recover();
+}
+
+void test_rotate_recover_io_uring() {
+	setenv("MARQUISE_SPOOL_WRITER", "io_uring", 1);
+	check_rotate_recover();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
 int main(int argc, char **argv) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/marquise_rotate/rotate", test_rotate);
+	g_test_add_func("/marquise_rotate/rotate_batch", test_rotate_batch);
+	g_test_add_func("/marquise_rotate/rotate_batch_mmap", test_rotate_batch_mmap);
+	g_test_add_func("/marquise_rotate/rotate_batch_io_uring", test_rotate_batch_io_uring);
+	g_test_add_func("/marquise_rotate/rotate_size", test_rotate_size);
+	g_test_add_func("/marquise_rotate/rotate_age", test_rotate_age);
+	g_test_add_func("/marquise_rotate/rotate_recover", test_rotate_recover);
+	g_test_add_func("/marquise_rotate/rotate_recover_io_uring", test_rotate_recover_io_uring);
 	return g_test_run();
 
 }
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "../marquise.h"
 
@@ -52,9 +53,250 @@ void test_send_extended() {
 	marquise_shutdown(ctx);
 }
 
+void test_send_batch() {
+	struct stat spool_stat;
+	marquise_point simple[3] = {
+		{ SIMPLE_ADDRESS, SIMPLE_TIMESTAMP,     SIMPLE_VALUE },
+		{ SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + 1, SIMPLE_VALUE },
+		{ SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + 2, SIMPLE_VALUE },
+	};
+	marquise_extended_point extended[2] = {
+		{ EXTENDED_ADDRESS, EXTENDED_TIMESTAMP,     EXTENDED_VALUE, EXTENDED_VALUE_LEN },
+		{ EXTENDED_ADDRESS, EXTENDED_TIMESTAMP + 1, EXTENDED_VALUE, EXTENDED_VALUE_LEN },
+	};
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	if (ctx == NULL) {
+		perror("marquise_init failed");
+		g_test_fail();
+		return;
+	}
+
+	if (marquise_send_simple_batch(ctx, simple, 3) != 0) {
+		perror("marquise_send_simple_batch failed");
+		g_test_fail();
+		return;
+	}
+	if (marquise_send_extended_batch(ctx, extended, 2) != 0) {
+		perror("marquise_send_extended_batch failed");
+		g_test_fail();
+		return;
+	}
+	marquise_flush(ctx);
+	if (stat(ctx->writer_points.tmp_path, &spool_stat) != 0 || spool_stat.st_size != 3 * 24 + 2 * (24 + EXTENDED_VALUE_LEN)) {
+		printf("spool file does not contain the batched frames\n");
+		g_test_fail();
+		return;
+	}
+	marquise_shutdown(ctx);
+}
+
+/* A simple point or source dict for address 0 or 1 could make a frame
+ * header of all zeroes, which would read as the end of the spool file. */
+void test_reserved_address() {
+	struct stat spool_stat;
+	char *fields[1] = { "foo" };
+	char *values[1] = { "bar" };
+	marquise_point simple[2] = {
+		{ SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE },
+		{ 1, 0, 0 },
+	};
+	uint64_t addresses[1] = { 0 };
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	g_assert(ctx != NULL);
+
+	g_assert_cmpint(marquise_send_simple(ctx, 0, 0, 0), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	g_assert_cmpint(marquise_send_simple_batch(ctx, simple, 2), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	marquise_source *source = marquise_new_source(fields, values, 1);
+	g_assert_cmpint(marquise_update_source(ctx, 1, source), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	g_assert_cmpint(marquise_update_sources_batch(ctx, addresses, &source, 1), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	marquise_free_source(source);
+	/* Extended frames always have the LSB set. */
+	g_assert_cmpint(marquise_send_extended(ctx, 0, 0, "", 0), ==, 0);
+
+	g_assert_cmpint(marquise_flush(ctx), ==, 0);
+	g_assert(stat(ctx->writer_points.tmp_path, &spool_stat) == 0);
+	g_assert_cmpint(spool_stat.st_size, ==, 24);
+	g_assert(stat(ctx->writer_contents.tmp_path, &spool_stat) == 0);
+	g_assert_cmpint(spool_stat.st_size, ==, 0);
+	marquise_shutdown(ctx);
+}
+
+void test_flush() {
+	struct stat spool_stat;
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	if (ctx == NULL) {
+		perror("marquise_init failed");
+		g_test_fail();
+		return;
+	}
+
+	if (marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE) != 0) {
+		perror("marquise_send_simple failed");
+		g_test_fail();
+		return;
+	}
+	if (marquise_flush(ctx) != 0) {
+		perror("marquise_flush failed");
+		g_test_fail();
+		return;
+	}
+
+	/* The frame must be on disk without waiting for shutdown. */
+	if (stat(ctx->writer_points.tmp_path, &spool_stat) != 0 || spool_stat.st_size != 24) {
+		printf("spool file does not contain the flushed frame\n");
+		g_test_fail();
+		return;
+	}
+	marquise_shutdown(ctx);
+}
+
+void check_stats() {
+	marquise_stats stats;
+	uint64_t writes = 0;
+	int i;
+	char *fields[1] = { "foo" };
+	char *values[1] = { "bar" };
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SOURCE_CACHE_PERSIST", "0", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	g_assert(ctx != NULL);
+
+	for (i = 0; i < 10; i++) {
+		g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + i, SIMPLE_VALUE), ==, 0);
+	}
+	g_assert_cmpint(marquise_send_extended(ctx, EXTENDED_ADDRESS, EXTENDED_TIMESTAMP, EXTENDED_VALUE, EXTENDED_VALUE_LEN), ==, 0);
+	marquise_source *source = marquise_new_source(fields, values, 1);
+	g_assert_cmpint(marquise_update_source(ctx, SIMPLE_ADDRESS, source), ==, 0);
+	g_assert_cmpint(marquise_update_source(ctx, SIMPLE_ADDRESS, source), ==, 0);
+	marquise_free_source(source);
+	g_assert_cmpint(marquise_flush(ctx), ==, 0);
+
+	marquise_get_stats(ctx, &stats);
+	g_assert_cmpuint(stats.frames_points, ==, 11);
+	g_assert_cmpuint(stats.bytes_points, ==, 10 * 24 + 24 + EXTENDED_VALUE_LEN);
+	g_assert_cmpuint(stats.frames_contents, ==, 1);
+	g_assert_cmpuint(stats.bytes_contents, ==, 16 + strlen("foo:bar"));
+	g_assert_cmpuint(stats.source_hits, ==, 1);
+	g_assert_cmpuint(stats.source_misses, ==, 1);
+	g_assert_cmpuint(stats.rotations, ==, 0);
+	g_assert_cmpuint(stats.write_errors, ==, 0);
+	/* One flush of each spool file. */
+	for (i = 0; i < MARQUISE_STATS_LATENCY_BUCKETS; i++) {
+		writes += stats.write_latency[i];
+	}
+	g_assert_cmpuint(writes, ==, 2);
+
+	/* Enough to fill a spool file. */
+	for (i = 0; i < MAX_SPOOL_FILE_SIZE / 24; i++) {
+		g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + i, SIMPLE_VALUE), ==, 0);
+	}
+	marquise_get_stats(ctx, &stats);
+	g_assert_cmpuint(stats.rotations, ==, 1);
+	g_assert_cmpuint(stats.frames_points, ==, 11 + MAX_SPOOL_FILE_SIZE / 24);
+	marquise_shutdown(ctx);
+	unsetenv("MARQUISE_SOURCE_CACHE_PERSIST");
+}
+
+void test_stats() {
+	check_stats();
+}
+
+/* Writes through an io_uring are timed from submission to completion,
+ * so they land in the histogram just the same. */
+void test_stats_io_uring() {
+	setenv("MARQUISE_SPOOL_WRITER", "io_uring", 1);
+	check_stats();
+	unsetenv("MARQUISE_SPOOL_WRITER");
+}
+
+/* Syncing after every send means nothing is left in the buffer. */
+void test_durability_frame() {
+	struct stat spool_stat;
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_DURABILITY", "fsync-sometimes", 1);
+	g_assert(marquise_init("marquisetest") == NULL);
+	g_assert_cmpint(errno, ==, EINVAL);
+
+	setenv("MARQUISE_DURABILITY", "frame", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	unsetenv("MARQUISE_DURABILITY");
+	g_assert(ctx != NULL);
+	g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE), ==, 0);
+	g_assert_cmpint(stat(ctx->writer_points.tmp_path, &spool_stat), ==, 0);
+	g_assert_cmpint(spool_stat.st_size, ==, 24);
+	marquise_shutdown(ctx);
+}
+
+/* Does the spool file at path hold a simple frame for address? */
+int spool_has_address(const char *path, uint64_t address, size_t frame_len) {
+	gchar *contents;
+	gsize len;
+	size_t i;
+	int found = 0;
+	unsigned char le[8];
+	for (i = 0; i < 8; i++) {
+		le[i] = address >> (8 * i);
+	}
+	if (!g_file_get_contents(path, &contents, &len, NULL)) {
+		return 0;
+	}
+	for (i = 0; i + frame_len <= len; i += frame_len) {
+		if (memcmp(contents + i, le, sizeof(le)) == 0) {
+			found = 1;
+		}
+	}
+	g_free(contents);
+	return found;
+}
+
+void test_telemetry() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_SOURCE_CACHE_PERSIST", "0", 1);
+	setenv("MARQUISE_TELEMETRY_INTERVAL", "20", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	g_assert(ctx != NULL);
+	g_assert(ctx->telemetry != NULL);
+	g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE), ==, 0);
+	usleep(100000);
+
+	char *id = g_strdup_printf("hostname:%s,metric:frames_per_second,namespace:marquisetest,"
+	                           "service:libmarquise,unit:frames/s", g_get_host_name());
+	uint64_t address = marquise_hash_identifier((const unsigned char *)id, strlen(id));
+	g_free(id);
+	char *points_path = strdup(ctx->spool_path_points);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+	unsetenv("MARQUISE_TELEMETRY_INTERVAL");
+	unsetenv("MARQUISE_SOURCE_CACHE_PERSIST");
+
+	/* Simple frames have the address's LSB clear. */
+	address &= ~(uint64_t)1;
+	g_assert(spool_has_address(points_path, address, 24));
+	free(points_path);
+}
+
 int main(int argc, char **argv) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/marquise_send/send_simple", test_send_simple);
 	g_test_add_func("/marquise_send/send_extended", test_send_extended);
+	g_test_add_func("/marquise_send/send_batch", test_send_batch);
+	g_test_add_func("/marquise_send/reserved_address", test_reserved_address);
+	g_test_add_func("/marquise_send/flush", test_flush);
+	g_test_add_func("/marquise_send/stats", test_stats);
+	g_test_add_func("/marquise_send/stats_io_uring", test_stats_io_uring);
+	g_test_add_func("/marquise_send/durability_frame", test_durability_frame);
+	g_test_add_func("/marquise_send/telemetry", test_telemetry);
 	return g_test_run();
 }
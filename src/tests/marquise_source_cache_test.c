@@ -0,0 +1,164 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <glib/gstdio.h>
+
+#include "../source_cache.h"
+
+#define TEST_HASHES 100000
+
+/* Spread test hashes out over the whole 64-bit range, including the
+ * top bit which the old tree comparator got wrong. */
+uint64_t test_hash(uint64_t i) {
+	return i * 0x9E3779B97F4A7C15;
+}
+
+void test_insert_contains() {
+	struct marquise_source_cache *c = source_cache_new(16, SIZE_MAX);
+	g_assert(c != NULL);
+	uint64_t i;
+	for (i = 0; i < TEST_HASHES; i++) {
+		g_assert_cmpint(source_cache_insert(c, test_hash(i)), ==, 1);
+	}
+	for (i = 0; i < TEST_HASHES; i++) {
+		g_assert(source_cache_contains(c, test_hash(i)));
+		g_assert_cmpint(source_cache_insert(c, test_hash(i)), ==, 0);
+	}
+	g_assert_cmpuint(c->count, ==, TEST_HASHES - 1);	// test_hash(0) is zero
+	g_assert(!source_cache_contains(c, test_hash(TEST_HASHES)));
+	source_cache_free(c);
+}
+
+void test_zero_hash() {
+	struct marquise_source_cache *c = source_cache_new(0, SIZE_MAX);
+	g_assert(c != NULL);
+	g_assert(!source_cache_contains(c, 0));
+	g_assert_cmpint(source_cache_insert(c, 0), ==, 1);
+	g_assert(source_cache_contains(c, 0));
+	g_assert_cmpint(source_cache_insert(c, 0), ==, 0);
+	g_assert(!source_cache_contains(c, 1));
+	source_cache_free(c);
+}
+
+/* Hashes which collide in the low bits all end up in one probe run. */
+void test_collisions() {
+	struct marquise_source_cache *c = source_cache_new(64, SIZE_MAX);
+	g_assert(c != NULL);
+	uint64_t i;
+	for (i = 1; i <= 40; i++) {
+		g_assert_cmpint(source_cache_insert(c, i << 32), ==, 1);
+	}
+	for (i = 1; i <= 40; i++) {
+		g_assert(source_cache_contains(c, i << 32));
+	}
+	g_assert(!source_cache_contains(c, (uint64_t)41 << 32));
+	source_cache_free(c);
+}
+
+/* A capped cache evicts to stay under its limit, preferring entries
+ * which haven't been looked up recently. */
+void test_eviction() {
+	struct marquise_source_cache *c = source_cache_new(0, 64 * SOURCE_CACHE_SLOT_BYTES);
+	g_assert(c != NULL);
+	size_t limit = source_cache_limit(c);
+	g_assert_cmpuint(limit, ==, 48);
+
+	uint64_t i;
+	for (i = 1; i <= limit; i++) {
+		g_assert_cmpint(source_cache_insert(c, test_hash(i)), ==, 1);
+	}
+	g_assert_cmpuint(c->evictions, ==, 0);
+	g_assert_cmpuint(c->capacity, ==, 64);
+
+	/* Sweep once so that every reference bit is clear, then keep the
+	 * first half warm. */
+	g_assert_cmpint(source_cache_insert(c, test_hash(1000)), ==, 1);
+	g_assert_cmpuint(c->evictions, ==, 1);
+	for (i = 1; i <= limit / 2; i++) {
+		if (source_cache_contains(c, test_hash(i))) {
+			g_assert_cmpint(source_cache_insert(c, test_hash(i)), ==, 0);
+		}
+	}
+	size_t warm = 0;
+	for (i = 1; i <= limit / 2; i++) {
+		warm += source_cache_contains(c, test_hash(i));
+	}
+
+	/* Churn through a quarter of the limit in new hashes. */
+	for (i = 2000; i < 2000 + limit / 4; i++) {
+		g_assert_cmpint(source_cache_insert(c, test_hash(i)), ==, 1);
+	}
+	g_assert_cmpuint(c->count, ==, limit);
+	g_assert_cmpuint(c->capacity, ==, 64);
+	g_assert_cmpuint(c->evictions, ==, 1 + limit / 4);
+	for (i = 1; i <= limit / 2; i++) {
+		warm -= source_cache_contains(c, test_hash(i));
+	}
+	g_assert_cmpuint(warm, ==, 0);
+
+	/* Everything still present must be findable after the shifting. */
+	size_t found = 0;
+	for (i = 0; i < 3000; i++) {
+		found += (i != 0 && source_cache_contains(c, test_hash(i)));
+	}
+	g_assert_cmpuint(found, ==, limit);
+	source_cache_free(c);
+}
+
+/* A file-backed cache comes back as it was persisted, and only if it
+ * was persisted. */
+void test_persist() {
+	gchar *dir = g_dir_make_tmp("marquise_source_cache_XXXXXX", NULL);
+	g_assert(dir != NULL);
+	gchar *path = g_build_filename(dir, "source_cache", NULL);
+
+	struct marquise_source_cache *c = source_cache_open(path, 16, SIZE_MAX);
+	g_assert(c != NULL);
+	g_assert(c->map != NULL);
+	uint64_t i;
+	for (i = 1; i <= 5000; i++) {
+		g_assert_cmpint(source_cache_insert(c, test_hash(i)), ==, 1);
+	}
+	g_assert(c->map != NULL);
+	g_assert_cmpint(source_cache_persist(c), ==, 0);
+	source_cache_free(c);
+
+	c = source_cache_open(path, 16, SIZE_MAX);
+	g_assert(c != NULL);
+	g_assert_cmpuint(c->count, ==, 5000);
+	for (i = 1; i <= 5000; i++) {
+		g_assert(source_cache_contains(c, test_hash(i)));
+	}
+	g_assert_cmpint(source_cache_insert(c, test_hash(5001)), ==, 1);
+	g_assert_cmpint(source_cache_persist(c), ==, 0);
+	source_cache_free(c);
+
+	/* A smaller cache keeps what fits. */
+	c = source_cache_open(path, 16, 1024 * SOURCE_CACHE_SLOT_BYTES);
+	g_assert(c != NULL);
+	g_assert_cmpuint(c->count, ==, source_cache_limit(c));
+	g_assert_cmpuint(c->capacity, ==, 1024);
+	/* Not persisted, so next time starts empty. */
+	source_cache_free(c);
+
+	c = source_cache_open(path, 16, SIZE_MAX);
+	g_assert(c != NULL);
+	g_assert_cmpuint(c->count, ==, 0);
+	g_assert(!source_cache_contains(c, test_hash(1)));
+	source_cache_free(c);
+
+	g_unlink(path);
+	g_rmdir(dir);
+	g_free(path);
+	g_free(dir);
+}
+
+int main(int argc, char **argv) {
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/marquise_source_cache/insert_contains", test_insert_contains);
+	g_test_add_func("/marquise_source_cache/zero_hash", test_zero_hash);
+	g_test_add_func("/marquise_source_cache/collisions", test_collisions);
+	g_test_add_func("/marquise_source_cache/eviction", test_eviction);
+	g_test_add_func("/marquise_source_cache/persist", test_persist);
+	return g_test_run();
+}
@@ -0,0 +1,206 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../marquise.h"
+#include "marquise_test.h"
+
+/* Be careful with the addresses we write, the LSB will be cleared for
+   simple points and set for extended points. */
+#define SIMPLE_ADDRESS   1234567890123456780
+#define SIMPLE_TIMESTAMP 1405392588998566144
+#define SIMPLE_VALUE     133713371337
+#define EXTENDED_ADDRESS   1234567890999999999
+#define EXTENDED_TIMESTAMP 1405392588999999999
+#define EXTENDED_VALUE     "This is data これはデータ and Sinhala ශුද්ධ සිංහල"
+#define EXTENDED_VALUE_LEN sizeof(EXTENDED_VALUE)-1
+#define TEST_ADDRESS                1234567890123456789
+#define TEST_SOURCE_DICT_SERIALISED "foo:one,bar:two,baz:three"
+#define TEST_SOURCE_DICT_LENGTH     sizeof(TEST_SOURCE_DICT_SERIALISED)-1
+#define N_POINTS 100
+
+/* Send N_POINTS simple points, each followed by an extended one, and
+ * return the published points spool path. */
+char *write_points(marquise_ctx *ctx) {
+	int i;
+	for (i = 0; i < N_POINTS; i++) {
+		g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + i, SIMPLE_VALUE + i), ==, 0);
+		g_assert_cmpint(marquise_send_extended(ctx, EXTENDED_ADDRESS, EXTENDED_TIMESTAMP + i, EXTENDED_VALUE, EXTENDED_VALUE_LEN), ==, 0);
+	}
+	char *path = strdup(ctx->spool_path_points);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+	return path;
+}
+
+/* Check that s holds what write_points() sent, in order if ordered, or
+ * else with the simple points first, as the compact format has them. */
+void check_points(marquise_spool *s, bool ordered) {
+	marquise_frame f;
+	int i;
+	for (i = 0; i < 2 * N_POINTS; i++) {
+		int n = ordered ? i / 2 : i % N_POINTS;
+		bool extended = ordered ? (i % 2 == 1) : (i >= N_POINTS);
+		g_assert_cmpint(marquise_spool_next(s, &f), ==, 1);
+		g_assert(f.extended == extended);
+		if (extended) {
+			g_assert_cmpuint(f.address, ==, EXTENDED_ADDRESS);
+			g_assert_cmpuint(f.timestamp, ==, EXTENDED_TIMESTAMP + n);
+			g_assert_cmpuint(f.len, ==, EXTENDED_VALUE_LEN);
+			g_assert(memcmp(f.data, EXTENDED_VALUE, EXTENDED_VALUE_LEN) == 0);
+			g_assert_cmpuint(f.frame_len, ==, 24 + EXTENDED_VALUE_LEN);
+		} else {
+			g_assert_cmpuint(f.address, ==, SIMPLE_ADDRESS);
+			g_assert_cmpuint(f.timestamp, ==, SIMPLE_TIMESTAMP + n);
+			g_assert_cmpuint(f.value, ==, SIMPLE_VALUE + n);
+			g_assert_cmpuint(f.frame_len, ==, 24);
+		}
+	}
+	g_assert_cmpint(marquise_spool_next(s, &f), ==, 0);
+	g_assert_cmpint(marquise_spool_next(s, &f), ==, 0);
+}
+
+void test_reader_points() {
+	marquise_ctx *ctx = init_test_ctx(NULL);
+	if (ctx == NULL) {
+		return;
+	}
+	char *path = write_points(ctx);
+	marquise_spool *s = marquise_spool_open(path, SPOOL_POINTS);
+	g_assert(s != NULL);
+	check_points(s, true);
+	marquise_spool_close(s);
+	free(path);
+}
+
+void test_reader_contents() {
+	char *fields[3] = { "foo", "bar", "baz" };
+	char *values[3] = { "one", "two", "three" };
+	/* Every run has to write the source dict out again. */
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_SOURCE_CACHE_PERSIST", "0", NULL);
+	if (ctx == NULL) {
+		return;
+	}
+	marquise_source *src = marquise_new_source(fields, values, 3);
+	g_assert_cmpint(marquise_update_source(ctx, TEST_ADDRESS, src), ==, 0);
+	marquise_free_source(src);
+	char *path = strdup(ctx->spool_path_contents);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+
+	marquise_spool *s = marquise_spool_open(path, SPOOL_CONTENTS);
+	g_assert(s != NULL);
+	marquise_frame f;
+	g_assert_cmpint(marquise_spool_next(s, &f), ==, 1);
+	/* Source dicts are stored with the LSB of the address cleared. */
+	g_assert_cmpuint(f.address, ==, TEST_ADDRESS >> 1 << 1);
+	g_assert_cmpuint(f.len, ==, TEST_SOURCE_DICT_LENGTH);
+	g_assert(memcmp(f.data, TEST_SOURCE_DICT_SERIALISED, TEST_SOURCE_DICT_LENGTH) == 0);
+	g_assert_cmpint(marquise_spool_next(s, &f), ==, 0);
+	marquise_spool_close(s);
+	free(path);
+}
+
+/* A file cut off partway through a frame gives up every whole frame,
+ * then reports the rest. */
+void test_reader_truncated() {
+	marquise_ctx *ctx = init_test_ctx(NULL);
+	if (ctx == NULL) {
+		return;
+	}
+	char *path = write_points(ctx);
+	gchar *contents;
+	gsize len;
+	g_assert(g_file_get_contents(path, &contents, &len, NULL));
+	const char *cut_path = "/tmp/marquise_spool_reader_test_truncated";
+	size_t whole = 24 + 24 + EXTENDED_VALUE_LEN;
+	/* In a simple frame, in an extended frame's header, and in its
+	 * value. */
+	size_t cuts[] = { whole + 10, whole + 24 + 10, whole + 24 + 24 + 5 };
+	size_t frames[] = { 2, 3, 3 };
+	size_t offsets[] = { whole, whole + 24, whole + 24 };
+	int i;
+	for (i = 0; i < 3; i++) {
+		g_assert(g_file_set_contents(cut_path, contents, cuts[i], NULL));
+		marquise_spool *s = marquise_spool_open(cut_path, SPOOL_POINTS);
+		g_assert(s != NULL);
+		marquise_frame f;
+		size_t n;
+		for (n = 0; n < frames[i]; n++) {
+			g_assert_cmpint(marquise_spool_next(s, &f), ==, 1);
+		}
+		errno = 0;
+		g_assert_cmpint(marquise_spool_next(s, &f), ==, -1);
+		g_assert_cmpint(errno, ==, EINVAL);
+		g_assert_cmpuint(marquise_spool_offset(s), ==, offsets[i]);
+		marquise_spool_close(s);
+	}
+	unlink(cut_path);
+	g_free(contents);
+	free(path);
+}
+
+/* A live file from the mmap writer ends at the frames written so far,
+ * not at the end of its preallocated space. */
+void test_reader_mmap_live() {
+	marquise_ctx *ctx = init_test_ctx("MARQUISE_SPOOL_WRITER", "mmap", NULL);
+	if (ctx == NULL) {
+		return;
+	}
+	g_assert_cmpint(marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP, SIMPLE_VALUE), ==, 0);
+	marquise_spool *s = marquise_spool_open(ctx->writer_points.tmp_path, SPOOL_POINTS);
+	g_assert(s != NULL);
+	marquise_frame f;
+	g_assert_cmpint(marquise_spool_next(s, &f), ==, 1);
+	g_assert_cmpuint(f.value, ==, SIMPLE_VALUE);
+	g_assert_cmpint(marquise_spool_next(s, &f), ==, 0);
+	marquise_spool_close(s);
+	g_assert_cmpint(marquise_shutdown(ctx), ==, 0);
+}
+
+/* Compressed and compact files read the same, once decoded. */
+void test_reader_decoded() {
+	const char *formats[] = { "classic", "compact" };
+	int i;
+	for (i = 0; i < 2; i++) {
+		marquise_ctx *ctx = init_test_ctx("MARQUISE_SPOOL_FORMAT", formats[i], "MARQUISE_SPOOL_COMPRESSION", "zlib", NULL);
+		if (ctx == NULL) {
+			return;
+		}
+		char *path = write_points(ctx);
+		marquise_spool *s = marquise_spool_open(path, SPOOL_POINTS);
+		g_assert(s != NULL);
+		check_points(s, i == 0);
+		marquise_spool_close(s);
+		free(path);
+	}
+}
+
+void test_reader_empty() {
+	const char *path = "/tmp/marquise_spool_reader_test_empty";
+	g_assert(g_file_set_contents(path, "", 0, NULL));
+	marquise_spool *s = marquise_spool_open(path, SPOOL_CONTENTS);
+	g_assert(s != NULL);
+	marquise_frame f;
+	g_assert_cmpint(marquise_spool_next(s, &f), ==, 0);
+	marquise_spool_close(s);
+	unlink(path);
+
+	errno = 0;
+	g_assert(marquise_spool_open("/tmp/marquise_spool_reader_test_missing", SPOOL_POINTS) == NULL);
+	g_assert_cmpint(errno, ==, ENOENT);
+}
+
+int main(int argc, char **argv) {
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/marquise_spool_reader/points", test_reader_points);
+	g_test_add_func("/marquise_spool_reader/contents", test_reader_contents);
+	g_test_add_func("/marquise_spool_reader/truncated", test_reader_truncated);
+	g_test_add_func("/marquise_spool_reader/mmap_live", test_reader_mmap_live);
+#ifdef HAVE_SPOOL_CODEC
+	g_test_add_func("/marquise_spool_reader/decoded", test_reader_decoded);
+#endif
+	g_test_add_func("/marquise_spool_reader/empty", test_reader_empty);
+	return g_test_run();
+}
@@ -0,0 +1,42 @@
+/* Shared setup for the test programs. Include it after marquise.h,
+ * which has no include guard. */
+#include <glib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* Whether spool files can be compressed at all in this build. */
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+#define HAVE_SPOOL_CODEC 1
+#endif
+
+/* Create a context for the "marquisetest" namespace, spooling and
+ * locking under /tmp. The arguments are pairs of an environment
+ * variable's name and a value, ended by NULL, which are set in the
+ * options passed to marquise_init_opts. If marquise_init_opts fails,
+ * the test is marked as failed and NULL is returned. */
+static marquise_ctx *init_test_ctx(const char *name, ...)
+{
+	va_list ap;
+	const char *var;
+	marquise_options opts;
+	marquise_options_init(&opts);
+	opts.spool_dir = "/tmp";
+	opts.lock_dir = "/tmp";
+	va_start(ap, name);
+	for (var = name; var != NULL; var = va_arg(ap, const char *)) {
+		g_assert_cmpint(marquise_options_set(&opts, var, va_arg(ap, const char *)), ==, 0);
+	}
+	va_end(ap);
+	marquise_ctx *ctx = marquise_init_opts("marquisetest", &opts);
+	if (ctx == NULL) {
+		printf("marquise_init failed: %s\n", strerror(errno));
+		g_test_fail();
+	}
+	return ctx;
+}
@@ -0,0 +1,113 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "../marquise.h"
+
+#define SIMPLE_ADDRESS   1234567890123456780
+#define SIMPLE_TIMESTAMP 1405392588998566144
+#define SIMPLE_VALUE     133713371337
+
+#define N_THREADS 4
+#define N_POINTS  5000
+
+gpointer send_points(gpointer data) {
+	marquise_ctx *ctx = data;
+	int i;
+	for (i = 0; i < N_POINTS; i++) {
+		if (marquise_send_simple(ctx, SIMPLE_ADDRESS, SIMPLE_TIMESTAMP + i, SIMPLE_VALUE) != 0) {
+			return GINT_TO_POINTER(1);
+		}
+	}
+	return NULL;
+}
+
+/* Every point sent from every thread has to end up in the spool, and
+ * since nothing here rotates they all end up in the one file. */
+void check_shared_ctx(marquise_ctx *ctx) {
+	GThread *threads[N_THREADS];
+	struct stat spool_stat;
+	int i;
+	int failed = 0;
+
+	for (i = 0; i < N_THREADS; i++) {
+		threads[i] = g_thread_new("sender", send_points, ctx);
+	}
+	for (i = 0; i < N_THREADS; i++) {
+		failed |= GPOINTER_TO_INT(g_thread_join(threads[i]));
+	}
+	if (failed) {
+		printf("marquise_send_simple failed in a sending thread\n");
+		g_test_fail();
+		return;
+	}
+
+	char *spool_path = strdup(ctx->spool_path_points);
+	if (marquise_shutdown(ctx) != 0) {
+		perror("marquise_shutdown failed");
+		g_test_fail();
+		return;
+	}
+	if (stat(spool_path, &spool_stat) != 0 || spool_stat.st_size != N_THREADS * N_POINTS * 24) {
+		printf("points from concurrent senders went missing\n");
+		g_test_fail();
+	}
+	free(spool_path);
+}
+
+void test_threads_sync() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	if (ctx == NULL) {
+		perror("marquise_init failed");
+		g_test_fail();
+		return;
+	}
+	check_shared_ctx(ctx);
+}
+
+void test_threads_async() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_ASYNC", "1", 1);
+	/* Small rings, so the senders have to wait on the flusher. */
+	setenv("MARQUISE_ASYNC_QUEUE_SIZE", "4096", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	unsetenv("MARQUISE_ASYNC");
+	unsetenv("MARQUISE_ASYNC_QUEUE_SIZE");
+	if (ctx == NULL) {
+		perror("marquise_init failed");
+		g_test_fail();
+		return;
+	}
+	check_shared_ctx(ctx);
+}
+
+/* With group commit every send waits for a sync, and concurrent
+ * senders share them. */
+void test_threads_group_commit() {
+	setenv("MARQUISE_SPOOL_DIR", "/tmp", 1);
+	setenv("MARQUISE_LOCK_DIR", "/tmp", 1);
+	setenv("MARQUISE_DURABILITY", "group", 1);
+	setenv("MARQUISE_GROUP_COMMIT_INTERVAL", "0", 1);
+	marquise_ctx *ctx = marquise_init("marquisetest");
+	unsetenv("MARQUISE_DURABILITY");
+	unsetenv("MARQUISE_GROUP_COMMIT_INTERVAL");
+	if (ctx == NULL) {
+		perror("marquise_init failed");
+		g_test_fail();
+		return;
+	}
+	check_shared_ctx(ctx);
+}
+
+int main(int argc, char **argv) {
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/marquise_threads/sync", test_threads_sync);
+	g_test_add_func("/marquise_threads/async", test_threads_async);
+	g_test_add_func("/marquise_threads/group_commit", test_threads_group_commit);
+	return g_test_run();
+}
@@ -3,14 +3,20 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "../marquise.h"
 
 extern uint8_t valid_namespace(char *namespace);
 extern uint8_t valid_source_tag(char *tag);
 extern char* build_lock_path(const char *lock_prefix, char *namespace);
-extern char* build_spool_path(const char *spool_prefix, char *namespace, const char* spool_type);
+extern int open_spool_dir(const char *spool_prefix, char *namespace, const char* spool_type, char **dir_path);
 extern char* serialise_marquise_source(marquise_source *source);
+extern size_t scan_source_tag(const char *tag, uint8_t *valid);
+extern const size_t *source_lens(const marquise_source *source);
+extern uint64_t hash_marquise_source(marquise_source *source);
 
 void test_valid_namespace() {
 	int ret = valid_namespace("abcdefghijklmn12345");
@@ -55,46 +61,34 @@ void test_build_lock_path() {
 	}
 }
 
-void test_build_spool_path() {
-	const char *prefix = "/tmp";
-	char *namespace = "marquisetest";
-	char *expected_points_path   = "/tmp/marquisetest/points/new";
-	char *expected_contents_path = "/tmp/marquisetest/contents/new";
-
-	char *spool_path_points = build_spool_path(prefix, namespace, "points");
-	if (spool_path_points == NULL) {
-		perror("build_spool_path returned NULL when building for 'points'");
-		free(spool_path_points);
+void check_spool_dir(const char *spool_type, const char *expected_path) {
+	char *dir_path;
+	struct stat dir_stat;
+	int dirfd = open_spool_dir("/tmp", "marquisetest", spool_type, &dir_path);
+	if (dirfd < 0) {
+		printf("open_spool_dir failed for '%s': %s\n", spool_type, strerror(errno));
 		g_test_fail();
 		return;
 	}
-	/* Use the length of the expected path as our safety boundary, it's */
-	/* guaranteed to be safely null-terminated */
-	if (strncmp(spool_path_points, expected_points_path, strlen(expected_points_path)) != 0) {
-		printf("Got 'points' path %s, expected path with prefix %s\n", spool_path_points, expected_points_path);
-		free(spool_path_points);
+	if (strcmp(dir_path, expected_path) != 0) {
+		printf("Got '%s' path %s, expected %s\n", spool_type, dir_path, expected_path);
 		g_test_fail();
-		return;
 	}
-	free(spool_path_points);
-
-
-	/* Test for "contents" as well. */
-	char *spool_path_contents = build_spool_path(prefix, namespace, "contents");
-	if (spool_path_contents == NULL) {
-		perror("build_spool_path returned NULL when building for 'contents'");
-		free(spool_path_contents);
+	/* Files are written in tmp/ and published to new/. */
+	if (fstatat(dirfd, "tmp", &dir_stat, 0) != 0 || !S_ISDIR(dir_stat.st_mode) ||
+	    fstatat(dirfd, "new", &dir_stat, 0) != 0 || !S_ISDIR(dir_stat.st_mode)) {
+		printf("tmp/ and new/ not created under %s\n", dir_path);
 		g_test_fail();
-		return;
 	}
-	if (strncmp(spool_path_contents, expected_contents_path, strlen(expected_contents_path)) != 0) {
-		printf("Got 'contents' path %s, expected path with prefix %s\n", spool_path_contents, expected_contents_path);
-		free(spool_path_contents);
-		g_test_fail();
-		return;
-	}
-	free(spool_path_contents);
+	close(dirfd);
+	free(dir_path);
+}
+
+void test_open_spool_dir() {
+	check_spool_dir("points", "/tmp/marquisetest/points/");
+	check_spool_dir("contents", "/tmp/marquisetest/contents/");
 }
+
 void test_serialise_marquise_source() {
 	char* fields[3] = { "foo", "bar", "baz" };
 	char* values[3] = { "one", "two", "three" };
@@ -117,12 +111,109 @@ void test_serialise_marquise_source() {
 	free(serialised_dict);
 }
 
+/* The vectorised scan gets the length and validity right wherever the
+ * string starts and ends relative to its 16-byte blocks, and wherever
+ * the bad character is. */
+void test_scan_source_tag() {
+	char buf[96];
+	size_t start, len, bad;
+	for (start = 0; start < 16; start++) {
+		for (len = 0; len < 48; len++) {
+			memset(buf, 'a', sizeof(buf));
+			buf[start + len] = '\0';
+			uint8_t valid;
+			g_assert_cmpuint(scan_source_tag(buf + start, &valid), ==, len);
+			g_assert_cmpuint(valid, ==, 1);
+			for (bad = 0; bad < len; bad++) {
+				buf[start + bad] = (bad & 1) ? ',' : ':';
+				g_assert_cmpuint(scan_source_tag(buf + start, &valid), ==, len);
+				g_assert_cmpuint(valid, ==, 0);
+				buf[start + bad] = 'a';
+			}
+			/* A separator just past the end doesn't count. */
+			buf[start + len + 1] = ',';
+			g_assert_cmpuint(scan_source_tag(buf + start, &valid), ==, len);
+			g_assert_cmpuint(valid, ==, 1);
+		}
+	}
+}
+
+void test_source_builder() {
+	const char *tags = "foo=one&bar=two&baz=three";
+	marquise_source_builder *b = marquise_source_builder_new();
+	g_assert(b != NULL);
+
+	int round;
+	for (round = 0; round < 2; round++) {
+		g_assert_cmpint(marquise_source_builder_add(b, tags, 3, tags + 4, 3), ==, 0);
+		g_assert_cmpint(marquise_source_builder_add(b, tags + 8, 3, tags + 12, 3), ==, 0);
+		g_assert_cmpint(marquise_source_builder_add(b, tags + 16, 3, tags + 20, 5), ==, 0);
+		g_assert_cmpint(marquise_source_builder_add(b, "a,b", 3, "c", 1), ==, -1);
+		g_assert_cmpint(errno, ==, EINVAL);
+		g_assert_cmpint(marquise_source_builder_add(b, "a", 1, "c:", 2), ==, -1);
+
+		marquise_source *src = marquise_source_builder_finish(b);
+		g_assert(src != NULL);
+		g_assert_cmpuint(src->n_tags, ==, 3);
+		g_assert_cmpstr(src->fields[2], ==, "baz");
+		g_assert_cmpstr(src->values[2], ==, "three");
+		g_assert(source_lens(src) != NULL);
+		g_assert_cmpuint(source_lens(src)[5], ==, 5);
+		char *serialised_dict = serialise_marquise_source(src);
+		g_assert_cmpstr(serialised_dict, ==, "foo:one,bar:two,baz:three");
+		free(serialised_dict);
+		marquise_free_source(src);
+	}
+
+	marquise_source *empty = marquise_source_builder_finish(b);
+	g_assert(empty != NULL);
+	g_assert_cmpuint(empty->n_tags, ==, 0);
+	char *serialised_dict = serialise_marquise_source(empty);
+	g_assert_cmpstr(serialised_dict, ==, "");
+	free(serialised_dict);
+	marquise_free_source(empty);
+	marquise_source_builder_free(b);
+}
+
+/* Sources put together by hand, as callers have always been able to,
+ * are measured as needed and freed a piece at a time. */
+void test_caller_built_source() {
+	char *fields[2] = { "foo", "bar" };
+	char *values[2] = { "one", "two" };
+	marquise_source *ours = marquise_new_source(fields, values, 2);
+	g_assert(ours != NULL);
+
+	marquise_source *theirs = malloc(sizeof(marquise_source));
+	g_assert(theirs != NULL);
+	theirs->n_tags = 2;
+	theirs->fields = malloc(2 * sizeof(char *));
+	theirs->values = malloc(2 * sizeof(char *));
+	g_assert(theirs->fields != NULL && theirs->values != NULL);
+	int i;
+	for (i = 0; i < 2; i++) {
+		theirs->fields[i] = strdup(fields[i]);
+		theirs->values[i] = strdup(values[i]);
+	}
+	g_assert(source_lens(theirs) == NULL);
+
+	char *serialised_dict = serialise_marquise_source(theirs);
+	g_assert_cmpstr(serialised_dict, ==, "foo:one,bar:two");
+	free(serialised_dict);
+	g_assert_cmpuint(hash_marquise_source(theirs), ==, hash_marquise_source(ours));
+	marquise_free_source(theirs);
+	marquise_free_source(ours);
+}
+
 int main(int argc, char **argv) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/valid_namespace/valid", test_valid_namespace);
 	g_test_add_func("/valid_namespace/invalid", test_invalid_namespace);
 	g_test_add_func("/valid_source_tag/valid", test_valid_source_tag);
 	g_test_add_func("/valid_source_tag/invalid", test_invalid_source_tag);
-	g_test_add_func("/build_spool_path/path", test_build_spool_path);
+	g_test_add_func("/valid_source_tag/scan", test_scan_source_tag);
+	g_test_add_func("/open_spool_dir/path", test_open_spool_dir);
+	g_test_add_func("/serialise_marquise_source/serialise", test_serialise_marquise_source);
+	g_test_add_func("/marquise_source_builder/build", test_source_builder);
+	g_test_add_func("/marquise_source/caller_built", test_caller_built_source);
 	return g_test_run();
 }